@@ -0,0 +1,60 @@
+/*
+ *  Timing and file loading helpers shared by the benchmarks
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+/* Wall clock seconds, for timing a run */
+double bench_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Reads a whole file into a malloc'd, NUL terminated buffer. Returns NULL on error. */
+char *bench_load_file(const char *file, long *length)
+{
+    FILE *fp;
+    char *buf;
+
+    fp = fopen(file, "rb");
+    if(fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    *length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf = malloc(*length + 1);
+    if(buf && (fread(buf, 1, *length, fp) != (size_t)*length))
+    {
+        free(buf);
+        buf = NULL;
+    }
+    if(buf)
+        buf[*length] = '\0';
+    fclose(fp);
+
+    return buf;
+}
+
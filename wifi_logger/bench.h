@@ -0,0 +1,27 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Shared by the benchmarks built with 'make bench' */
+double bench_now(void);
+char *bench_load_file(const char *file, long *length);
+
+#endif
+
@@ -18,140 +18,550 @@
 #include "gps.h"
 
 #include "serial.h"
+#include "nmea.h"
+#include "ubx.h"
+#include "replay.h"
+#include "monotonic.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 
-#define ASCIIHEX_TO_UINT(x)         ( ((x) > '9') ? (x-55):(x-48) )
+typedef struct
+{
+    const char *type;           /* Sentence type, without the talker ID */
+    int min_fields;
+    int time_field;             /* Field holding the UTC time, or 0 if the sentence has none */
+    void (*decode)(gps_t *fix, const nmea_field_t *f, int count);
+} nmea_handler_t;
+
+static int64_t parse_time(const char *str);
+static int64_t fix_clock(const gps_t *gps);
+static int64_t replay_due(const gps_t *gps);
+static bool replay_wait(int timeout);
+static int gps_update_nmea(gps_t *gps, int timeout);
+static int gps_update_ubx(gps_t *gps, int timeout);
+static bool nmea_process(gps_t *gps, const char *buf, int length);
+static bool nmea_last_part(const nmea_handler_t *handler, const nmea_field_t *f);
+static void nmea_emit(gps_t *gps);
+static void nmea_reset(void);
+static void nmea_rmc(gps_t *fix, const nmea_field_t *f, int count);
+static void nmea_gga(gps_t *fix, const nmea_field_t *f, int count);
+static void nmea_gsa(gps_t *fix, const nmea_field_t *f, int count);
+static void nmea_gsv(gps_t *fix, const nmea_field_t *f, int count);
+static void nmea_vtg(gps_t *fix, const nmea_field_t *f, int count);
+static void ubx_process(gps_t *gps);
+
+/* Talker IDs accepted: GPS, multi-GNSS, GLONASS, Galileo, BeiDou and QZSS */
+static const char talkers[][3] = { "GP", "GN", "GL", "GA", "GB", "BD", "GQ" };
 
-static bool nmea_process(gps_t *gps, char *string);
-static uint8_t nmea_checksum(const char *string);
-static bool nmea_validate(char *string);
+#define CYCLE_RELEARN   3   /* Epochs in a row that miss the cycle end before it's learnt again */
+
+static const nmea_handler_t handlers[] = 
+{
+    { "RMC", 10, 1, nmea_rmc },
+    { "GGA", 10, 1, nmea_gga },
+    { "GSA", 18, 0, nmea_gsa },
+    { "GSV", 4,  0, nmea_gsv },
+    { "VTG", 8,  0, nmea_vtg },
+};
 
-static FILE *input;
 static bool readlog;
+static int64_t replay_start, replay_end;
+static bool replay_dated;           /* The log's RMC sentences give dates, so the window can be seeked */
+
+/* Replay clock: monotonic time at which the fix stamped clock_utc was replayed,
+ * and a decoded fix being held back until it is due */
+static int replay_speed;
+static bool clock_started, clock_dated;
+static int64_t clock_origin, clock_utc;
+static bool held;
+static gps_t held_fix;
+static int64_t held_due;
+static int protocol;
 static int id;
 
-int gps_init(const char *dev, int baud)
+/* Epoch being assembled, and the sentence type (talker and handler) that has been seen to close an epoch */
+static gps_t epoch;
+static bool epoch_open, epoch_rmc, epoch_gga;
+static int last_type, cycle_end, missed;
+
+/* A fix completed by the same sentence as the one before it, returned by the next update */
+static bool queued;
+static gps_t queued_fix;
+
+/* UBX decoder, the bytes read but not yet decoded, and the latest NAV-DOP */
+static ubx_parser_t ubx;
+static const uint8_t *pending;
+static int pending_length;
+static uint32_t dop_itow;
+static int dop_hdop = -1;
+
+int gps_init(const gps_config_t *config)
 {
     int result = 0;
-    readlog = (baud == GPS_LOGFILE) ? true : false;
+    readlog = (config->baud == GPS_LOGFILE) ? true : false;
+    protocol = config->protocol;
     
     if(readlog)
     {       
-        input = fopen(dev, "r");
-        if(input == NULL)
-        {
-	        printf("loading %s logfile failed\n", dev); 
-	        result = -1;
-        }
+        result = replay_open(config->dev);
     }
     else
     {
-        result = serial_init(dev, baud, false);
+        result = serial_init(config->dev, config->baud, false, config->strict_baud);
     }
     
     id = 0;
+    nmea_reset();
+    last_type = cycle_end = -1;
+    missed = 0;
+    queued = false;
+    ubx_init(&ubx);
+    pending_length = 0;
+    dop_hdop = -1;
+    replay_start = replay_end = -1;
+    replay_speed = config->replay_speed;
+    clock_started = false;
+    held = false;
+    
+    /* Optional replay window */
+    if((result == 0) && readlog && (config->replay_start || config->replay_end))
+    {
+        if(protocol != GPS_NMEA)
+        {
+            printf("Replay windows are only supported for NMEA logs\n");
+            return -1;
+        }
+        if(config->replay_start && ((replay_start = parse_time(config->replay_start)) < 0))
+        {
+            printf("Can't parse ReplayStart '%s'\n", config->replay_start);
+            return -1;
+        }
+        if(config->replay_end && ((replay_end = parse_time(config->replay_end)) < 0))
+        {
+            printf("Can't parse ReplayEnd '%s'\n", config->replay_end);
+            return -1;
+        }
+        
+        /* A log without dates can't be seeked by UTC, so its window is applied to each fix's time of day */
+        replay_dated = (replay_first_time() >= 0);
+        if(replay_dated && (replay_start >= 0) && (replay_seek(replay_start) < 0))
+            printf("%s has nothing after %s\n", config->dev, config->replay_start);
+    }
+    
     return result;
 }
 
 void gps_close(void)
 {
     if(readlog)
-    {
-        if(input)
-        {
-            fclose(input);
-            input = NULL;
-        }
-    }
+        replay_close();
     else
         serial_close();        
 }
 
-int gps_update(gps_t *gps)
+/*
+ * Reads and decodes the next sentence (or UBX frame). gps->valid is set only
+ * by the call that completes a valid fix. A UART is waited on for up to 
+ * timeout ms (-1 forever); returns 0 if nothing arrived, -1 on error or at
+ * the end of a replayed log.
+ */
+int gps_update(gps_t *gps, int timeout)
 {
-    char data[200];
     int result;
     
-    if(readlog)
+    gps->valid = false;
+    
+    /* A paced replay returns nothing else until the held fix is released */
+    if(held)
     {
-        char *ret;
-        ret = fgets(data, sizeof(data) - 1, input);
-        result = (ret) ? 0 : -1;
-	}
-	else
-	{        
-        result = serial_readline(data);
+        if(!replay_wait(timeout))
+            return 0;
+        held = false;
+        *gps = held_fix;
+        gps->received = monotonic_ms();
+        return 1;
     }
     
-    if(result >= 0)
+    if(protocol == GPS_UBX)
+        result = gps_update_ubx(gps, timeout);
+    else
+        result = gps_update_nmea(gps, timeout);
+    
+    /* A replay window ends at the first fix past it */
+    if(gps->valid && (replay_end >= 0) && (fix_clock(gps) > (gps->date ? replay_end : replay_end % 86400000)))
     {
-        nmea_process(gps, data);  
+        gps->valid = false;
+        result = -1;
     }
+    if(gps->valid && !replay_dated && (replay_start >= 0) && (gps->time < replay_start % 86400000))
+        gps->valid = false;
+    
+    if(gps->valid && readlog && (replay_speed > 0))
+    {
+        held_fix = *gps;
+        held_due = replay_due(gps);
+        held = !replay_wait(timeout);
+        gps->valid = !held;
+    }
+    if(gps->valid)
+        gps->received = monotonic_ms();
     
     return result;
 }
 
+/* Converts an NMEA ddmmyy date and a time of day in ms into ms since the Unix epoch */
+int64_t gps_utc(int32_t date, int32_t time)
+{
+    int day = date / 10000, month = (date / 100) % 100, year = date % 100;
+    int64_t days;
+    int era, yoe, doy;
+    
+    /* Two digit years: 1980-2079 */
+    year += (year < 80) ? 2000 : 1900;
+    
+    /* Days from civil (proleptic Gregorian) */
+    year -= (month <= 2);
+    era = year / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+    days = (int64_t)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    
+    return days * 86400000 + time;
+}
+
 /*
  * Private functions
  */
 
-static bool nmea_process(gps_t *gps, char *string)
+/*
+ * Parses "YYYY-MM-DD HH:MM:SS[.sss]" (UTC) into ms since the Unix epoch. A bare
+ * "HH:MM:SS[.sss]" is taken to be on the first day of the log, or is just a
+ * time of day if the log has no dates. Returns -1 if it's neither.
+ */
+static int64_t parse_time(const char *str)
+{
+    int year, month, day, hour, min;
+    float sec;
+    int64_t first;
+    
+    if(sscanf(str, "%d-%d-%d %d:%d:%f", &year, &month, &day, &hour, &min, &sec) == 6)
+        return gps_utc(day * 10000 + month * 100 + year % 100, ((hour * 60 + min) * 60) * 1000 + (int)(sec * 1000));
+    
+    if(sscanf(str, "%d:%d:%f", &hour, &min, &sec) == 3)
+    {
+        first = replay_first_time();
+        if(first < 0)
+            first = 0;
+        return first - first % 86400000 + ((hour * 60 + min) * 60) * 1000 + (int)(sec * 1000);
+    }
+    
+    return -1;
+}
+
+/* A fix's UTC time in ms since the Unix epoch, or just its time of day if it has no date (no RMC) */
+static int64_t fix_clock(const gps_t *gps)
+{
+    return gps->date ? gps_utc(gps->date, gps->time) : gps->time;
+}
+
+/*
+ * Returns the monotonic time at which a replayed fix is due: its GPS timestamp
+ * relative to the first fix, scaled by replay_speed. The clock re-anchors if
+ * time runs backwards, or switches between dated fixes and ones with only a
+ * time of day.
+ */
+static int64_t replay_due(const gps_t *gps)
 {
-    bool valid;
+    int64_t utc = fix_clock(gps);
+    
+    if(!clock_started || (utc < clock_utc) || (clock_dated != (gps->date != 0)))
+    {
+        clock_origin = monotonic_ms();
+        clock_utc = utc;
+        clock_dated = (gps->date != 0);
+        clock_started = true;
+    }
+    
+    return clock_origin + (utc - clock_utc) / replay_speed;
+}
+
+/* Sleeps until the held fix is due, but no longer than timeout ms (-1 forever). Returns true once due. */
+static bool replay_wait(int timeout)
+{
+    int64_t now = monotonic_ms(), wait = held_due - now;
+    
+    if(wait <= 0)
+        return true;
+    if((timeout >= 0) && (timeout < wait))
+    {
+        usleep(timeout * 1000);
+        return false;
+    }
+    
+    usleep(wait * 1000);
+    return true;
+}
+
+/* Processes one NMEA sentence */
+static int gps_update_nmea(gps_t *gps, int timeout)
+{
+    const char *line;
+    int result;
+    
+    if(queued)
+    {
+        queued = false;
+        *gps = queued_fix;
+        return 1;
+    }
+    
+    if(readlog)
+        result = replay_readline(&line);
+    else
+        result = serial_readline(&line, timeout);
+    
+    if(result > 0)
+    {
+        nmea_process(gps, line, result);
+    }
+    
+    return result;
+}
+
+/* Decodes buffered UBX bytes up to the end of the next frame, reading more if there are none */
+static int gps_update_ubx(gps_t *gps, int timeout)
+{
+    bool complete;
+    int result;
+    
+    if(pending_length == 0)
+    {
+        const char *data;
+        
+        if(readlog)
+            result = replay_read(&data);
+        else
+            result = serial_read(&data, timeout);
+        if(result <= 0)
+            return result;
+        pending = (const uint8_t *)data;
+        pending_length = result;
+    }
+    
+    result = ubx_feed(&ubx, pending, pending_length, &complete);
+    pending += result;
+    pending_length -= result;
+    
+    if(complete)
+        ubx_process(gps);
+    
+    return result;
+}
+
+/*
+ * Sentences are folded into the current epoch until it completes. An epoch
+ * completes when a sentence carries a different UTC time; the last sentence
+ * type before that boundary (timed or not, and the last part of a GSV group)
+ * is then remembered as the end of the receiver's cycle, so later epochs are
+ * emitted as soon as it arrives. An epoch whose cycle end goes missing is
+ * still emitted at the next boundary if it has a position. Receivers send
+ * untimed sentences (GSA, GSV) after a timed one of their epoch, so those
+ * arriving with no epoch open are left over from one already emitted, and
+ * are dropped rather than folded into the next. gps->valid is only set on
+ * the call that emits a fix. A sentence that ends one epoch and is learnt as
+ * the cycle end (an RMC-only stream, say) completes two; the second is queued
+ * for the next call.
+ */
+static bool nmea_process(gps_t *gps, const char *buf, int length)
+{
+    nmea_sentence_t sentence;
+    const nmea_field_t *f = sentence.field;
+    const nmea_handler_t *handler = NULL;
+    int i, count, talker, type;
+    bool emitted = false;
     
-    valid = nmea_validate(string);
     gps->valid = false;
     
-    /* Check for GPRMC message */
-    if(valid && (strncmp(string, "$GPRMC", 6) == 0))
+    count = nmea_tokenize(buf, length, &sentence);
+    if((count < 0) || (f[0].length != 5))
+        return false;
+    
+    for(i = 0; i < (int)(sizeof(talkers) / sizeof(talkers[0])); i++)
+    {
+        if(memcmp(f[0].start, talkers[i], 2) == 0)
+            break;
+    }
+    if(i == (int)(sizeof(talkers) / sizeof(talkers[0])))
+        return true;
+    talker = i;
+    
+    for(i = 0; i < (int)(sizeof(handlers) / sizeof(handlers[0])); i++)
     {
-        strcpy(gps->str, string);
+        if(memcmp(f[0].start + 2, handlers[i].type, 3) == 0)
+        {
+            handler = &handlers[i];
+            break;
+        }
+    }
+    if((handler == NULL) || (count < handler->min_fields))
+        return true;
+    type = talker * (int)(sizeof(handlers) / sizeof(handlers[0])) + i;
+    
+    if(handler->time_field && (f[handler->time_field].length > 0))
+    {
+        int32_t time = nmea_field_time(&f[handler->time_field]);
         
-        char a;
-        sscanf(string, "$GPRMC,%f,%c,%f,%c,%f,%c", &gps->time, &a, &gps->latitude, &gps->latitude_dir, &gps->longitude, &gps->longitude_dir);
-        gps->valid = (a == 'A') ? true : false;
-        gps->id = id++;
+        if(epoch_open && (time != epoch.time))
+        {
+            /* New epoch, so the previous one is over without its cycle end being seen */
+            if(cycle_end < 0)
+                cycle_end = last_type;
+            else if(++missed >= CYCLE_RELEARN)
+            {
+                cycle_end = last_type;
+                missed = 0;
+            }
+            if(epoch_rmc || epoch_gga)
+            {
+                nmea_emit(gps);
+                emitted = true;
+            }
+            nmea_reset();
+        }
+        
+        if(!epoch_open)
+        {
+            epoch.time = time;
+            epoch_open = true;
+        }
+    }
+    else if(!epoch_open)
+        return true;
+    
+    handler->decode(&epoch, f, count);
+    if(nmea_last_part(handler, f))
+        last_type = type;
+    
+    if((type == cycle_end) && nmea_last_part(handler, f))
+    {
+        missed = 0;
+        nmea_emit(emitted ? &queued_fix : gps);
+        queued = emitted;
+        nmea_reset();
     }
     
-    return valid;
+    return true;
 }
 
-static uint8_t nmea_checksum(const char *string)
+/* Whether a sentence completes its group: only GSV is split over several messages */
+static bool nmea_last_part(const nmea_handler_t *handler, const nmea_field_t *f)
 {
-	uint8_t checksum = 0, tmp;
-	
-	while(*string)
-	{
-		if(*string == '*')
-		    break;
-		else if(*string == '$')
-		    tmp = *string++;
-		else
-		    checksum ^= *string++;
-	}	
+    if(handler->decode != nmea_gsv)
+        return true;
+    return nmea_field_fixed(&f[2], 0) >= nmea_field_fixed(&f[1], 0);
+}
 
-	return checksum;
-} 
+static void nmea_emit(gps_t *gps)
+{
+    *gps = epoch;
+    gps->id = id++;
+}
 
-static bool nmea_validate(char *string)
+static void nmea_reset(void)
 {
-	uint8_t checksum1;
-	int i;
-	char *pch;
-	
-	pch = strchr(string, '*');
-    i = pch - string + 1;
-	
-	checksum1 = (ASCIIHEX_TO_UINT(string[i]) << 4) + ASCIIHEX_TO_UINT(string[i+1]);
+    memset(&epoch, 0, sizeof(epoch));
+    epoch_open = epoch_rmc = epoch_gga = false;
+}
 
-	uint8_t checksum2 = nmea_checksum(string);
-	if(checksum1 == checksum2)
-		return true;
-	else
-		return false;
+static void nmea_rmc(gps_t *fix, const nmea_field_t *f, int count)
+{
+    fix->valid = (nmea_field_char(&f[2]) == 'A') ? true : false;
+    fix->latitude = nmea_field_coord(&f[3], &f[4]);
+    fix->longitude = nmea_field_coord(&f[5], &f[6]);
+    /* Knots to mm/s */
+    fix->speed = nmea_field_fixed(&f[7], 3) * 1852 / 3600;
+    fix->course = nmea_field_fixed(&f[8], 2);
+    fix->date = nmea_field_fixed(&f[9], 0);
+    epoch_rmc = true;
+}
+
+static void nmea_gga(gps_t *fix, const nmea_field_t *f, int count)
+{
+    /* RMC's status is authoritative when both are present */
+    if(!epoch_rmc)
+        fix->valid = (nmea_field_fixed(&f[6], 0) > 0) ? true : false;
+    fix->latitude = nmea_field_coord(&f[2], &f[3]);
+    fix->longitude = nmea_field_coord(&f[4], &f[5]);
+    fix->satellites = nmea_field_fixed(&f[7], 0);
+    fix->hdop = nmea_field_fixed(&f[8], 2);
+    fix->altitude = nmea_field_fixed(&f[9], 3);
+    epoch_gga = true;
 }
 
+static void nmea_gsa(gps_t *fix, const nmea_field_t *f, int count)
+{
+    int i, used = 0;
+    
+    /* GGA's counts are authoritative. Otherwise add up the per-constellation 
+     * GSA sentences that multi-GNSS receivers send */
+    if(epoch_gga)
+        return;
+    
+    for(i = 3; i <= 14; i++)
+    {
+        if(f[i].length > 0)
+            used++;
+    }
+    fix->satellites += used;
+    fix->hdop = nmea_field_fixed(&f[16], 2);
+}
+
+static void nmea_gsv(gps_t *fix, const nmea_field_t *f, int count)
+{
+    /* Count each talker's satellites once, from the first message of its group */
+    if(nmea_field_fixed(&f[2], 0) == 1)
+        fix->satellites_in_view += nmea_field_fixed(&f[3], 0);
+}
+
+static void nmea_vtg(gps_t *fix, const nmea_field_t *f, int count)
+{
+    fix->course = nmea_field_fixed(&f[1], 2);
+    /* km/h to mm/s */
+    fix->speed = nmea_field_fixed(&f[7], 3) * 10 / 36;
+}
+
+static void ubx_process(gps_t *gps)
+{
+    ubx_nav_pvt_t pvt;
+    
+    if(ubx_nav_dop(&ubx, &dop_itow, &dop_hdop))
+        return;
+    
+    if(ubx_nav_pvt(&ubx, &pvt))
+    {
+        gps_t fix;
+        
+        memset(&fix, 0, sizeof(fix));
+        fix.time = ((pvt.hour * 60 + pvt.min) * 60 + pvt.sec) * 1000 + pvt.nano / 1000000;
+        if(fix.time < 0)
+            fix.time += 24 * 60 * 60 * 1000;
+        fix.date = pvt.day * 10000 + pvt.month * 100 + pvt.year % 100;
+        /* 2D, 3D or GNSS + dead reckoning */
+        fix.valid = pvt.fix_ok && pvt.valid_time && (pvt.fix_type >= 2) && (pvt.fix_type <= 4);
+        fix.latitude = pvt.lat;
+        fix.longitude = pvt.lon;
+        fix.altitude = pvt.height_msl;
+        fix.speed = pvt.ground_speed;
+        fix.course = pvt.heading / 1000;
+        fix.satellites = pvt.num_sv;
+        /* NAV-PVT only has PDOP; prefer HDOP from a NAV-DOP of the same epoch */
+        fix.hdop = ((dop_hdop >= 0) && (dop_itow == pvt.itow)) ? dop_hdop : pvt.pdop;
+        
+        *gps = fix;
+        gps->id = id++;
+    }
+}
@@ -19,24 +19,51 @@
 #define GPS_H
 
 #include <stdbool.h>
+#include <inttypes.h>
 
 #define GPS_LOGFILE     0
 
+/* Input protocols */
+#define GPS_NMEA        0
+#define GPS_UBX         1
+
+/* Coordinates are fixed-point degrees scaled by GPS_COORD_SCALE (1e-7 degree, ~1 cm) */
+#define GPS_COORD_SCALE         10000000
+#define GPS_COORD_TO_DEG(x)     ((double)(x) / GPS_COORD_SCALE)
+
+/* One fix, folded together from every sentence of a single receiver epoch */
 typedef struct
 {
-    char str[50];
-    float time;
+    int32_t time;           /* UTC time of fix, milliseconds since midnight */
+    int32_t date;           /* UTC date as ddmmyy, 0 if no RMC was seen */
     int id;
     bool valid;
-    float latitude;
-    char latitude_dir;
-    float longitude;
-    char longitude_dir;
+    int32_t latitude;       /* Positive north */
+    int32_t longitude;      /* Positive east */
+    int32_t altitude;       /* Millimetres above mean sea level */
+    int32_t speed;          /* Speed over ground, millimetres per second */
+    int32_t course;         /* Course over ground, 1e-2 degrees from true north */
+    int hdop;               /* Horizontal dilution of precision, x100 */
+    int satellites;         /* Satellites used in the fix */
+    int satellites_in_view;
+    int64_t received;       /* Monotonic ms at which the fix was completed */
 } gps_t;
 
-int gps_init(const char *dev, int baud);
+typedef struct
+{
+    const char *dev;        /* UART device, or a recorded log file when baud is GPS_LOGFILE */
+    int baud;
+    bool strict_baud;       /* Fail rather than fall back when the UART can't run at baud */
+    int protocol;           /* GPS_NMEA or GPS_UBX (NAV-PVT, optionally with NAV-DOP) */
+    const char *replay_start;   /* Optional replay window for NMEA log files, */
+    const char *replay_end;     /* as "YYYY-MM-DD HH:MM:SS" or "HH:MM:SS" UTC */
+    int replay_speed;       /* Log files are replayed at this multiple of real time, or flat out if 0 */
+} gps_config_t;
+
+int gps_init(const gps_config_t *config);
 void gps_close(void);
-int gps_update(gps_t *gps);
+int gps_update(gps_t *gps, int timeout);
+int64_t gps_utc(int32_t date, int32_t time);
 
 #endif
 
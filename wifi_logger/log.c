@@ -0,0 +1,1301 @@
+/*
+ *  Text and compact binary log output, and a streaming reader for the binary logs
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "gps.h"
+#include "monotonic.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define HEADER_FIXED        16      /* Header up to the schema */
+#define HEADER_FIXED_V1     12
+#define BLOCK_HEADER        16
+#define VARINT_MAX          10      /* Bytes in the longest 64 bit varint */
+#define RECORD_HEADER       2       /* kind, length */
+#define NAME_CACHE          256     /* BSSIDs remembered as already named, a power of two */
+
+/* The sample layout this logger writes */
+static const struct
+{
+    uint8_t id;
+    uint8_t type;
+    uint8_t size;
+} schema[] = 
+{
+    {LOG_FIELD_TIME, LOG_INT, 8},
+    {LOG_FIELD_LATITUDE, LOG_INT, 4},
+    {LOG_FIELD_LONGITUDE, LOG_INT, 4},
+    {LOG_FIELD_BSSID, LOG_BYTES, 6},
+    {LOG_FIELD_QUALITY, LOG_UINT, 1},
+    {LOG_FIELD_SIGNAL, LOG_INT, 1},
+    {LOG_FIELD_NOISE, LOG_INT, 1},
+    {LOG_FIELD_CHANNEL, LOG_UINT, 1},
+    {LOG_FIELD_RADIO, LOG_UINT, 1},
+};
+#define SCHEMA_FIELDS       (int)(sizeof(schema) / sizeof(schema[0]))
+
+static void put_le(unsigned char *p, uint64_t value, int size);
+static uint64_t get_le(const unsigned char *p, int size);
+static int64_t get_field(const log_sample_t *sample, int id);
+static void set_field(log_sample_t *sample, int id, int64_t value);
+static int write_record(int kind, const void *data, int length);
+static int name_bssid(const unsigned char *bssid, const char *essid);
+static int reader_name(log_reader_t *reader, const unsigned char *bssid, const char *essid, int length);
+static const char *reader_essid(const log_reader_t *reader, const unsigned char *bssid);
+static unsigned int bssid_hash(const unsigned char *bssid);
+static int64_t clamp_field(int i, int64_t value);
+static int block_add(const log_sample_t *sample, const char *essid, const char *radio);
+static int block_flush(void);
+static int read_block(log_reader_t *reader);
+static int decode_sample(log_reader_t *reader, log_entry_t *entry);
+static unsigned char *put_varint(unsigned char *p, uint64_t value);
+static int get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value);
+static int find_commits(log_reader_t *reader, long header_length);
+static size_t reader_read(log_reader_t *reader, void *buf, size_t length);
+static void reader_back(log_reader_t *reader, long length);
+static int segment_open(void);
+static int segment_close(void);
+static bool segment_full(const log_sample_t *sample);
+static void segment_name(char *buf, int size, const char *file, int number);
+static int segment_last(const char *file);
+static void index_add(const log_sample_t *sample);
+static int write_index(void);
+static void read_index(log_reader_t *reader, long start);
+static int output(const void *data, int length);
+
+static log_config_t settings;
+static bool opened;
+static bool commits;                /* Batches are followed by trailers */
+static int format;
+static int flush_interval;
+static int64_t block_started;       /* When the block being gathered got its first sample */
+static int sample_length;
+static log_name_t named[NAME_CACHE];
+static bool radio_named[256];
+
+/* The block being gathered, for LOG_COMPRESSED */
+static unsigned char block[LOG_BLOCK_SIZE];
+static int block_length;
+static unsigned long block_samples;
+static log_name_t block_names[LOG_BLOCK_BSSIDS];
+static int block_name_count;
+static bool block_radios[256];
+static char radio_names[256][LOG_RADIO_NAME_MAX + 1];
+static int64_t previous[LOG_MAX_FIELDS];
+
+/* The segment being written, when the log is split into segments */
+static int segment;                 /* Its number, 0 if the log isn't split */
+static char segment_file[256];
+static long segment_bytes;
+static log_index_t segment_index;
+
+/* 
+ * Creates the log file, or its first segment when it's split into segments,
+ * numbered on from the highest an earlier run left. Returns 0, or -1 on error.
+ */
+int log_open(const log_config_t *config)
+{
+    settings = *config;
+    format = config->format;
+    flush_interval = config->flush_interval;
+    if((format == LOG_TEXT) && (config->preallocate > 0))
+        printf("Preallocated logs need a binary format, appending instead\n");
+    
+    segment = 0;
+    if((config->segment_size > 0) || (config->segment_duration > 0))
+    {
+        /* Only a binary segment can carry the index that lets log_convert pass over it */
+        if(format == LOG_TEXT)
+        {
+            printf("Log segments need a binary format (SegmentSize and SegmentDuration can't be used with text)\n");
+            return -1;
+        }
+        /* Not the first free number: the segments after it would overwrite the earlier run's */
+        segment = segment_last(config->file) + 1;
+        segment_name(segment_file, sizeof(segment_file), config->file, segment);
+    }
+    
+    return segment_open();
+}
+
+/* Creates a log file, writing the header and schema for a binary log. Returns 0, or -1 on error. */
+static int segment_open(void)
+{
+    unsigned char header[HEADER_FIXED + 4 * SCHEMA_FIELDS];
+    writer_config_t writer;
+    int i;
+    
+    block_started = 0;
+    segment_bytes = 0;
+    memset(&segment_index, 0, sizeof(segment_index));
+    writer.file = segment ? segment_file : settings.file;
+    writer.flush_size = settings.flush_size;
+    writer.preallocate = (format != LOG_TEXT) ? settings.preallocate : 0;
+    writer.trailer = commits = (format != LOG_TEXT) && (writer.preallocate == 0);
+    if(writer_open(&writer) < 0)
+        return -1;
+    opened = true;
+    if(segment)
+        printf("Logging to %s\n", segment_file);
+
+    memset(named, 0, sizeof(named));
+    memset(radio_named, 0, sizeof(radio_named));
+    block_length = block_samples = block_name_count = 0;
+    memset(block_radios, 0, sizeof(block_radios));
+    memset(previous, 0, sizeof(previous));
+    if(format == LOG_TEXT)
+        return 0;
+    
+    sample_length = 0;
+    for(i = 0; i < SCHEMA_FIELDS; i++)
+    {
+        unsigned char *field = header + HEADER_FIXED + 4 * i;
+        field[0] = schema[i].id;
+        field[1] = schema[i].type;
+        field[2] = schema[i].size;
+        field[3] = 0;
+        sample_length += schema[i].size;
+    }
+    put_le(header, LOG_MAGIC, 4);
+    put_le(header + 4, LOG_VERSION, 2);
+    put_le(header + 6, sizeof(header), 2);
+    put_le(header + 8, sample_length, 2);
+    put_le(header + 10, SCHEMA_FIELDS, 2);
+    put_le(header + 12, (commits ? LOG_FLAG_COMMITS : 0) | ((format == LOG_COMPRESSED) ? LOG_FLAG_BLOCKS : 0), 2);
+    put_le(header + 14, 0, 2);
+    
+    return output(header, sizeof(header));
+}
+
+void log_close(void)
+{
+    segment_close();
+}
+
+/* 
+ * Writes out any partly gathered block and the index, and closes the log file
+ * once everything is synced. Returns 0, or -1 if the last writes failed.
+ */
+static int segment_close(void)
+{
+    int result = 0;
+    
+    if(opened && (format == LOG_COMPRESSED) && (block_flush() < 0))
+        result = -1;
+    if(opened && (format != LOG_TEXT) && (write_index() < 0))
+        result = -1;
+    writer_close();
+    opened = false;
+    
+    return result;
+}
+
+/* 
+ * Whether sample should start a new segment. Durations are measured in sample
+ * time, which keeps the clock out of the logging path. A preallocated segment
+ * has to keep room for a last block and the index.
+ */
+static bool segment_full(const log_sample_t *sample)
+{
+    long limit = settings.segment_size;
+    
+    if(segment_index.samples == 0)
+        return false;
+    if((format != LOG_TEXT) && (settings.preallocate > 0))
+    {
+        long room = settings.preallocate - LOG_MAP_HEADER - 2 * WRITER_MAX_WRITE;
+        if((limit == 0) || (limit > room))
+            limit = room;
+    }
+    if((limit > 0) && (segment_bytes + block_length >= limit))
+        return true;
+    
+    return (settings.segment_duration > 0) && (sample->time - segment_index.first >= settings.segment_duration);
+}
+
+/* log.wlog becomes log.0001.wlog: the number goes before the extension, if there is one */
+static void segment_name(char *buf, int size, const char *file, int number)
+{
+    const char *dot = strrchr(file, '.'), *slash = strrchr(file, '/');
+    
+    if((dot == NULL) || (slash && (dot < slash)))
+        dot = file + strlen(file);
+    snprintf(buf, size, "%.*s.%04d%s", (int)(dot - file), file, number, dot);
+}
+
+/* The highest segment number of file already on disk, or 0 if there are none */
+static int segment_last(const char *file)
+{
+    const char *slash = strrchr(file, '/'), *base = slash ? slash + 1 : file;
+    const char *ext = strrchr(base, '.');
+    char dir[256];
+    int stem, last = 0;
+    struct dirent *entry;
+    DIR *d;
+    
+    if(ext == NULL)
+        ext = base + strlen(base);
+    stem = ext - base;
+    if(slash)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - file + 1), file);
+    else
+        strcpy(dir, ".");
+    
+    d = opendir(dir);
+    if(d == NULL)
+        return 0;
+    while((entry = readdir(d)) != NULL)
+    {
+        const char *name = entry->d_name, *p = name + stem + 1;
+        int number = 0;
+        
+        /* <stem>.<digits><ext>, as segment_name makes them */
+        if((strncmp(name, base, stem) != 0) || (name[stem] != '.') || (*p < '0') || (*p > '9'))
+            continue;
+        while((*p >= '0') && (*p <= '9'))
+            number = number * 10 + (*p++ - '0');
+        if((strcmp(p, ext) == 0) && (number > last))
+            last = number;
+    }
+    closedir(d);
+    
+    return last;
+}
+
+static void index_add(const log_sample_t *sample)
+{
+    log_index_t *index = &segment_index;
+    
+    if(index->samples++ == 0)
+    {
+        index->first = sample->time;
+        index->south = index->north = sample->latitude;
+        index->west = index->east = sample->longitude;
+    }
+    index->last = sample->time;
+    if(sample->latitude < index->south)
+        index->south = sample->latitude;
+    if(sample->latitude > index->north)
+        index->north = sample->latitude;
+    if(sample->longitude < index->west)
+        index->west = sample->longitude;
+    if(sample->longitude > index->east)
+        index->east = sample->longitude;
+}
+
+static int write_index(void)
+{
+    unsigned char index[LOG_INDEX_LENGTH];
+    
+    put_le(index, LOG_INDEX_MAGIC, 4);
+    put_le(index + 4, LOG_INDEX_LENGTH, 4);
+    put_le(index + 8, segment_index.first, 8);
+    put_le(index + 16, segment_index.last, 8);
+    put_le(index + 24, segment_index.south, 4);
+    put_le(index + 28, segment_index.west, 4);
+    put_le(index + 32, segment_index.north, 4);
+    put_le(index + 36, segment_index.east, 4);
+    put_le(index + 40, segment_index.samples, 4);
+    put_le(index + 44, log_crc32(index, 44), 4);
+    
+    return output(index, sizeof(index));
+}
+
+/* Everything for the file goes through here, so the segment's size is known */
+static int output(const void *data, int length)
+{
+    segment_bytes += length;
+    return writer_write(data, length);
+}
+
+/* 
+ * Flushes data that has waited flush_interval, so a quiet spell doesn't leave
+ * it in RAM indefinitely. Called from the logger's main loop. Returns the ms
+ * until it next needs calling, or -1 if nothing is waiting.
+ */
+int log_poll(void)
+{
+    int64_t now, oldest = writer_oldest();
+    
+    if(!opened || (flush_interval <= 0))
+        return -1;
+    if(block_started && ((oldest == 0) || (block_started < oldest)))
+        oldest = block_started;
+    if(oldest == 0)
+        return -1;
+    
+    now = monotonic_ms();
+    if(now - oldest < flush_interval)
+        return (int)(oldest + flush_interval - now);
+    
+    if(format == LOG_COMPRESSED)
+        block_flush();
+    writer_flush();
+    return -1;
+}
+
+void log_get_stats(writer_stats_t *stats)
+{
+    writer_get_stats(stats);
+}
+
+/* 
+ * Logs one sample. A binary log names the BSSID and radio the first time
+ * they're seen, so samples only carry the BSSID and radio index. Returns 0,
+ * or -1 if the write failed.
+ */
+int log_write(const log_sample_t *sample, const char *essid, const char *radio)
+{
+    unsigned char record[64];
+    int i, offset = 0;
+    
+    if(segment && segment_full(sample))
+    {
+        segment_close();
+        segment_name(segment_file, sizeof(segment_file), settings.file, ++segment);
+        segment_open();
+    }
+    if(!opened)
+        return -1;
+    index_add(sample);
+    
+    if(format == LOG_TEXT)
+    {
+        char line[180];
+        return output(line, log_format_text(line, sample, essid, radio));
+    }
+    if(format == LOG_COMPRESSED)
+        return block_add(sample, essid, radio);
+    
+    if(!radio_named[sample->radio & 0xFF])
+    {
+        int length = strlen(radio);
+        if(length > LOG_RADIO_NAME_MAX)
+            length = LOG_RADIO_NAME_MAX;
+        record[0] = sample->radio;
+        memcpy(record + 1, radio, length);
+        if(write_record(LOG_RECORD_RADIO, record, length + 1) < 0)
+            return -1;
+        radio_named[sample->radio & 0xFF] = true;
+    }
+    if(name_bssid(sample->bssid, essid) < 0)
+        return -1;
+    
+    for(i = 0; i < SCHEMA_FIELDS; i++)
+    {
+        if(schema[i].type == LOG_BYTES)
+            memcpy(record + offset, sample->bssid, schema[i].size);
+        else
+            put_le(record + offset, clamp_field(i, get_field(sample, schema[i].id)), schema[i].size);
+        offset += schema[i].size;
+    }
+    
+    return write_record(LOG_RECORD_SAMPLE, record, offset);
+}
+
+/* Formats a fixed-point coordinate as signed decimal degrees */
+int log_format_coord(char *buf, int32_t coord)
+{
+    uint32_t magnitude = (coord < 0) ? -(uint32_t)coord : (uint32_t)coord;
+    
+    return sprintf(buf, "%s%u.%07u", (coord < 0) ? "-" : "", 
+        magnitude / GPS_COORD_SCALE, magnitude % GPS_COORD_SCALE);
+}
+
+/* Formats a sample as a text log line, returning its length. line needs 180 bytes. */
+int log_format_text(char *line, const log_sample_t *sample, const char *essid, const char *radio)
+{
+    int32_t time = (int32_t)(sample->time % LOG_DAY_MS);
+    int n;
+    
+    /* Format: gps time (hhmmss.sss), scan quality, signal level, noise level, gps latitude, gps longitude (degrees),
+     * bssid, channel, radio (interface), essid (last, as it may contain spaces) */
+    n = sprintf(line, "%02d%02d%02d.%03d %d %d %d ", time / 3600000, (time / 60000) % 60, 
+        (time / 1000) % 60, time % 1000, sample->quality, sample->signal, sample->noise);
+    n += log_format_coord(line + n, sample->latitude);
+    line[n++] = ' ';
+    n += log_format_coord(line + n, sample->longitude);
+    n += sprintf(line + n, " %02X:%02X:%02X:%02X:%02X:%02X %d %.16s %.32s\n", sample->bssid[0], sample->bssid[1], 
+        sample->bssid[2], sample->bssid[3], sample->bssid[4], sample->bssid[5], sample->channel, radio, essid);
+    
+    return n;
+}
+
+/* Opens a binary log and reads its schema. Returns 0, or -1 if it isn't a log this reader understands. */
+int log_reader_open(log_reader_t *reader, const char *file)
+{
+    unsigned char header[HEADER_FIXED], field[4];
+    int header_length, version, i, offset = 0;
+    
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->committed = -1;
+    reader->fp = fopen(file, "rb");
+    if(reader->fp == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", file);
+        return -1;
+    }
+    
+    /* A preallocated log says how much of the file it has used */
+    if((fread(header, LOG_MAP_HEADER, 1, reader->fp) == 1) && (get_le(header, 4) == LOG_MAP_MAGIC))
+    {
+        reader->base = LOG_MAP_HEADER;
+        reader->committed = LOG_MAP_HEADER + get_le(header + 4, 4);
+    }
+    else
+        fseek(reader->fp, 0, SEEK_SET);
+    
+    if((fread(header, HEADER_FIXED_V1, 1, reader->fp) != 1) || (get_le(header, 4) != LOG_MAGIC))
+    {
+        fprintf(stderr, "%s is not a wifi_logger binary log\n", file);
+        log_reader_close(reader);
+        return -1;
+    }
+    version = get_le(header + 4, 2);
+    if(version > LOG_VERSION)
+    {
+        fprintf(stderr, "%s was written by a newer logger (version %d)\n", file, version);
+        log_reader_close(reader);
+        return -1;
+    }
+    if((version >= 2) && (fread(header + HEADER_FIXED_V1, HEADER_FIXED - HEADER_FIXED_V1, 1, reader->fp) != 1))
+    {
+        fprintf(stderr, "%s has a truncated header\n", file);
+        log_reader_close(reader);
+        return -1;
+    }
+    reader->flags = (version >= 2) ? get_le(header + 12, 2) : 0;
+    header_length = get_le(header + 6, 2);
+    reader->sample_length = get_le(header + 8, 2);
+    reader->field_count = get_le(header + 10, 2);
+    if((reader->field_count > LOG_MAX_FIELDS) || 
+        (header_length < ((version >= 2) ? HEADER_FIXED : HEADER_FIXED_V1) + 4 * reader->field_count))
+    {
+        fprintf(stderr, "%s has a malformed header\n", file);
+        log_reader_close(reader);
+        return -1;
+    }
+    
+    for(i = 0; i < reader->field_count; i++)
+    {
+        if(fread(field, sizeof(field), 1, reader->fp) != 1)
+        {
+            fprintf(stderr, "%s has a truncated header\n", file);
+            log_reader_close(reader);
+            return -1;
+        }
+        reader->fields[i].id = field[0];
+        reader->fields[i].type = field[1];
+        reader->fields[i].size = field[2];
+        reader->fields[i].offset = offset;
+        offset += field[2];
+    }
+    if(offset > reader->sample_length)
+    {
+        fprintf(stderr, "%s has a malformed schema\n", file);
+        log_reader_close(reader);
+        return -1;
+    }
+    /* Skip anything a later version appended to the header */
+    fseek(reader->fp, reader->base + header_length, SEEK_SET);
+    reader->pos = reader->base + header_length;
+    if((reader->flags & LOG_FLAG_COMMITS) && (find_commits(reader, header_length) < 0))
+    {
+        log_reader_close(reader);
+        return -1;
+    }
+    read_index(reader, reader->pos);
+    
+    return 0;
+}
+
+void log_reader_close(log_reader_t *reader)
+{
+    if(reader->fp)
+        fclose(reader->fp);
+    free(reader->names);
+    free(reader->block);
+    free(reader->trailers);
+    reader->fp = NULL;
+    reader->names = NULL;
+    reader->block = NULL;
+    reader->trailers = NULL;
+}
+
+/*
+ * Reads up to the next sample, taking in the names records before it.
+ * Returns 1 with entry filled in, 0 at the end of the log (including a record
+ * cut short by the logger stopping mid-write), or -1 on error.
+ */
+int log_read(log_reader_t *reader, log_entry_t *entry)
+{
+    unsigned char header[RECORD_HEADER], record[256];
+    
+    if(reader->flags & LOG_FLAG_BLOCKS)
+    {
+        while(1)
+        {
+            while(reader->block_samples == 0)
+            {
+                int result = read_block(reader);
+                if(result <= 0)
+                    return result;
+            }
+            /* A damaged block is dropped and the next one tried */
+            if(decode_sample(reader, entry) > 0)
+                return 1;
+        }
+    }
+    
+    while(reader_read(reader, header, sizeof(header)) == sizeof(header))
+    {
+        int i, length = header[1];
+        
+        if(reader_read(reader, record, length) != (size_t)length)
+        {
+            fprintf(stderr, "%s ends with a truncated record\n", reader->file);
+            return 0;
+        }
+        reader->records++;
+        
+        if(header[0] == LOG_RECORD_NAME)
+        {
+            if((length >= 6) && (reader_name(reader, record, (const char *)record + 6, length - 6) < 0))
+                return -1;
+        }
+        else if(header[0] == LOG_RECORD_RADIO)
+        {
+            if(length >= 1)
+            {
+                int name = (length - 1 > LOG_RADIO_NAME_MAX) ? LOG_RADIO_NAME_MAX : length - 1;
+                memcpy(reader->radios[record[0]], record + 1, name);
+                reader->radios[record[0]][name] = '\0';
+            }
+        }
+        else if((header[0] == LOG_RECORD_SAMPLE) && (length >= reader->sample_length))
+        {
+            memset(entry, 0, sizeof(*entry));
+            for(i = 0; i < reader->field_count; i++)
+            {
+                const unsigned char *p = record + reader->fields[i].offset;
+                int size = reader->fields[i].size;
+                int64_t value;
+                
+                if(reader->fields[i].type == LOG_BYTES)
+                {
+                    if((reader->fields[i].id == LOG_FIELD_BSSID) && (size == sizeof(entry->sample.bssid)))
+                        memcpy(entry->sample.bssid, p, size);
+                    continue;
+                }
+                if((size < 1) || (size > 8))
+                    continue;
+                value = get_le(p, size);
+                /* Sign extend */
+                if((reader->fields[i].type == LOG_INT) && (size < 8) && (value & ((int64_t)1 << (8 * size - 1))))
+                    value -= (int64_t)1 << (8 * size);
+                set_field(&entry->sample, reader->fields[i].id, value);
+            }
+            entry->essid = reader_essid(reader, entry->sample.bssid);
+            entry->radio = reader->radios[entry->sample.radio & 0xFF][0] ? reader->radios[entry->sample.radio & 0xFF] : "?";
+            return 1;
+        }
+        /* Anything else is from a later version, and skipped */
+    }
+    
+    return 0;
+}
+
+static void put_le(unsigned char *p, uint64_t value, int size)
+{
+    int i;
+    
+    for(i = 0; i < size; i++)
+        p[i] = value >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char *p, int size)
+{
+    uint64_t value = 0;
+    int i;
+    
+    for(i = size - 1; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static int64_t get_field(const log_sample_t *sample, int id)
+{
+    switch(id)
+    {
+        case LOG_FIELD_TIME: return sample->time;
+        case LOG_FIELD_LATITUDE: return sample->latitude;
+        case LOG_FIELD_LONGITUDE: return sample->longitude;
+        case LOG_FIELD_QUALITY: return sample->quality;
+        case LOG_FIELD_SIGNAL: return sample->signal;
+        case LOG_FIELD_NOISE: return sample->noise;
+        case LOG_FIELD_CHANNEL: return sample->channel;
+        case LOG_FIELD_RADIO: return sample->radio;
+    }
+    return 0;
+}
+
+/* Unknown ids are fields added by a later version, and ignored */
+static void set_field(log_sample_t *sample, int id, int64_t value)
+{
+    switch(id)
+    {
+        case LOG_FIELD_TIME: sample->time = value; break;
+        case LOG_FIELD_LATITUDE: sample->latitude = value; break;
+        case LOG_FIELD_LONGITUDE: sample->longitude = value; break;
+        case LOG_FIELD_QUALITY: sample->quality = value; break;
+        case LOG_FIELD_SIGNAL: sample->signal = value; break;
+        case LOG_FIELD_NOISE: sample->noise = value; break;
+        case LOG_FIELD_CHANNEL: sample->channel = value; break;
+        case LOG_FIELD_RADIO: sample->radio = value; break;
+    }
+}
+
+/* Fits a value to its field, single byte fields saturating rather than wrapping */
+static int64_t clamp_field(int i, int64_t value)
+{
+    if((schema[i].size == 1) && (schema[i].type == LOG_INT))
+        return (value < -128) ? -128 : (value > 127) ? 127 : value;
+    if((schema[i].size == 1) && (schema[i].type == LOG_UINT))
+        return (value < 0) ? 0 : (value > 255) ? 255 : value;
+    return value;
+}
+
+static int write_record(int kind, const void *data, int length)
+{
+    unsigned char record[RECORD_HEADER + 255];
+    
+    record[0] = kind;
+    record[1] = length;
+    memcpy(record + RECORD_HEADER, data, length);
+    return output(record, RECORD_HEADER + length);
+}
+
+static unsigned int bssid_hash(const unsigned char *bssid)
+{
+    /* The vendor OUI says little, the last three bytes vary most */
+    return (bssid[3] * 65599u + bssid[4]) * 65599u + bssid[5];
+}
+
+/* Writes a name record unless this BSSID was recently named with the same ESSID */
+static int name_bssid(const unsigned char *bssid, const char *essid)
+{
+    log_name_t *name = &named[bssid_hash(bssid) & (NAME_CACHE - 1)];
+    unsigned char record[6 + LOG_ESSID_MAX];
+    int length;
+    
+    if(name->used && (memcmp(name->bssid, bssid, 6) == 0) && (strcmp(name->essid, essid) == 0))
+        return 0;
+    
+    /* A BSSID pushed out of the cache is just named again the next time it's seen */
+    length = strlen(essid);
+    if(length > LOG_ESSID_MAX)
+        length = LOG_ESSID_MAX;
+    memcpy(record, bssid, 6);
+    memcpy(record + 6, essid, length);
+    if(write_record(LOG_RECORD_NAME, record, 6 + length) < 0)
+        return -1;
+    
+    memcpy(name->bssid, bssid, 6);
+    memcpy(name->essid, essid, length);
+    name->essid[length] = '\0';
+    name->used = true;
+    
+    return 0;
+}
+
+/* Records a BSSID's ESSID in the reader's table, growing it past half full. Returns 0, or -1 if out of memory. */
+static int reader_name(log_reader_t *reader, const unsigned char *bssid, const char *essid, int length)
+{
+    log_name_t *name;
+    unsigned int i;
+    
+    if(2 * (reader->name_count + 1) > reader->name_slots)
+    {
+        log_name_t *old = reader->names;
+        int old_slots = reader->name_slots, j;
+        
+        reader->name_slots = old_slots ? 2 * old_slots : 1024;
+        reader->names = calloc(reader->name_slots, sizeof(log_name_t));
+        if(reader->names == NULL)
+        {
+            fprintf(stderr, "Failed to allocate the BSSID table\n");
+            reader->names = old;
+            reader->name_slots = old_slots;
+            return -1;
+        }
+        reader->name_count = 0;
+        for(j = 0; j < old_slots; j++)
+        {
+            if(old[j].used)
+                reader_name(reader, old[j].bssid, old[j].essid, strlen(old[j].essid));
+        }
+        free(old);
+    }
+    
+    for(i = bssid_hash(bssid); ; i++)
+    {
+        name = &reader->names[i & (reader->name_slots - 1)];
+        if(!name->used || (memcmp(name->bssid, bssid, 6) == 0))
+            break;
+    }
+    if(!name->used)
+        reader->name_count++;
+    
+    if(length > LOG_ESSID_MAX)
+        length = LOG_ESSID_MAX;
+    memcpy(name->bssid, bssid, 6);
+    memcpy(name->essid, essid, length);
+    name->essid[length] = '\0';
+    name->used = true;
+    
+    return 0;
+}
+
+static const char *reader_essid(const log_reader_t *reader, const unsigned char *bssid)
+{
+    unsigned int i;
+    
+    if(reader->name_slots == 0)
+        return "";
+    for(i = bssid_hash(bssid); ; i++)
+    {
+        const log_name_t *name = &reader->names[i & (reader->name_slots - 1)];
+        if(!name->used)
+            return "";
+        if(memcmp(name->bssid, bssid, 6) == 0)
+            return name->essid;
+    }
+}
+
+/* 
+ * Delta codes a sample onto the block being gathered, first writing the block
+ * out if the sample might not fit. Returns 0, or -1 if a write failed.
+ */
+static int block_add(const log_sample_t *sample, const char *essid, const char *radio)
+{
+    unsigned char *p;
+    int i, name, index = sample->radio & 0xFF;
+    
+    /* The ESSID can change under a BSSID, so both have to match */
+    for(name = 0; name < block_name_count; name++)
+    {
+        if((memcmp(block_names[name].bssid, sample->bssid, 6) == 0) && (strncmp(block_names[name].essid, essid, LOG_ESSID_MAX) == 0))
+            break;
+    }
+    if((block_length + SCHEMA_FIELDS * VARINT_MAX > LOG_BLOCK_SIZE) || (name == LOG_BLOCK_BSSIDS))
+    {
+        if(block_flush() < 0)
+            return -1;
+        name = 0;
+    }
+    if(block_samples == 0)
+        block_started = monotonic_ms();
+    if(name == block_name_count)
+    {
+        memcpy(block_names[name].bssid, sample->bssid, 6);
+        strncpy(block_names[name].essid, essid, LOG_ESSID_MAX);
+        block_names[name].essid[LOG_ESSID_MAX] = '\0';
+        block_name_count++;
+    }
+    if(!block_radios[index])
+    {
+        strncpy(radio_names[index], radio, LOG_RADIO_NAME_MAX);
+        block_radios[index] = true;
+    }
+    
+    p = block + block_length;
+    for(i = 0; i < SCHEMA_FIELDS; i++)
+    {
+        if(schema[i].type == LOG_BYTES)
+            p = put_varint(p, name);
+        else
+        {
+            int64_t value = clamp_field(i, get_field(sample, schema[i].id));
+            int64_t delta = value - previous[i];
+            
+            /* Zig-zag, so small negative deltas stay short too */
+            p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            previous[i] = value;
+        }
+    }
+    block_length = p - block;
+    block_samples++;
+    
+    return 0;
+}
+
+/* Writes out the gathered block, if any, and starts a new one. Returns 0, or -1 if the write failed. */
+static int block_flush(void)
+{
+    static unsigned char payload[BLOCK_HEADER + VARINT_MAX + LOG_BLOCK_BSSIDS * (7 + LOG_ESSID_MAX) + 
+        VARINT_MAX + 256 * (2 + LOG_RADIO_NAME_MAX) + LOG_BLOCK_SIZE];
+    unsigned char *p = payload + BLOCK_HEADER;
+    int i, length, radios = 0;
+    
+    if(block_samples == 0)
+        return 0;
+    
+    p = put_varint(p, block_name_count);
+    for(i = 0; i < block_name_count; i++)
+    {
+        length = strlen(block_names[i].essid);
+        memcpy(p, block_names[i].bssid, 6);
+        p[6] = length;
+        memcpy(p + 7, block_names[i].essid, length);
+        p += 7 + length;
+    }
+    for(i = 0; i < 256; i++)
+        radios += block_radios[i];
+    p = put_varint(p, radios);
+    for(i = 0; i < 256; i++)
+    {
+        if(!block_radios[i])
+            continue;
+        length = strlen(radio_names[i]);
+        p[0] = i;
+        p[1] = length;
+        memcpy(p + 2, radio_names[i], length);
+        p += 2 + length;
+    }
+    memcpy(p, block, block_length);
+    p += block_length;
+    
+    length = p - payload - BLOCK_HEADER;
+    put_le(payload, LOG_BLOCK_MAGIC, 4);
+    put_le(payload + 4, length, 4);
+    put_le(payload + 8, block_samples, 4);
+    put_le(payload + 12, log_crc32(payload + BLOCK_HEADER, length), 4);
+    
+    /* Every block stands alone, so start the next from scratch */
+    block_length = block_samples = block_name_count = 0;
+    block_started = 0;
+    memset(block_radios, 0, sizeof(block_radios));
+    memset(previous, 0, sizeof(previous));
+    
+    return output(payload, p - payload);
+}
+
+/*
+ * Reads the next block and its tables, ready for decode_sample. Returns 1,
+ * 0 at the end of the log (including a block cut short by the logger stopping
+ * mid-write), or -1 on error. A damaged block is skipped, leaving no samples
+ * to decode, and the next one is found by its magic.
+ */
+static int read_block(log_reader_t *reader)
+{
+    unsigned char header[BLOCK_HEADER];
+    const unsigned char *p, *end;
+    uint64_t count;
+    uint32_t length;
+    size_t got;
+    long skipped = 0;
+    int i, n;
+    
+    got = reader_read(reader, header, sizeof(header));
+    if(got == 0)
+        return 0;
+    while((got == sizeof(header)) && (get_le(header, 4) != LOG_BLOCK_MAGIC))
+    {
+        memmove(header, header + 1, sizeof(header) - 1);
+        if(reader_read(reader, header + sizeof(header) - 1, 1) != 1)
+            got--;
+        skipped++;
+    }
+    if(skipped)
+        fprintf(stderr, "%s: skipped %ld bytes looking for the next block\n", reader->file, skipped);
+    if(got != sizeof(header))
+    {
+        fprintf(stderr, "%s ends with a truncated block\n", reader->file);
+        return 0;
+    }
+    
+    length = get_le(header + 4, 4);
+    if(length > LOG_BLOCK_MAX)
+    {
+        /* Most likely a corrupt header, so look for the next magic just past this one */
+        reader_back(reader, sizeof(header) - 1);
+        goto bad;
+    }
+    if(reader->block == NULL)
+    {
+        reader->block = malloc(LOG_BLOCK_MAX);
+        if(reader->block == NULL)
+        {
+            fprintf(stderr, "Failed to allocate the block buffer\n");
+            return -1;
+        }
+    }
+    if(reader_read(reader, reader->block, length) != length)
+    {
+        fprintf(stderr, "%s ends with a truncated block\n", reader->file);
+        return 0;
+    }
+    if(log_crc32(reader->block, length) != get_le(header + 12, 4))
+        goto bad;
+    
+    p = reader->block;
+    end = p + length;
+    n = get_varint(p, end, &count);
+    if((n < 0) || (count > LOG_BLOCK_BSSIDS))
+        goto bad;
+    p += n;
+    for(i = 0; i < (int)count; i++)
+    {
+        if((end - p < 7) || (p[6] > LOG_ESSID_MAX) || (end - p < 7 + p[6]))
+            goto bad;
+        memcpy(reader->block_names[i].bssid, p, 6);
+        memcpy(reader->block_names[i].essid, p + 7, p[6]);
+        reader->block_names[i].essid[p[6]] = '\0';
+        p += 7 + p[6];
+    }
+    reader->block_name_count = count;
+    
+    n = get_varint(p, end, &count);
+    if((n < 0) || (count > 256))
+        goto bad;
+    p += n;
+    for(i = 0; i < (int)count; i++)
+    {
+        if((end - p < 2) || (p[1] > LOG_RADIO_NAME_MAX) || (end - p < 2 + p[1]))
+            goto bad;
+        memcpy(reader->radios[p[0]], p + 2, p[1]);
+        reader->radios[p[0]][p[1]] = '\0';
+        p += 2 + p[1];
+    }
+    
+    reader->block_pos = p - reader->block;
+    reader->block_length = length;
+    reader->block_samples = get_le(header + 8, 4);
+    memset(reader->previous, 0, sizeof(reader->previous));
+    reader->blocks++;
+    return 1;
+    
+bad:
+    fprintf(stderr, "%s: block %lu is damaged, skipped\n", reader->file, reader->blocks + reader->bad_blocks);
+    reader->bad_blocks++;
+    reader->block_samples = 0;
+    return 1;
+}
+
+/* Decodes the next sample of the current block. Returns 1, or 0 if the block turned out to be malformed. */
+static int decode_sample(log_reader_t *reader, log_entry_t *entry)
+{
+    const unsigned char *p = reader->block + reader->block_pos, *end = reader->block + reader->block_length;
+    int i, name = -1;
+    
+    memset(entry, 0, sizeof(*entry));
+    for(i = 0; i < reader->field_count; i++)
+    {
+        uint64_t value;
+        int n = get_varint(p, end, &value);
+        
+        if(n < 0)
+            goto malformed;
+        p += n;
+        if(reader->fields[i].type == LOG_BYTES)
+        {
+            if(reader->fields[i].id != LOG_FIELD_BSSID)
+                continue;
+            if(value >= (uint64_t)reader->block_name_count)
+                goto malformed;
+            name = value;
+            continue;
+        }
+        /* Undo the zig-zag, adding in unsigned so corrupt data can't overflow */
+        reader->previous[i] = (int64_t)((uint64_t)reader->previous[i] + ((value >> 1) ^ -(value & 1)));
+        set_field(&entry->sample, reader->fields[i].id, reader->previous[i]);
+    }
+    
+    if(name >= 0)
+    {
+        memcpy(entry->sample.bssid, reader->block_names[name].bssid, 6);
+        entry->essid = reader->block_names[name].essid;
+    }
+    else
+        entry->essid = "";
+    entry->radio = reader->radios[entry->sample.radio & 0xFF][0] ? reader->radios[entry->sample.radio & 0xFF] : "?";
+    reader->block_pos = p - reader->block;
+    reader->block_samples--;
+    
+    return 1;
+    
+malformed:
+    fprintf(stderr, "%s: block %lu is malformed, skipped\n", reader->file, reader->blocks - 1);
+    reader->bad_blocks++;
+    reader->block_samples = 0;
+    return 0;
+}
+
+/* Unsigned LEB128: seven bits a byte, low bits first, the top bit set on all but the last */
+static unsigned char *put_varint(unsigned char *p, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+/* Returns the bytes taken, or -1 if the varint runs past end */
+static int get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value)
+{
+    int i;
+    
+    *value = 0;
+    for(i = 0; (i < VARINT_MAX) && (p + i < end); i++)
+    {
+        *value |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if(!(p[i] & 0x80))
+            return i + 1;
+    }
+    return -1;
+}
+
+/* The IEEE 802.3 CRC, as used by zip and png */
+uint32_t log_crc32(const void *data, int length)
+{
+    static uint32_t table[256];
+    const unsigned char *p = data;
+    uint32_t crc = 0xFFFFFFFF;
+    int i;
+    
+    if(table[1] == 0)
+    {
+        for(i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            int k;
+            for(k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    
+    for(i = 0; i < length; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+/* Reads and checks the trailer at pos. Returns the length of the batch it commits, or -1 if it isn't one. */
+static long read_trailer(log_reader_t *reader, long pos, uint32_t *sequence)
+{
+    unsigned char trailer[LOG_TRAILER_LENGTH];
+    long length;
+    
+    if((pos < 0) || (fseek(reader->fp, pos, SEEK_SET) < 0) || (fread(trailer, sizeof(trailer), 1, reader->fp) != 1))
+        return -1;
+    if(get_le(trailer, 4) != LOG_TRAILER_MAGIC)
+        return -1;
+    length = get_le(trailer + 4, 4);
+    if(length > pos)
+        return -1;
+    *sequence = get_le(trailer + 12, 4);
+    
+    return length;
+}
+
+/* Checks the batch a trailer at pos commits against the trailer's checksum */
+static bool batch_intact(log_reader_t *reader, long pos, long length)
+{
+    unsigned char trailer[LOG_TRAILER_LENGTH], *data = malloc(length ? length : 1);
+    bool intact = false;
+    
+    if(data && (fseek(reader->fp, pos - length, SEEK_SET) == 0) && (fread(data, 1, length, reader->fp) == (size_t)length) &&
+        (fread(trailer, sizeof(trailer), 1, reader->fp) == 1))
+        intact = (log_crc32(data, length) == get_le(trailer + 8, 4));
+    free(data);
+    
+    return intact;
+}
+
+/*
+ * Finds the last committed batch and, walking back batch by batch from its
+ * trailer, where every trailer is, so reader_read can step over them. Batches
+ * before the last were synced before it was written, so only the last can be
+ * torn and only its checksum needs checking. Returns 0, or -1 if the chain of
+ * trailers is broken.
+ */
+static int find_commits(log_reader_t *reader, long header_length)
+{
+    long size, pos, length = -1;
+    uint32_t sequence, expected;
+    int count = 0, i;
+    
+    fseek(reader->fp, 0, SEEK_END);
+    size = ftell(reader->fp);
+    
+    /* A log that was closed cleanly ends in a trailer, so this only searches after a crash */
+    for(pos = size - LOG_TRAILER_LENGTH; pos >= header_length; pos--)
+    {
+        length = read_trailer(reader, pos, &sequence);
+        if((length >= 0) && batch_intact(reader, pos, length))
+            break;
+    }
+    if(pos < header_length)
+    {
+        fprintf(stderr, "%s has no committed data\n", reader->file);
+        reader->committed = header_length;
+        fseek(reader->fp, header_length, SEEK_SET);
+        return 0;
+    }
+    if(pos + LOG_TRAILER_LENGTH < size)
+        fprintf(stderr, "%s: ignoring %ld uncommitted bytes at the end\n", reader->file, size - pos - LOG_TRAILER_LENGTH);
+    reader->committed = pos + LOG_TRAILER_LENGTH;
+    
+    /* Walk back to the start of the file */
+    while(1)
+    {
+        if(count == reader->trailer_count)
+        {
+            long *grown = realloc(reader->trailers, (count ? 2 * count : 64) * sizeof(long));
+            if(grown == NULL)
+            {
+                fprintf(stderr, "Failed to allocate the trailer table\n");
+                return -1;
+            }
+            reader->trailers = grown;
+            reader->trailer_count = count ? 2 * count : 64;
+        }
+        reader->trailers[count++] = pos;
+        
+        pos -= length;
+        if(pos == 0)
+            break;
+        expected = sequence - 1;
+        pos -= LOG_TRAILER_LENGTH;
+        length = read_trailer(reader, pos, &sequence);
+        if((length < 0) || (sequence != expected))
+        {
+            fprintf(stderr, "%s has a damaged trailer at %ld\n", reader->file, pos);
+            return -1;
+        }
+    }
+    
+    /* Collected last first */
+    for(i = 0; i < count / 2; i++)
+    {
+        long swap = reader->trailers[i];
+        reader->trailers[i] = reader->trailers[count - 1 - i];
+        reader->trailers[count - 1 - i] = swap;
+    }
+    reader->trailer_count = count;
+    reader->next_trailer = 0;
+    while((reader->next_trailer < count) && (reader->trailers[reader->next_trailer] + LOG_TRAILER_LENGTH <= header_length))
+        reader->next_trailer++;
+    fseek(reader->fp, header_length, SEEK_SET);
+    
+    return 0;
+}
+
+/* 
+ * Reads the log's data as if the trailers weren't there, stopping at the end
+ * of the last committed batch. Returns the bytes read, like fread.
+ */
+static size_t reader_read(log_reader_t *reader, void *buf, size_t length)
+{
+    unsigned char *p = buf;
+    size_t total = 0;
+    
+    if(reader->committed < 0)
+        return fread(buf, 1, length, reader->fp);
+    
+    while(total < length)
+    {
+        long limit = reader->committed, n;
+        
+        if((reader->next_trailer < reader->trailer_count) && (reader->trailers[reader->next_trailer] < limit))
+        {
+            if(reader->pos == reader->trailers[reader->next_trailer])
+            {
+                reader->pos += LOG_TRAILER_LENGTH;
+                reader->next_trailer++;
+                fseek(reader->fp, reader->pos, SEEK_SET);
+                continue;
+            }
+            limit = reader->trailers[reader->next_trailer];
+        }
+        if(reader->pos >= limit)
+            break;
+        
+        n = ((long)(length - total) < limit - reader->pos) ? (long)(length - total) : limit - reader->pos;
+        n = fread(p + total, 1, n, reader->fp);
+        if(n <= 0)
+            break;
+        total += n;
+        reader->pos += n;
+    }
+    
+    return total;
+}
+
+/* Steps back over data just read, as long as that doesn't cross a trailer */
+static void reader_back(log_reader_t *reader, long length)
+{
+    if(reader->committed < 0)
+    {
+        fseek(reader->fp, -length, SEEK_CUR);
+        return;
+    }
+    if((reader->next_trailer > 0) && (reader->pos - length < reader->trailers[reader->next_trailer - 1] + LOG_TRAILER_LENGTH))
+        return;
+    reader->pos -= length;
+    fseek(reader->fp, reader->pos, SEEK_SET);
+}
+
+/* 
+ * Takes the index off the end of a closed segment, so the samples stop short
+ * of it. Anything else (an older log, or one cut short) is left as it is.
+ */
+static void read_index(log_reader_t *reader, long start)
+{
+    unsigned char index[LOG_INDEX_LENGTH];
+    long end;
+    
+    if(reader->committed < 0)
+        return;
+    end = reader->trailer_count ? reader->trailers[reader->trailer_count - 1] : reader->committed;
+    if((end - LOG_INDEX_LENGTH < start) || (fseek(reader->fp, end - LOG_INDEX_LENGTH, SEEK_SET) < 0))
+        return;
+    
+    if((fread(index, sizeof(index), 1, reader->fp) == 1) && (get_le(index, 4) == LOG_INDEX_MAGIC) && 
+        (get_le(index + 4, 4) == LOG_INDEX_LENGTH) && (log_crc32(index, 44) == get_le(index + 44, 4)))
+    {
+        reader->index.first = (int64_t)get_le(index + 8, 8);
+        reader->index.last = (int64_t)get_le(index + 16, 8);
+        reader->index.south = (int32_t)get_le(index + 24, 4);
+        reader->index.west = (int32_t)get_le(index + 28, 4);
+        reader->index.north = (int32_t)get_le(index + 32, 4);
+        reader->index.east = (int32_t)get_le(index + 36, 4);
+        reader->index.samples = get_le(index + 40, 4);
+        reader->has_index = true;
+        reader->committed = end - LOG_INDEX_LENGTH;
+    }
+    fseek(reader->fp, reader->pos, SEEK_SET);
+}
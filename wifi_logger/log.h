@@ -0,0 +1,239 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "writer.h"
+
+/* Output formats */
+#define LOG_TEXT            0   /* One line of ASCII per sample */
+#define LOG_BINARY          1   /* Packed records, converted offline with log_convert */
+#define LOG_COMPRESSED      2   /* Delta coded blocks of samples */
+
+/*
+ * A binary log is a header, then records. Every multi-byte value is little
+ * endian whatever the host, so a log written on the (big endian) router reads
+ * back on a PC. The header is:
+ *
+ *   magic (4), version (2), header length (2), sample length (2), field count (2),
+ *   flags (2), reserved (2), then per sample field: id (1), type (1), size (1), reserved (1)
+ *
+ * The fields are listed in the order they're packed into sample records, so a
+ * reader finds the ones it knows and steps over the rest. Each record starts
+ * with its kind (1) and the length of what follows (1). Version 1 headers
+ * stopped before the flags.
+ *
+ * With LOG_FLAG_BLOCKS the records are instead grouped into blocks, each
+ * standing alone so a damaged one costs only its own samples:
+ *
+ *   magic (4), payload length (4), sample count (4), CRC-32 of the payload (4),
+ *   then the payload: BSSID count, per BSSID: bssid (6), essid length (1), essid,
+ *   radio count, per radio: index (1), name length (1), name, then the samples
+ *
+ * Counts are varints. A sample is each schema field in turn as the zig-zag
+ * varint of its difference from the previous sample in the block, except that
+ * byte fields (the BSSID) are a varint index into the block's BSSID table.
+ * Consecutive samples mostly differ by a little, so most fields take a byte.
+ *
+ * With LOG_FLAG_COMMITS the file (header included) is written in batches, each
+ * followed by a trailer: magic (4), batch length (4), CRC-32 of the batch (4),
+ * sequence number (4). Only data up to the last trailer that checks out was
+ * known to be on flash; anything after it was cut short by a crash or power
+ * cut, and is ignored.
+ *
+ * A log written into a preallocated file (see log_config_t) has no trailers.
+ * It's preceded instead by a prefix: magic (4), committed length (4), file
+ * size (4), reserved (4). The committed length is how much of the log after
+ * the prefix was written; the rest of the file is unused. It is exact after
+ * the logger crashes, but after a power cut only what was synced is sure to
+ * be on flash and the tail may read back as zeros, which a reader skips.
+ *
+ * A log split into segments (see log_config_t) ends each binary segment
+ * with an index of what it holds, so a query can pass over segments without
+ * reading them. It's the last thing before the final trailer, or the end of
+ * the committed data for a preallocated log:
+ *
+ *   magic (4), length (4), first sample time (8), last sample time (8),
+ *   southmost latitude (4), westmost longitude (4), northmost latitude (4),
+ *   eastmost longitude (4), sample count (4), CRC-32 of the rest (4)
+ */
+#define LOG_MAGIC           0x474F4C57UL    /* "WLOG" */
+#define LOG_BLOCK_MAGIC     0x4B4C4257UL    /* "WBLK" */
+#define LOG_VERSION         2
+
+#define LOG_TRAILER_MAGIC   0x544D4357UL    /* "WCMT" */
+#define LOG_TRAILER_LENGTH  16
+
+#define LOG_MAP_MAGIC       0x50414D57UL    /* "WMAP" */
+#define LOG_MAP_HEADER      16
+
+#define LOG_INDEX_MAGIC     0x58444957UL    /* "WIDX" */
+#define LOG_INDEX_LENGTH    48
+
+/* Header flags */
+#define LOG_FLAG_BLOCKS     0x0001
+#define LOG_FLAG_COMMITS    0x0002
+
+/* Record kinds */
+#define LOG_RECORD_SAMPLE   1   /* One BSS measured at one fix, laid out by the schema */
+#define LOG_RECORD_NAME     2   /* bssid (6), essid: names a BSSID before samples refer to it */
+#define LOG_RECORD_RADIO    3   /* radio index (1), interface name */
+
+/* Sample field ids */
+#define LOG_FIELD_TIME      1   /* ms since the Unix epoch (UTC), or since midnight if the date was unknown */
+#define LOG_FIELD_LATITUDE  2   /* GPS_COORD_SCALE fixed point degrees */
+#define LOG_FIELD_LONGITUDE 3
+#define LOG_FIELD_BSSID     4
+#define LOG_FIELD_QUALITY   5
+#define LOG_FIELD_SIGNAL    6   /* dBm */
+#define LOG_FIELD_NOISE     7   /* dBm */
+#define LOG_FIELD_CHANNEL   8
+#define LOG_FIELD_RADIO     9   /* Index named by a LOG_RECORD_RADIO */
+
+/* Field types */
+#define LOG_INT             0   /* Signed integer of the field's size */
+#define LOG_UINT            1   /* Unsigned integer */
+#define LOG_BYTES           2   /* Opaque bytes */
+
+#define LOG_ESSID_MAX       32
+#define LOG_RADIO_NAME_MAX  16
+#define LOG_MAX_FIELDS      32
+#define LOG_BLOCK_SIZE      4096    /* Encoded samples gathered before a block is written */
+#define LOG_BLOCK_BSSIDS    64      /* BSSIDs one block can refer to */
+#define LOG_BLOCK_MAX       65536   /* Largest payload a reader accepts */
+
+/* Times before this are a time of day with no date */
+#define LOG_DAY_MS          86400000
+
+typedef struct
+{
+    const char *file;
+    int format;
+    int flush_interval;     /* Longest data waits in RAM before it's written and synced (ms, 0 = until flush_size) */
+    int flush_size;         /* Bytes gathered before they're written and synced */
+    int preallocate;        /* Bytes to preallocate and write through a mapping (binary formats), 0 to append batches */
+    int segment_size;       /* Bytes written before starting the next segment, 0 for no limit */
+    int segment_duration;   /* ms logged before starting the next segment, 0 for no limit */
+} log_config_t;
+
+typedef struct
+{
+    int64_t time;
+    int32_t latitude;
+    int32_t longitude;
+    unsigned char bssid[6];
+    int quality;
+    int signal;
+    int noise;
+    int channel;
+    int radio;
+} log_sample_t;
+
+/* What a segment holds */
+typedef struct
+{
+    int64_t first;              /* Sample times */
+    int64_t last;
+    int32_t south;              /* Bounding box of the sample positions */
+    int32_t west;
+    int32_t north;
+    int32_t east;
+    unsigned long samples;
+} log_index_t;
+
+/* What log_read returns: a sample, with the names it refers to resolved */
+typedef struct
+{
+    log_sample_t sample;
+    const char *essid;          /* "" if the BSSID was never named */
+    const char *radio;
+} log_entry_t;
+
+typedef struct
+{
+    unsigned char bssid[6];
+    bool used;
+    char essid[LOG_ESSID_MAX + 1];
+} log_name_t;
+
+/* Streams a binary log, decoding records as they're read */
+typedef struct
+{
+    FILE *fp;
+    const char *file;
+    int flags;
+    int sample_length;
+    int field_count;
+    struct
+    {
+        int id;
+        int type;
+        int size;
+        int offset;
+    } fields[LOG_MAX_FIELDS];
+    log_name_t *names;          /* Open addressed, grown as BSSIDs are named */
+    int name_slots;
+    int name_count;
+    char radios[256][LOG_RADIO_NAME_MAX + 1];
+    unsigned long records;
+    
+    /* The block being decoded */
+    unsigned char *block;
+    int block_length;
+    int block_pos;
+    unsigned long block_samples;        /* Left to decode */
+    log_name_t block_names[LOG_BLOCK_BSSIDS];
+    int block_name_count;
+    int64_t previous[LOG_MAX_FIELDS];
+    unsigned long blocks;
+    unsigned long bad_blocks;           /* Skipped for a bad checksum or encoding */
+    
+    /* Where the committed batches' trailers are, for LOG_FLAG_COMMITS */
+    long *trailers;
+    int trailer_count;
+    int next_trailer;
+    long base;                          /* Length of a preallocated log's prefix */
+    long pos;
+    long committed;                     /* End of the committed data, or -1 to read to the end of the file */
+    
+    bool has_index;                     /* The log is a closed segment, and index says what it holds */
+    log_index_t index;
+} log_reader_t;
+
+/* Writing, on the logger */
+int log_open(const log_config_t *config);
+void log_close(void);
+int log_write(const log_sample_t *sample, const char *essid, const char *radio);
+int log_poll(void);
+void log_get_stats(writer_stats_t *stats);
+
+/* Reading, offline */
+int log_reader_open(log_reader_t *reader, const char *file);
+void log_reader_close(log_reader_t *reader);
+int log_read(log_reader_t *reader, log_entry_t *entry);
+
+int log_format_text(char *line, const log_sample_t *sample, const char *essid, const char *radio);
+int log_format_coord(char *buf, int32_t coord);
+uint32_t log_crc32(const void *data, int length);
+
+#endif
+
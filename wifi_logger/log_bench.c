@@ -0,0 +1,452 @@
+/*
+ *  Benchmarks log encoding and decoding on a survey derived from a recorded NMEA log
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "gps.h"
+#include "log.h"
+
+#define DEFAULT_FILE        "data/mish_gps.txt"
+#define DEFAULT_ITERATIONS  50
+#define OUTPUT              "log_bench.tmp"
+#define SEGMENTS            "log_bench_seg.tmp"     /* Segments are log_bench_seg.0001.tmp, ... */
+#define MAX_FIXES           100000
+#define NETWORKS            3
+
+static gps_t fixes[MAX_FIXES];
+static int fix_count;
+static int64_t duration;        /* ms covered by one pass over the fixes */
+
+/* A few networks heard along the route, as a scan would report them */
+static const struct
+{
+    unsigned char bssid[6];
+    const char *essid;
+    int channel;
+    int base;                   /* Signal (dBm) when close by */
+} networks[NETWORKS] =
+{
+    {{0x00, 0x11, 0x22, 0x33, 0x44, 0x01}, "robotang", 6, -50},
+    {{0x00, 0x11, 0x22, 0x33, 0x44, 0x02}, "neighbour", 1, -70},
+    {{0x02, 0x1a, 0x70, 0x0c, 0x9e, 0x31}, "cafe guest", 11, -80},
+};
+
+/* Replays the NMEA log through gps_update, keeping every valid fix */
+static int load_fixes(const char *file)
+{
+    gps_config_t config;
+    gps_t gps;
+    
+    memset(&config, 0, sizeof(config));
+    config.dev = file;
+    config.baud = GPS_LOGFILE;
+    if(gps_init(&config) < 0)
+        return -1;
+    while((gps_update(&gps, -1) >= 0) && (fix_count < MAX_FIXES))
+    {
+        if(gps.valid)
+            fixes[fix_count++] = gps;
+    }
+    gps_close();
+    
+    if(fix_count > 1)
+        duration = gps_utc(fixes[fix_count - 1].date, fixes[fix_count - 1].time) - 
+            gps_utc(fixes[0].date, fixes[0].time) + 1000;
+    return fix_count;
+}
+
+/* 
+ * The n'th sample of the survey: every network at every fix, the route driven
+ * over and over to stand in for a long drive. Signals wander deterministically
+ * so each run encodes the same data.
+ */
+static void make_sample(long n, log_sample_t *sample)
+{
+    const gps_t *fix = &fixes[(n / NETWORKS) % fix_count];
+    long pass = n / NETWORKS / fix_count;
+    int network = n % NETWORKS;
+    unsigned int noise = (unsigned int)n * 2654435761u;
+    
+    sample->time = gps_utc(fix->date, fix->time) + pass * duration;
+    sample->latitude = fix->latitude;
+    sample->longitude = fix->longitude;
+    memcpy(sample->bssid, networks[network].bssid, 6);
+    sample->signal = networks[network].base - (int)((noise >> 28) % 8);
+    sample->noise = -95;
+    sample->quality = sample->signal + 110;
+    sample->channel = networks[network].channel;
+    sample->radio = 0;
+}
+
+static long file_size(const char *file)
+{
+    struct stat info;
+    return (stat(file, &info) == 0) ? (long)info.st_size : -1;
+}
+
+/* Whether a sample read back is the n'th written */
+static bool sample_matches(const log_entry_t *entry, long n)
+{
+    log_sample_t sample;
+    
+    make_sample(n, &sample);
+    return (entry->sample.time == sample.time) && (entry->sample.latitude == sample.latitude) && 
+        (entry->sample.longitude == sample.longitude) && (entry->sample.signal == sample.signal) && 
+        !memcmp(entry->sample.bssid, sample.bssid, 6) && !strcmp(entry->essid, networks[n % NETWORKS].essid);
+}
+
+/* Writes the survey in one format and reads it back, checking every sample. Returns 0, or -1 if it didn't read back. */
+static int bench_format(const char *name, int format, int preallocate, long samples, long text_size)
+{
+    log_reader_t reader;
+    log_entry_t entry;
+    log_sample_t sample;
+    log_config_t config = {OUTPUT, format, 0, 65536, preallocate};
+    double start, encode, decode;
+    long n, size, errors = 0;
+    
+    start = bench_now();
+    if(log_open(&config) < 0)
+        return -1;
+    for(n = 0; n < samples; n++)
+    {
+        make_sample(n, &sample);
+        log_write(&sample, networks[n % NETWORKS].essid, "wlan0");
+    }
+    log_close();
+    encode = bench_now() - start;
+    size = file_size(OUTPUT);
+    
+    printf("%-10s encode: %0.3f s, %0.0f samples/s, %ld bytes, %0.2f bytes/sample, %0.1fx smaller than text\n", name, 
+        encode, samples / encode, size, (double)size / samples, (text_size > 0) ? (double)text_size / size : 1.0);
+    if(format == LOG_TEXT)
+        return 0;
+    
+    start = bench_now();
+    if(log_reader_open(&reader, OUTPUT) < 0)
+        return -1;
+    for(n = 0; log_read(&reader, &entry) > 0; n++)
+    {
+        if(!sample_matches(&entry, n))
+            errors++;
+    }
+    log_reader_close(&reader);
+    decode = bench_now() - start;
+    
+    printf("%-10s decode: %0.3f s, %0.0f samples/s, %ld of %ld samples read back, %ld mismatched\n", name, 
+        decode, n / decode, n, samples, errors);
+    if(errors || (n != samples))
+    {
+        printf("%-10s FAIL\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Offset of the first four bytes at or after pos that read as magic, or -1 */
+static long find_magic(const unsigned char *buf, long length, long pos, uint32_t magic)
+{
+    for(; pos + 4 <= length; pos++)
+    {
+        if((uint32_t)(buf[pos] | (buf[pos + 1] << 8) | (buf[pos + 2] << 16) | ((uint32_t)buf[pos + 3] << 24)) == magic)
+            return pos;
+    }
+    return -1;
+}
+
+/* 
+ * Damages one byte of a compressed block early in the log and checks that its
+ * CRC catches it, that the reader finds the next block, and that only that
+ * block's samples are lost. Returns 0, or -1 if the check failed.
+ */
+static int check_damaged_block(long samples)
+{
+    log_config_t config = {OUTPUT, LOG_COMPRESSED, 0, 8192, 0};
+    log_reader_t reader;
+    log_entry_t entry;
+    log_sample_t sample;
+    unsigned char *buf;
+    long length, pos = 0, lost, n, expected = 0, skips = 0, errors = 0;
+    int i;
+    FILE *fp;
+    
+    if(log_open(&config) < 0)
+        return -1;
+    for(n = 0; n < samples; n++)
+    {
+        make_sample(n, &sample);
+        log_write(&sample, networks[n % NETWORKS].essid, "wlan0");
+    }
+    log_close();
+    
+    /* The third block, whose header doesn't run into a batch trailer; early, as only the last batch is checksummed whole */
+    buf = (unsigned char *)bench_load_file(OUTPUT, &length);
+    if(buf == NULL)
+        return -1;
+    for(i = 0; i < 3; i++)
+    {
+        pos = find_magic(buf, length, pos + 1, LOG_BLOCK_MAGIC);
+        while((pos >= 0) && (find_magic(buf, (pos + 32 < length) ? pos + 32 : length, pos, LOG_TRAILER_MAGIC) >= 0))
+            pos = find_magic(buf, length, pos + 1, LOG_BLOCK_MAGIC);
+        if(pos < 0)
+        {
+            printf("damaged:   too few blocks to damage one\n");
+            free(buf);
+            return -1;
+        }
+    }
+    lost = buf[pos + 8] | (buf[pos + 9] << 8) | (buf[pos + 10] << 16) | ((long)buf[pos + 11] << 24);
+    buf[pos + 24] ^= 0x55;
+    fp = fopen(OUTPUT, "wb");
+    if((fp == NULL) || (fwrite(buf, 1, length, fp) != (size_t)length))
+        errors++;
+    if(fp)
+        fclose(fp);
+    free(buf);
+    
+    /* Samples must read back in order, with one gap the size of the damaged block */
+    if(log_reader_open(&reader, OUTPUT) < 0)
+        return -1;
+    for(n = 0; log_read(&reader, &entry) > 0; n++, expected++)
+    {
+        if(sample_matches(&entry, expected))
+            continue;
+        if((skips == 0) && sample_matches(&entry, expected + lost))
+        {
+            expected += lost;
+            skips++;
+        }
+        else
+            errors++;
+    }
+    printf("damaged:   %ld of %ld samples read back, %lu bad block(s), %ld samples expected lost, %ld mismatched\n", 
+        n, samples, reader.bad_blocks, lost, errors);
+    if(errors || (reader.bad_blocks != 1) || (skips != 1) || (n != samples - lost))
+    {
+        printf("damaged:   FAIL\n");
+        errors++;
+    }
+    log_reader_close(&reader);
+    
+    return errors ? -1 : 0;
+}
+
+/* 
+ * Starts a segmented log beside segments 1 and 3 of an earlier run, which
+ * must be left alone: numbering carries on after 3 rather than filling the
+ * gap at 2. Returns 0, or -1 if the check failed.
+ */
+static int check_segments(void)
+{
+    static const char earlier[] = "an earlier run's segment";
+    log_config_t config = {SEGMENTS, LOG_BINARY, 0, 65536, 0, 4096, 0};
+    log_sample_t sample;
+    char name[64], buf[sizeof(earlier)];
+    int number, failed = 0;
+    long n;
+    FILE *fp;
+    
+    for(number = 1; number <= 3; number += 2)
+    {
+        sprintf(name, "log_bench_seg.%04d.tmp", number);
+        fp = fopen(name, "wb");
+        if(fp == NULL)
+            return -1;
+        fwrite(earlier, 1, sizeof(earlier), fp);
+        fclose(fp);
+    }
+    
+    /* Enough samples for a few segments */
+    if(log_open(&config) < 0)
+        return -1;
+    for(n = 0; n < 1000; n++)
+    {
+        make_sample(n, &sample);
+        log_write(&sample, networks[n % NETWORKS].essid, "wlan0");
+    }
+    log_close();
+    
+    for(number = 1; number <= 6; number++)
+    {
+        bool earlier_run = (number == 1) || (number == 3);
+        
+        sprintf(name, "log_bench_seg.%04d.tmp", number);
+        fp = fopen(name, "rb");
+        if(earlier_run && ((fp == NULL) || (fread(buf, 1, sizeof(buf), fp) != sizeof(buf)) || memcmp(buf, earlier, sizeof(buf))))
+        {
+            printf("segments:  %s from the earlier run was overwritten\n", name);
+            failed = 1;
+        }
+        else if((number == 2) && fp)
+        {
+            printf("segments:  %s was written in the earlier run's gap\n", name);
+            failed = 1;
+        }
+        else if((number >= 4) && (number <= 5) && (fp == NULL))
+        {
+            printf("segments:  %s is missing\n", name);
+            failed = 1;
+        }
+        if(fp)
+            fclose(fp);
+    }
+    
+    for(number = 1; number < 100; number++)
+    {
+        sprintf(name, "log_bench_seg.%04d.tmp", number);
+        remove(name);
+    }
+    
+    printf("segments:  %s\n", failed ? "FAIL" : "numbered on from the earlier run's, which are intact");
+    return failed ? -1 : 0;
+}
+
+/* Reads a log back, returning how many samples came out in order, or -1 if one was wrong */
+static long read_back(const char *file)
+{
+    log_reader_t reader;
+    log_entry_t entry;
+    long n;
+    
+    if(log_reader_open(&reader, file) < 0)
+        return -1;
+    for(n = 0; log_read(&reader, &entry) > 0; n++)
+    {
+        if(!sample_matches(&entry, n))
+        {
+            n = -1;
+            break;
+        }
+    }
+    log_reader_close(&reader);
+    return n;
+}
+
+/* 
+ * Stands in for a crash mid-batch: cuts the log off halfway through its last
+ * batch of samples, then checks that exactly the samples up to the last intact
+ * trailer read back, the same as if the log had been cut off at that trailer.
+ * Returns 0, or -1 if the check failed.
+ */
+static int check_truncated(const char *name, int format, long samples)
+{
+    log_config_t config = {OUTPUT, format, 0, 8192, 0};
+    log_sample_t sample;
+    unsigned char *buf;
+    long length, last = -1, end = -1, pos, next, torn, committed;
+    long n;
+    
+    if(log_open(&config) < 0)
+        return -1;
+    for(n = 0; n < samples; n++)
+    {
+        make_sample(n, &sample);
+        log_write(&sample, networks[n % NETWORKS].essid, "wlan0");
+    }
+    log_close();
+    
+    /* The last batch bigger than the index (which may have a batch of its own at the end), and the trailer before it */
+    buf = (unsigned char *)bench_load_file(OUTPUT, &length);
+    if(buf == NULL)
+        return -1;
+    for(pos = find_magic(buf, length, 0, LOG_TRAILER_MAGIC); pos >= 0; pos = next)
+    {
+        next = find_magic(buf, length, pos + 1, LOG_TRAILER_MAGIC);
+        if((next >= 0) && (next - pos - LOG_TRAILER_LENGTH > LOG_INDEX_LENGTH))
+        {
+            last = pos;
+            end = next;
+        }
+    }
+    free(buf);
+    if(last < 0)
+    {
+        printf("%-10s truncated: the log is a single batch\n", name);
+        return -1;
+    }
+    
+    if(truncate(OUTPUT, (last + LOG_TRAILER_LENGTH + end) / 2) < 0)
+        return -1;
+    torn = read_back(OUTPUT);
+    if(truncate(OUTPUT, last + LOG_TRAILER_LENGTH) < 0)
+        return -1;
+    committed = read_back(OUTPUT);
+    
+    printf("%-10s truncated: %ld of %ld samples read back, %ld committed by the last intact trailer\n", 
+        name, torn, samples, committed);
+    if((torn < 0) || (torn != committed) || (committed <= 0) || (committed >= samples))
+    {
+        printf("%-10s truncated: FAIL\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file = (argc > 1) ? argv[1] : DEFAULT_FILE;
+    int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    long samples, text_size;
+    int result = 0;
+    
+    if(load_fixes(file) < 2)
+    {
+        printf("loading fixes from %s failed\n", file);
+        return -1;
+    }
+    samples = (long)fix_count * NETWORKS * iterations;
+    printf("%d fixes from %s, %d networks each, driven %d times: %ld samples over %0.1f hours\n", 
+        fix_count, file, NETWORKS, iterations, samples, duration * iterations / 3600000.0);
+    
+    if(bench_format("text", LOG_TEXT, 0, samples, 0) < 0)
+        result = -1;
+    text_size = file_size(OUTPUT);
+    if(bench_format("binary", LOG_BINARY, 0, samples, text_size) < 0)
+        result = -1;
+    if(bench_format("compressed", LOG_COMPRESSED, 0, samples, text_size) < 0)
+        result = -1;
+    printf("compressed: %0.2f MB per day of driving\n", 
+        file_size(OUTPUT) / (duration * iterations / 86400000.0) / 1000000.0);
+    
+    /* The same through a preallocated mapping rather than batched writes */
+    if(bench_format("mapped", LOG_BINARY, text_size, samples, text_size) < 0)
+        result = -1;
+    
+    if(check_damaged_block((long)fix_count * NETWORKS * 4) < 0)
+        result = -1;
+    
+    /* A crash mid-batch loses only the uncommitted batch */
+    if(check_truncated("binary", LOG_BINARY, (long)fix_count * NETWORKS) < 0)
+        result = -1;
+    if(check_truncated("compressed", LOG_COMPRESSED, (long)fix_count * NETWORKS * 4) < 0)
+        result = -1;
+    
+    remove(OUTPUT);
+    
+    if(check_segments() < 0)
+        result = -1;
+    return result;
+}
+
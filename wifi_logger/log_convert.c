@@ -0,0 +1,353 @@
+/*
+ *  Converts a binary wifi_logger log to text, CSV or GeoJSON, one record at a time
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "gps.h"
+
+#define FORMAT_TEXT     0   /* As wifi_logger writes with Format = text */
+#define FORMAT_CSV      1
+#define FORMAT_GEOJSON  2
+
+/* Which samples to convert, if not all of them */
+static struct
+{
+    bool by_time;
+    int64_t from;
+    int64_t to;
+    bool by_area;
+    int32_t south;
+    int32_t west;
+    int32_t north;
+    int32_t east;
+} query;
+
+/* Formats a sample time as ISO 8601 UTC, or just the time of day if the fix had no date */
+static void format_time(char *buf, int64_t ms)
+{
+    time_t seconds = ms / 1000;
+    struct tm tm;
+    
+    if(ms < LOG_DAY_MS)
+    {
+        sprintf(buf, "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000) % 60, (int)(ms / 1000) % 60, (int)(ms % 1000));
+        return;
+    }
+    gmtime_r(&seconds, &tm);
+    sprintf(buf, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, 
+        tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(ms % 1000));
+}
+
+static void format_bssid(char *buf, const unsigned char *bssid)
+{
+    sprintf(buf, "%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+}
+
+/* CSV quotes every ESSID, doubling any quotes in it */
+static void put_csv_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for(; *s; s++)
+    {
+        if(*s == '"')
+            fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void put_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for(; *s; s++)
+    {
+        if((*s == '"') || (*s == '\\'))
+            fprintf(out, "\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void write_csv(FILE *out, const log_entry_t *entry)
+{
+    const log_sample_t *sample = &entry->sample;
+    char time[32], latitude[16], longitude[16], bssid[18];
+    
+    format_time(time, sample->time);
+    log_format_coord(latitude, sample->latitude);
+    log_format_coord(longitude, sample->longitude);
+    format_bssid(bssid, sample->bssid);
+    fprintf(out, "%s,%s,%s,%s,%d,%d,%d,%d,%s,", time, latitude, longitude, bssid, sample->channel, 
+        sample->quality, sample->signal, sample->noise, entry->radio);
+    put_csv_string(out, entry->essid);
+    fputc('\n', out);
+}
+
+/* One Point feature per sample. first is cleared once the first has been written, for the separators. */
+static void write_geojson(FILE *out, const log_entry_t *entry, bool *first)
+{
+    const log_sample_t *sample = &entry->sample;
+    char time[32], latitude[16], longitude[16], bssid[18];
+    
+    format_time(time, sample->time);
+    log_format_coord(latitude, sample->latitude);
+    log_format_coord(longitude, sample->longitude);
+    format_bssid(bssid, sample->bssid);
+    fprintf(out, "%s\n{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[%s,%s]},"
+        "\"properties\":{\"time\":\"%s\",\"bssid\":\"%s\",\"essid\":", *first ? "" : ",", longitude, latitude, time, bssid);
+    put_json_string(out, entry->essid);
+    fprintf(out, ",\"channel\":%d,\"quality\":%d,\"signal\":%d,\"noise\":%d,\"radio\":", 
+        sample->channel, sample->quality, sample->signal, sample->noise);
+    put_json_string(out, entry->radio);
+    fputs("}}", out);
+    *first = false;
+}
+
+/* Parses a UTC time (2012-05-01T10:30:00), or a time of day (10:30:00) for logs without dates. Returns 0, or -1 if it's neither. */
+static int parse_time(const char *s, int64_t *ms)
+{
+    struct tm tm;
+    double seconds;
+    
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(s, "%d-%d-%dT%d:%d:%lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &seconds) == 6)
+    {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        *ms = (int64_t)timegm(&tm) * 1000 + (int64_t)(seconds * 1000 + 0.5);
+        return 0;
+    }
+    if(sscanf(s, "%d:%d:%lf", &tm.tm_hour, &tm.tm_min, &seconds) == 3)
+    {
+        *ms = tm.tm_hour * 3600000LL + tm.tm_min * 60000LL + (int64_t)(seconds * 1000 + 0.5);
+        return 0;
+    }
+    return -1;
+}
+
+/* -t from,to */
+static int parse_times(const char *s)
+{
+    const char *comma = strchr(s, ',');
+    char from[64];
+    
+    if((comma == NULL) || (comma - s >= (int)sizeof(from)))
+        return -1;
+    memcpy(from, s, comma - s);
+    from[comma - s] = '\0';
+    if((parse_time(from, &query.from) < 0) || (parse_time(comma + 1, &query.to) < 0))
+        return -1;
+    query.by_time = true;
+    return 0;
+}
+
+/* -b south,west,north,east in degrees */
+static int parse_area(const char *s)
+{
+    double south, west, north, east;
+    
+    if(sscanf(s, "%lf,%lf,%lf,%lf", &south, &west, &north, &east) != 4)
+        return -1;
+    query.south = (int32_t)(south * GPS_COORD_SCALE);
+    query.west = (int32_t)(west * GPS_COORD_SCALE);
+    query.north = (int32_t)(north * GPS_COORD_SCALE);
+    query.east = (int32_t)(east * GPS_COORD_SCALE);
+    query.by_area = true;
+    return 0;
+}
+
+/* Whether a segment's index rules out every sample in it */
+static bool skip_segment(const log_index_t *index)
+{
+    if(index->samples == 0)
+        return true;
+    if(query.by_time && ((index->last < query.from) || (index->first > query.to)))
+        return true;
+    if(query.by_area && ((index->north < query.south) || (index->south > query.north) || 
+        (index->east < query.west) || (index->west > query.east)))
+        return true;
+    return false;
+}
+
+static bool match(const log_sample_t *sample)
+{
+    if(query.by_time && ((sample->time < query.from) || (sample->time > query.to)))
+        return false;
+    if(query.by_area && ((sample->latitude < query.south) || (sample->latitude > query.north) || 
+        (sample->longitude < query.west) || (sample->longitude > query.east)))
+        return false;
+    return true;
+}
+
+/* -i: what each segment's index says it holds */
+static void print_index(const char *file, const log_reader_t *reader)
+{
+    char first[32], last[32], south[16], west[16], north[16], east[16];
+    
+    if(!reader->has_index)
+    {
+        printf("%s: no index\n", file);
+        return;
+    }
+    format_time(first, reader->index.first);
+    format_time(last, reader->index.last);
+    log_format_coord(south, reader->index.south);
+    log_format_coord(west, reader->index.west);
+    log_format_coord(north, reader->index.north);
+    log_format_coord(east, reader->index.east);
+    printf("%s: %lu samples, %s to %s, %s,%s to %s,%s\n", file, reader->index.samples, first, last, south, west, north, east);
+}
+
+int main(int argc, char *argv[])
+{
+    int format = FORMAT_TEXT, arg = 1, result = 0, logs = 0, skipped = 0;
+    log_reader_t reader;
+    log_entry_t entry;
+    FILE *out = stdout;
+    bool first = true, list = false;
+    unsigned long samples = 0, records = 0, blocks = 0, bad_blocks = 0;
+    
+    for(; (arg < argc) && (argv[arg][0] == '-'); arg++)
+    {
+        if(strcmp(argv[arg], "-i") == 0)
+        {
+            list = true;
+            continue;
+        }
+        if(arg + 1 >= argc)
+            break;
+        if(strcmp(argv[arg], "-f") == 0)
+        {
+            if(strcmp(argv[arg + 1], "csv") == 0)
+                format = FORMAT_CSV;
+            else if(strcmp(argv[arg + 1], "geojson") == 0)
+                format = FORMAT_GEOJSON;
+            else if(strcmp(argv[arg + 1], "text") != 0)
+            {
+                fprintf(stderr, "Unknown format %s\n", argv[arg + 1]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[arg], "-o") == 0)
+        {
+            out = fopen(argv[arg + 1], "w");
+            if(out == NULL)
+            {
+                fprintf(stderr, "Failed to create %s\n", argv[arg + 1]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[arg], "-t") == 0)
+        {
+            if(parse_times(argv[arg + 1]) < 0)
+            {
+                fprintf(stderr, "Bad time range %s\n", argv[arg + 1]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[arg], "-b") == 0)
+        {
+            if(parse_area(argv[arg + 1]) < 0)
+            {
+                fprintf(stderr, "Bad area %s\n", argv[arg + 1]);
+                return -1;
+            }
+        }
+        else
+            break;
+        arg++;
+    }
+    if(arg >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-f text|csv|geojson] [-o output] [-t from,to] [-b south,west,north,east] [-i] <log>...\n", argv[0]);
+        fprintf(stderr, "  -t and -b select samples by UTC time (2012-05-01T10:30:00, or 10:30:00 for logs without dates) and area\n");
+        fprintf(stderr, "  -i lists what each segment holds rather than converting\n");
+        return -1;
+    }
+    
+    if(!list && (format == FORMAT_CSV))
+        fputs("time,latitude,longitude,bssid,channel,quality,signal,noise,radio,essid\n", out);
+    else if(!list && (format == FORMAT_GEOJSON))
+        fputs("{\"type\":\"FeatureCollection\",\"features\":[", out);
+    
+    /* Segments are converted in turn, skipping any whose index rules out the query */
+    for(; (arg < argc) && (result >= 0); arg++)
+    {
+        if(log_reader_open(&reader, argv[arg]) < 0)
+        {
+            result = -1;
+            break;
+        }
+        logs++;
+        if(list)
+        {
+            print_index(argv[arg], &reader);
+            log_reader_close(&reader);
+            continue;
+        }
+        if(reader.has_index && (query.by_time || query.by_area) && skip_segment(&reader.index))
+        {
+            skipped++;
+            log_reader_close(&reader);
+            continue;
+        }
+        
+        while((result = log_read(&reader, &entry)) > 0)
+        {
+            if(!match(&entry.sample))
+                continue;
+            if(format == FORMAT_CSV)
+                write_csv(out, &entry);
+            else if(format == FORMAT_GEOJSON)
+                write_geojson(out, &entry, &first);
+            else
+            {
+                char line[180];
+                log_format_text(line, &entry.sample, entry.essid, entry.radio);
+                fputs(line, out);
+            }
+            samples++;
+        }
+        records += reader.records;
+        blocks += reader.blocks;
+        bad_blocks += reader.bad_blocks;
+        log_reader_close(&reader);
+    }
+    
+    if(!list && (format == FORMAT_GEOJSON))
+        fputs("\n]}\n", out);
+    if(out != stdout)
+    {
+        fclose(out);
+        if(blocks)
+            printf("%lu samples from %lu blocks (%lu damaged)", samples, blocks, bad_blocks);
+        else
+            printf("%lu samples from %lu records", samples, records);
+        printf(" in %d logs, %d skipped by their index\n", logs, skipped);
+    }
+    
+    return (result < 0) ? -1 : 0;
+}
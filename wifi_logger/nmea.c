@@ -0,0 +1,184 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nmea.h"
+
+#include <string.h>
+
+static int hex_digit(char c);
+
+/*
+ * Validates the checksum and splits the sentence into fields in a single pass
+ * over buf. Fields point back into buf, so buf must outlive the sentence.
+ * Returns the number of fields, or -1 if the sentence is malformed or the
+ * checksum doesn't match.
+ */
+int nmea_tokenize(const char *buf, int length, nmea_sentence_t *sentence)
+{
+    const char *p = buf, *end = buf + length;
+    nmea_field_t *field;
+    uint8_t checksum = 0;
+
+    if((length < 1) || (*p != '$'))
+        return -1;
+    p++;
+
+    sentence->count = 1;
+    field = &sentence->field[0];
+    field->start = p;
+
+    for(; p < end; p++)
+    {
+        char c = *p;
+
+        if(c == '*')
+        {
+            int hi, lo;
+
+            field->length = p - field->start;
+            if((end - p) < 3)
+                return -1;
+            hi = hex_digit(p[1]);
+            lo = hex_digit(p[2]);
+            if((hi < 0) || (lo < 0))
+                return -1;
+
+            return (checksum == ((hi << 4) | lo)) ? sentence->count : -1;
+        }
+        else if((c == '\r') || (c == '\n'))
+        {
+            break;  /* End of line before the checksum */
+        }
+
+        checksum ^= c;
+        if(c == ',')
+        {
+            field->length = p - field->start;
+            if(sentence->count == NMEA_MAX_FIELDS)
+                return -1;
+            field = &sentence->field[sentence->count++];
+            field->start = p + 1;
+        }
+    }
+
+    return -1;
+}
+
+bool nmea_field_is(const nmea_field_t *field, const char *str)
+{
+    int length = strlen(str);
+    return (field->length == length) && (memcmp(field->start, str, length) == 0);
+}
+
+/*
+ * Parses a decimal field such as "3644.4728" into an integer scaled by
+ * 10^decimals (eg 36444728 for 4 decimals). Extra fraction digits are
+ * truncated; an empty field is 0.
+ */
+int32_t nmea_field_fixed(const nmea_field_t *field, int decimals)
+{
+    const char *p = field->start, *end = field->start + field->length;
+    int32_t value = 0;
+    bool negative = false;
+
+    if((p < end) && ((*p == '-') || (*p == '+')))
+        negative = (*p++ == '-');
+
+    for(; (p < end) && (*p != '.'); p++)
+        value = value * 10 + (*p - '0');
+
+    if(p < end)
+        p++;    /* Skip the decimal point */
+
+    for(; decimals > 0; decimals--)
+    {
+        value *= 10;
+        if(p < end)
+            value += *p++ - '0';
+    }
+
+    return negative ? -value : value;
+}
+
+char nmea_field_char(const nmea_field_t *field)
+{
+    return (field->length > 0) ? field->start[0] : '\0';
+}
+
+/*
+ * Converts a hhmmss.sss field into milliseconds since midnight, or -1 if the
+ * field is empty.
+ */
+int32_t nmea_field_time(const nmea_field_t *field)
+{
+    int32_t hhmmss;
+
+    if(field->length == 0)
+        return -1;
+
+    hhmmss = nmea_field_fixed(field, 3);
+    return (((hhmmss / 10000000) * 60 + (hhmmss / 100000) % 100) * 60) * 1000 + hhmmss % 100000;
+}
+
+/*
+ * Converts a (d)ddmm.mmmm field and its N/S/E/W hemisphere field into signed
+ * degrees scaled by 1e7, without going through floating point.
+ */
+int32_t nmea_field_coord(const nmea_field_t *field, const nmea_field_t *hemisphere)
+{
+    const char *p = field->start, *end = field->start + field->length;
+    int32_t whole = 0, minutes, degrees;
+    char dir;
+    int i;
+
+    for(; (p < end) && (*p != '.'); p++)
+        whole = whole * 10 + (*p - '0');
+
+    if(p < end)
+        p++;    /* Skip the decimal point */
+
+    /* Minutes scaled by 1e7 */
+    minutes = whole % 100;
+    for(i = 0; i < 7; i++)
+    {
+        minutes *= 10;
+        if(p < end)
+            minutes += *p++ - '0';
+    }
+
+    degrees = (whole / 100) * 10000000 + (minutes + 30) / 60;
+
+    dir = nmea_field_char(hemisphere);
+    return ((dir == 'S') || (dir == 'W')) ? -degrees : degrees;
+}
+
+/*
+ * Private functions
+ */
+
+static int hex_digit(char c)
+{
+    if((c >= '0') && (c <= '9'))
+        return c - '0';
+    else if((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    else if((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    else
+        return -1;
+}
+
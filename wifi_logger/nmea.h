@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NMEA_H
+#define NMEA_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define NMEA_MAX_FIELDS     24
+
+/* A field is a view into the caller's sentence buffer - nothing is copied */
+typedef struct
+{
+    const char *start;
+    int length;
+} nmea_field_t;
+
+typedef struct
+{
+    int count;                              /* Number of fields, including the address field */
+    nmea_field_t field[NMEA_MAX_FIELDS];    /* field[0] is the address, eg "GPRMC" */
+} nmea_sentence_t;
+
+int nmea_tokenize(const char *buf, int length, nmea_sentence_t *sentence);
+bool nmea_field_is(const nmea_field_t *field, const char *str);
+int32_t nmea_field_fixed(const nmea_field_t *field, int decimals);
+char nmea_field_char(const nmea_field_t *field);
+int32_t nmea_field_time(const nmea_field_t *field);
+int32_t nmea_field_coord(const nmea_field_t *field, const nmea_field_t *hemisphere);
+
+#endif
+
@@ -0,0 +1,114 @@
+/*
+ *  Benchmarks NMEA parsing by replaying a recorded NMEA log
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "gps.h"
+#include "nmea.h"
+
+#define DEFAULT_FILE        "data/mish_gps.txt"
+#define DEFAULT_ITERATIONS  200
+
+/* Tokenizes every sentence of an in-memory copy of the log */
+static void bench_tokenize(const char *buf, long length, int iterations)
+{
+    nmea_sentence_t sentence;
+    long sentences = 0, bad = 0;
+    double start, elapsed;
+    int i;
+
+    start = bench_now();
+    for(i = 0; i < iterations; i++)
+    {
+        const char *p = buf, *end = buf + length;
+        while(p < end)
+        {
+            const char *eol = memchr(p, '\n', end - p);
+            int n = (eol ? eol + 1 : end) - p;
+
+            if(nmea_tokenize(p, n, &sentence) < 0)
+                bad++;
+            sentences++;
+            p += n;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    printf("tokenize:   %ld sentences (%ld bad) in %0.3f s, %0.0f sentences/s\n",
+        sentences, bad, elapsed, sentences / elapsed);
+}
+
+/* Replays the log through the same gps_update path used by the logger */
+static void bench_replay(const char *file, int iterations)
+{
+    gps_config_t config;
+    gps_t gps;
+    long sentences = 0, fixes = 0;
+    double start, elapsed;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.dev = file;
+    config.baud = GPS_LOGFILE;
+
+    start = bench_now();
+    for(i = 0; i < iterations; i++)
+    {
+        if(gps_init(&config) < 0)
+            return;
+        while(gps_update(&gps, -1) >= 0)
+        {
+            sentences++;
+            if(gps.valid)
+                fixes++;
+        }
+        gps_close();
+    }
+    elapsed = bench_now() - start;
+
+    printf("gps_update: %ld sentences (%ld fixes) in %0.3f s, %0.0f sentences/s\n",
+        sentences, fixes, elapsed, sentences / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file = (argc > 1) ? argv[1] : DEFAULT_FILE;
+    int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    char *buf;
+    long length;
+
+    buf = bench_load_file(file, &length);
+    if(buf == NULL)
+    {
+        printf("loading %s failed\n", file);
+        return -1;
+    }
+
+    printf("replaying %s x %d\n", file, iterations);
+    bench_tokenize(buf, length, iterations);
+    bench_replay(file, iterations);
+
+    free(buf);
+    return 0;
+}
+
@@ -0,0 +1,338 @@
+/*
+ *  Memory-mapped replay of recorded GPS logs, with a sparse index of RMC
+ *  sentences by UTC time for seeking
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replay.h"
+
+#include "gps.h"
+#include "nmea.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC     0x58494d4eUL    /* "NMIX" */
+#define INDEX_VERSION   1
+
+typedef struct
+{
+    int64_t time;       /* UTC, ms since the Unix epoch */
+    uint64_t offset;    /* Start of the RMC line */
+} index_entry_t;
+
+/* Sidecar file header. The index is only trusted if the log's size and 
+ * modification time still match. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t stride;
+    uint32_t count;
+} index_header_t;
+
+static int64_t rmc_time(const char *line, int length);
+static const char *next_line(size_t *pos, int *length);
+static int index_load(void);
+static int index_build(void);
+static void index_save(void);
+
+static const char *map;
+static size_t map_length, pos;
+static struct stat info;
+static char *sidecar;
+static index_entry_t *entries;
+static int count;
+static bool indexed;
+
+int replay_open(const char *file)
+{
+    int fd;
+    
+    fd = open(file, O_RDONLY);
+    if((fd < 0) || (fstat(fd, &info) < 0))
+    {
+        printf("loading %s logfile failed\n", file);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    
+    map_length = info.st_size;
+    map = (map_length > 0) ? mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        printf("mapping %s logfile failed\n", file);
+        map = NULL;
+        return -1;
+    }
+    
+    /* Replay reads straight through */
+    if(map)
+        madvise((void *)map, map_length, MADV_SEQUENTIAL);
+    
+    sidecar = malloc(strlen(file) + sizeof(".idx"));
+    sprintf(sidecar, "%s.idx", file);
+    
+    pos = 0;
+    entries = NULL;
+    count = 0;
+    indexed = false;
+    
+    return 0;
+}
+
+void replay_close(void)
+{
+    if(map)
+    {
+        munmap((void *)map, map_length);
+        map = NULL;
+    }
+    free(entries);
+    entries = NULL;
+    free(sidecar);
+    sidecar = NULL;
+}
+
+/* Returns the next line (pointing into the mapping) and its length, or -1 at the end */
+int replay_readline(const char **line)
+{
+    int length;
+    
+    *line = next_line(&pos, &length);
+    return (*line) ? length : -1;
+}
+
+/* Returns everything left in the log for binary protocols, or -1 at the end */
+int replay_read(const char **data)
+{
+    int length;
+    
+    if(pos >= map_length)
+        return -1;
+    
+    *data = map + pos;
+    length = (map_length - pos > 0x7fffffff) ? 0x7fffffff : map_length - pos;
+    pos += length;
+    
+    return length;
+}
+
+/*
+ * Positions the replay at the first RMC sentence at or after utc (ms since the
+ * Unix epoch). The index is loaded from, or built and written to, the <log>.idx
+ * sidecar on first use; after that a seek is a binary search plus a scan of at
+ * most REPLAY_INDEX_STRIDE epochs. Returns -1 if nothing in the log is that late.
+ */
+int replay_seek(int64_t utc)
+{
+    int lo, hi;
+    size_t p;
+    
+    if(!indexed && (index_load() < 0) && (index_build() == 0))
+        index_save();
+    indexed = true;
+    
+    /* Last indexed entry before utc */
+    lo = 0;
+    hi = count - 1;
+    p = 0;
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(entries[mid].time < utc)
+        {
+            p = entries[mid].offset;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    
+    while(1)
+    {
+        size_t start = p;
+        int length;
+        const char *line = next_line(&p, &length);
+        
+        if(line == NULL)
+        {
+            pos = map_length;
+            return -1;
+        }
+        if(rmc_time(line, length) >= utc)
+        {
+            pos = start;
+            return 0;
+        }
+    }
+}
+
+/* UTC time of the first RMC sentence in the log, or -1 */
+int64_t replay_first_time(void)
+{
+    size_t p = 0;
+    const char *line;
+    int length;
+    
+    while((line = next_line(&p, &length)) != NULL)
+    {
+        int64_t time = rmc_time(line, length);
+        if(time >= 0)
+            return time;
+    }
+    
+    return -1;
+}
+
+/*
+ * Private functions
+ */
+
+/* Returns the UTC time of an RMC sentence, or -1 for anything else */
+static int64_t rmc_time(const char *line, int length)
+{
+    nmea_sentence_t sentence;
+    const nmea_field_t *f = sentence.field;
+    
+    if((length < 7) || (memcmp(line + 3, "RMC,", 4) != 0))
+        return -1;
+    if((nmea_tokenize(line, length, &sentence) < 10) || (f[1].length == 0) || (f[9].length == 0))
+        return -1;
+    
+    return gps_utc(nmea_field_fixed(&f[9], 0), nmea_field_time(&f[1]));
+}
+
+static const char *next_line(size_t *p, int *length)
+{
+    const char *line, *eol;
+    
+    if(*p >= map_length)
+        return NULL;
+    
+    line = map + *p;
+    eol = memchr(line, '\n', map_length - *p);
+    *length = eol ? (eol - line + 1) : (int)(map_length - *p);
+    *p += *length;
+    
+    return line;
+}
+
+static int index_load(void)
+{
+    index_header_t header;
+    FILE *fp;
+    int result = -1;
+    
+    fp = fopen(sidecar, "rb");
+    if(fp == NULL)
+        return -1;
+    
+    if((fread(&header, sizeof(header), 1, fp) == 1) && (header.magic == INDEX_MAGIC) && 
+        (header.version == INDEX_VERSION) && (header.size == (uint64_t)info.st_size) && 
+        (header.mtime == (int64_t)info.st_mtime))
+    {
+        entries = malloc(header.count * sizeof(index_entry_t) + 1);
+        if(entries && (fread(entries, sizeof(index_entry_t), header.count, fp) == header.count))
+        {
+            count = header.count;
+            result = 0;
+        }
+        else
+        {
+            free(entries);
+            entries = NULL;
+        }
+    }
+    
+    fclose(fp);
+    return result;
+}
+
+static int index_build(void)
+{
+    size_t p = 0;
+    int capacity = 0, rmc = 0;
+    
+    while(p < map_length)
+    {
+        size_t start = p;
+        int length;
+        const char *line = next_line(&p, &length);
+        int64_t time = rmc_time(line, length);
+        
+        if((time < 0) || (rmc++ % REPLAY_INDEX_STRIDE != 0))
+            continue;
+        
+        if(count == capacity)
+        {
+            index_entry_t *grown;
+            capacity = capacity ? capacity * 2 : 256;
+            grown = realloc(entries, capacity * sizeof(index_entry_t));
+            if(grown == NULL)
+            {
+                printf("%s: Allocation failed\n", __FUNCTION__);
+                return -1;
+            }
+            entries = grown;
+        }
+        entries[count].time = time;
+        entries[count].offset = start;
+        count++;
+    }
+    
+    return 0;
+}
+
+/* The sidecar is only a cache, so failing to write it (eg read-only media) is not an error */
+static void index_save(void)
+{
+    index_header_t header;
+    FILE *fp;
+    
+    fp = fopen(sidecar, "wb");
+    if(fp == NULL)
+        return;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.size = info.st_size;
+    header.mtime = info.st_mtime;
+    header.stride = REPLAY_INDEX_STRIDE;
+    header.count = count;
+    
+    if((fwrite(&header, sizeof(header), 1, fp) != 1) || 
+        (fwrite(entries, sizeof(index_entry_t), count, fp) != (size_t)count))
+    {
+        fclose(fp);
+        remove(sidecar);
+        return;
+    }
+    
+    fclose(fp);
+}
+
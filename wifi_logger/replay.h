@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <inttypes.h>
+
+/* Every REPLAY_INDEX_STRIDE'th RMC sentence is indexed */
+#define REPLAY_INDEX_STRIDE     32
+
+int replay_open(const char *file);
+void replay_close(void);
+int replay_readline(const char **line);
+int replay_read(const char **data);
+int replay_seek(int64_t utc);
+int64_t replay_first_time(void);
+
+#endif
+
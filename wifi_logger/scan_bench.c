@@ -0,0 +1,662 @@
+/*
+ *  Benchmarks and checks WEXT, nl80211 and capture scan result parsing by replaying a scan recording
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/wireless.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+
+#include "bench.h"
+#include "wifi_scan.h"
+#include "wifi_nl80211.h"
+#include "wifi_capture.h"
+
+#define DEFAULT_ITERATIONS  200
+#define MAX_RECORDS         4096
+#define SYNTHETIC_SIZE      65536
+#define SYNTHETIC_FAMILY    28      /* nl80211's generic netlink id is assigned at boot; any will do */
+#define DEFAULT_CAPTURE     "data/beacons.pcap"
+#define CAPTURE_WINDOW      1000
+#define CAPTURE_SNAP        2048    /* What the capture filter cuts frames to */
+#define CAPTURE_ITERATIONS  100000
+
+typedef struct
+{
+    const char *buf;
+    int length;
+} scan_buffer_t;
+
+static wifi_record_header_t format;
+static scan_buffer_t scans[MAX_RECORDS];
+static int scan_count;
+
+/* What a synthetic nl80211 dump must parse back to, empty for recordings */
+static wifi_scan_t expected[WIFI_SCAN_MAX_BSS];
+static int expected_count;
+
+/*
+ * data/beacons.pcap holds two capture windows of radiotap frames: beacons,
+ * one with an FCS and one from a hidden network with no radiotap channel,
+ * probe responses, and a data frame that mustn't be counted. Each window must
+ * average to these cells, in the order the BSSs were first heard.
+ */
+typedef struct
+{
+    int window;
+    unsigned char bssid[6];
+    const char *essid;
+    int frequency;
+    int channel;
+    int signal;
+    int noise;
+} capture_cell_t;
+
+static const capture_cell_t capture_expected[] = {
+    {0, {0x00, 0x11, 0x22, 0x33, 0x44, 0x01}, "robotang", 2437, 6, -54, -95},
+    {0, {0x00, 0x11, 0x22, 0x33, 0x44, 0x02}, "neighbour", 2412, 1, -74, -95},
+    {0, {0x00, 0x11, 0x22, 0x33, 0x44, 0x03}, "", 0, 11, -80, 0},
+    {1, {0x00, 0x11, 0x22, 0x33, 0x44, 0x01}, "robotang", 2437, 6, -60, -93},
+    {1, {0x00, 0x11, 0x22, 0x33, 0x44, 0x05}, "robotang-5g", 5180, 36, -66, -92},
+};
+#define CAPTURE_WINDOWS     2
+#define CAPTURE_BEACONS     9   /* Frames that are beacons or probe responses */
+
+/* Indexes the scans of a recording made with the [WIFI] Record option */
+static int load_recording(const char *buf, long length)
+{
+    long offset = sizeof(format);
+
+    if(length < (long)sizeof(format))
+        return -1;
+    memcpy(&format, buf, sizeof(format));
+    if((format.magic != WIFI_RECORD_MAGIC) || (format.version != WIFI_RECORD_VERSION))
+        return -1;
+
+    while((offset + (long)sizeof(wifi_record_t) <= length) && (scan_count < MAX_RECORDS))
+    {
+        wifi_record_t header;
+        memcpy(&header, buf + offset, sizeof(header));
+        offset += sizeof(header);
+        if(offset + header.length > length)
+            break;      /* Truncated by the logger stopping mid-write */
+        scans[scan_count].buf = buf + offset;
+        scans[scan_count].length = header.length;
+        scan_count++;
+        offset += header.length;
+    }
+
+    return scan_count;
+}
+
+/* Appends an event in this host's stream layout */
+static char *put_event(char *p, int cmd, const void *data, int length)
+{
+    struct iw_event iwe;
+
+    iwe.len = IW_EV_LCP_LEN + length;
+    iwe.cmd = cmd;
+    memcpy(p, &iwe, IW_EV_LCP_LEN);
+    memcpy(p + IW_EV_LCP_LEN, data, length);
+    return p + iwe.len;
+}
+
+/* Appends a point event: the length and flags, then the data in place of the pointer (WE-19 onwards) */
+static char *put_point(char *p, int cmd, const void *data, int length, int flags)
+{
+    struct iw_event iwe;
+    uint16_t point[2] = {length, flags};
+
+    iwe.len = IW_EV_POINT_LEN + length;
+    iwe.cmd = cmd;
+    memset(p, 0, IW_EV_POINT_LEN);
+    memcpy(p, &iwe, IW_EV_LCP_LEN);
+    memcpy(p + IW_EV_LCP_LEN, point, sizeof(point));
+    memcpy(p + IW_EV_POINT_LEN, data, length);
+    return p + iwe.len;
+}
+
+/* Builds one scan of cells shaped like cfg80211's SIOCGIWSCAN output */
+static int build_synthetic(int cells)
+{
+    static char buf[SYNTHETIC_SIZE];
+    char *p = buf, *end = buf + sizeof(buf);
+    int i;
+
+    memset(&format, 0, sizeof(format));
+    format.magic = WIFI_RECORD_MAGIC;
+    format.version = WIFI_RECORD_VERSION;
+    format.we_version = WIRELESS_EXT;
+    format.lcp_len = IW_EV_LCP_LEN;
+    format.has_range = 1;
+    format.max_qual = 70;
+    format.max_level = (uint8_t)-110;
+
+    for(i = 0; i < cells; i++)
+    {
+        struct sockaddr ap;
+        struct iw_freq freq;
+        struct iw_quality qual;
+        struct iw_param rate;
+        uint32_t mode = IW_MODE_MASTER;
+        char essid[IW_ESSID_MAX_SIZE + 1], custom[64];
+        unsigned char ie[24];
+        int channel = 1 + (i % 13), j;
+
+        if(end - p < 512)
+            break;
+
+        memset(&ap, 0, sizeof(ap));
+        ap.sa_family = 1;   /* ARPHRD_ETHER */
+        ap.sa_data[0] = 0x02;
+        ap.sa_data[4] = i >> 8;
+        ap.sa_data[5] = i;
+        p = put_event(p, SIOCGIWAP, &ap, sizeof(ap));
+
+        snprintf(essid, sizeof(essid), "network-%d", i);
+        p = put_point(p, SIOCGIWESSID, essid, strlen(essid), 1);
+
+        p = put_event(p, SIOCGIWMODE, &mode, sizeof(mode));
+
+        memset(&freq, 0, sizeof(freq));
+        freq.m = 2407 + 5 * channel;
+        freq.e = 6;
+        p = put_event(p, SIOCGIWFREQ, &freq, sizeof(freq));
+
+        memset(&qual, 0, sizeof(qual));
+        qual.level = (uint8_t)(-40 - (i % 50));
+        qual.qual = qual.level - (uint8_t)-110;
+        qual.updated = IW_QUAL_QUAL_UPDATED | IW_QUAL_LEVEL_UPDATED | IW_QUAL_NOISE_INVALID | IW_QUAL_DBM;
+        p = put_event(p, IWEVQUAL, &qual, sizeof(qual));
+
+        p = put_point(p, SIOCGIWENCODE, NULL, 0, IW_ENCODE_ENABLED | IW_ENCODE_NOKEY);
+
+        /* Rates come in a run of events which the parser has to step over */
+        memset(&rate, 0, sizeof(rate));
+        for(j = 0; j < 8; j++)
+        {
+            rate.value = (j + 1) * 6000000;
+            p = put_event(p, SIOCGIWRATE, &rate, sizeof(rate));
+        }
+
+        for(j = 0; j < (int)sizeof(ie); j++)
+            ie[j] = j;
+        p = put_point(p, IWEVGENIE, ie, sizeof(ie), 0);
+
+        p = put_point(p, IWEVCUSTOM, "tsf=0000001234567890", 20, 0);
+        snprintf(custom, sizeof(custom), "Last beacon: %dms ago", 100 * (i % 30));
+        p = put_point(p, IWEVCUSTOM, custom, strlen(custom), 0);
+    }
+
+    scans[0].buf = buf;
+    scans[0].length = p - buf;
+    scan_count = 1;
+
+    return i;
+}
+
+/* Appends a netlink attribute. With no data it starts a nest, to be sized by the caller. */
+static char *put_attr(char *p, int type, const void *data, int length)
+{
+    struct nlattr attr;
+
+    attr.nla_type = type;
+    attr.nla_len = NLA_HDRLEN + length;
+    memcpy(p, &attr, NLA_HDRLEN);
+    memcpy(p + NLA_HDRLEN, data, length);
+    memset(p + attr.nla_len, 0, NLA_ALIGN(attr.nla_len) - attr.nla_len);
+    return p + NLA_ALIGN(attr.nla_len);
+}
+
+/* Appends an SSID element and a DS parameter set element */
+static char *put_elements(char *p, int type, const char *essid, int channel)
+{
+    unsigned char ie[2 + WIFI_ESSID_MAX + 3 + 10];
+    int length = strlen(essid);
+    static const unsigned char rates[] = {1, 8, 0x82, 0x84, 0x8b, 0x96, 0x0c, 0x12, 0x18, 0x24};
+
+    ie[0] = 0;
+    ie[1] = length;
+    memcpy(ie + 2, essid, length);
+    memcpy(ie + 2 + length, rates, sizeof(rates));
+    ie[2 + length + sizeof(rates)] = 3;
+    ie[3 + length + sizeof(rates)] = 1;
+    ie[4 + length + sizeof(rates)] = channel;
+    return put_attr(p, type, ie, 5 + length + sizeof(rates));
+}
+
+/*
+ * Builds one NL80211_CMD_GET_SCAN dump of cells shaped like cfg80211's, and
+ * the cells it should parse to. Cells vary in which optional attributes they
+ * carry so that each fallback in the parser is taken.
+ */
+static int build_synthetic_nl80211(int cells)
+{
+    static uint32_t buf[SYNTHETIC_SIZE / sizeof(uint32_t)];
+    char *p = (char *)buf, *end = p + sizeof(buf);
+    struct nlmsghdr h;
+    struct genlmsghdr g;
+    int i;
+
+    memset(&format, 0, sizeof(format));
+    format.magic = WIFI_RECORD_MAGIC;
+    format.version = WIFI_RECORD_VERSION;
+    format.backend = WIFI_BACKEND_NL80211;
+
+    memset(&h, 0, sizeof(h));
+    memset(&g, 0, sizeof(g));
+    g.cmd = NL80211_CMD_NEW_SCAN_RESULTS;
+    g.version = 1;
+
+    for(i = 0; (i < cells) && (i < WIFI_SCAN_MAX_BSS); i++)
+    {
+        wifi_scan_t *cell = &expected[i];
+        char *message = p, *bss;
+        uint32_t generation = 7, ifindex = 3, frequency, age;
+        uint64_t tsf = 1234567890;
+        uint16_t interval = 100, capability = 0x0411;
+
+        if(end - p < 512)
+            break;
+
+        memset(cell, 0, sizeof(*cell));
+        cell->bssid[0] = 0x02;
+        cell->bssid[4] = i >> 8;
+        cell->bssid[5] = i;
+        snprintf(cell->essid, sizeof(cell->essid), "network-%d", i);
+        cell->target = true;
+        cell->channel = 1 + (i % 13);
+        cell->frequency = (i % 4 == 3) ? 0 : wifi_channel_to_freq(cell->channel);
+        cell->signal = (i % 5 == 4) ? 20 + (i % 80) : -40 - (i % 50);
+        cell->quality = (i % 5 == 4) ? cell->signal : wifi_quality_from_dbm(cell->signal);
+        cell->age = (i % 6 == 5) ? -1 : 100 * (i % 30);
+
+        p += NLMSG_HDRLEN;
+        memcpy(p, &g, GENL_HDRLEN);
+        p += GENL_HDRLEN;
+        p = put_attr(p, NL80211_ATTR_GENERATION, &generation, sizeof(generation));
+        p = put_attr(p, NL80211_ATTR_IFINDEX, &ifindex, sizeof(ifindex));
+
+        bss = p;
+        p = put_attr(p, NL80211_ATTR_BSS, NULL, 0);
+        p = put_attr(p, NL80211_BSS_BSSID, cell->bssid, 6);
+        if(cell->frequency)
+        {
+            frequency = cell->frequency;
+            p = put_attr(p, NL80211_BSS_FREQUENCY, &frequency, sizeof(frequency));
+        }
+        p = put_attr(p, NL80211_BSS_TSF, &tsf, sizeof(tsf));
+        p = put_attr(p, NL80211_BSS_BEACON_INTERVAL, &interval, sizeof(interval));
+        p = put_attr(p, NL80211_BSS_CAPABILITY, &capability, sizeof(capability));
+
+        /* Probe response elements win over the beacon's, which only some cells have */
+        if(i % 7 != 6)
+            p = put_elements(p, NL80211_BSS_INFORMATION_ELEMENTS, cell->essid, cell->channel);
+        if(i % 7 >= 5)
+            p = put_elements(p, NL80211_BSS_BEACON_IES, (i % 7 == 6) ? cell->essid : "beacon", cell->channel);
+
+        if(i % 5 == 4)
+        {
+            uint8_t unspec = cell->signal;
+            p = put_attr(p, NL80211_BSS_SIGNAL_UNSPEC, &unspec, sizeof(unspec));
+        }
+        else
+        {
+            int32_t mbm = cell->signal * 100;
+            p = put_attr(p, NL80211_BSS_SIGNAL_MBM, &mbm, sizeof(mbm));
+        }
+        if(cell->age >= 0)
+        {
+            age = cell->age;
+            p = put_attr(p, NL80211_BSS_SEEN_MS_AGO, &age, sizeof(age));
+        }
+        ((struct nlattr *)bss)->nla_len = p - bss;
+
+        h.nlmsg_len = p - message;
+        h.nlmsg_type = SYNTHETIC_FAMILY;
+        h.nlmsg_flags = NLM_F_MULTI;
+        h.nlmsg_seq = 1;
+        memcpy(message, &h, sizeof(h));
+    }
+    expected_count = i;
+
+    /* The dump ends with NLMSG_DONE */
+    h.nlmsg_len = NLMSG_LENGTH(sizeof(int));
+    h.nlmsg_type = NLMSG_DONE;
+    memcpy(p, &h, sizeof(h));
+    memset(p + NLMSG_HDRLEN, 0, sizeof(int));
+    p += h.nlmsg_len;
+
+    scans[0].buf = (const char *)buf;
+    scans[0].length = p - (char *)buf;
+    scan_count = 1;
+
+    return i;
+}
+
+/*
+ * Parses each scan once and checks its cells: a synthetic dump must parse to
+ * exactly the cells it was built from, and every recorded cell must at least
+ * be plausible. Returns the number of bad cells.
+ */
+static int check_cells(void)
+{
+    static wifi_scan_result_t result;
+    long cells = 0;
+    int bad = 0, i, j;
+
+    for(i = 0; i < scan_count; i++)
+    {
+        if(wifi_scan_parse(&format, scans[i].buf, scans[i].length, &result, NULL) < 0)
+        {
+            printf("check: scan %d failed to parse\n", i);
+            bad++;
+            continue;
+        }
+        if(expected_count && (result.count != expected_count))
+        {
+            printf("check: %d cells parsed, %d expected\n", result.count, expected_count);
+            bad++;
+        }
+        for(j = 0; j < result.count; j++)
+        {
+            const wifi_scan_t *cell = &result.bss[j];
+            bool ok;
+
+            if(expected_count)
+                ok = (j < expected_count) && (memcmp(cell, &expected[j], sizeof(*cell)) == 0);
+            else
+                ok = (cell->channel > 0) && (cell->quality >= 0) && (cell->quality <= 100) && (cell->age >= -1);
+            if(!ok)
+            {
+                printf("check: scan %d cell %02x:%02x:%02x:%02x:%02x:%02x '%s' ch %d %d MHz q %d sig %d age %d\n",
+                    i, cell->bssid[0], cell->bssid[1], cell->bssid[2], cell->bssid[3], cell->bssid[4], cell->bssid[5],
+                    cell->essid, cell->channel, cell->frequency, cell->quality, cell->signal, cell->age);
+                bad++;
+            }
+        }
+        bad += result.truncated;
+        cells += result.count;
+    }
+
+    printf("check: %ld cells in %d scans, %d bad\n", cells, scan_count, bad);
+    return bad;
+}
+
+/* Parses every recorded scan through the same path used by the logger */
+static void bench_parse(int iterations)
+{
+    static wifi_scan_result_t result;
+    wifi_scan_stats_t stats;
+    long parsed = 0, bss = 0, bytes = 0;
+    double start, elapsed;
+    int i, j;
+
+    memset(&stats, 0, sizeof(stats));
+    start = bench_now();
+    for(i = 0; i < iterations; i++)
+    {
+        for(j = 0; j < scan_count; j++)
+        {
+            if(wifi_scan_parse(&format, scans[j].buf, scans[j].length, &result, &stats) < 0)
+                return;
+            bss += result.count;
+            bytes += scans[j].length;
+            parsed++;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    printf("parse: %ld scans (%ld bytes) in %0.3f s, %0.0f scans/s, %0.0f events/s, %0.0f BSS/s, %0.1f MB/s\n",
+        parsed, bytes, elapsed, parsed / elapsed, stats.events / elapsed, bss / elapsed, bytes / elapsed / 1000000.0);
+}
+
+/* Returns the frame at *offset in an in-memory pcap file and steps past it, or NULL at the end */
+static const unsigned char *pcap_frame(const char *buf, long length, long *offset, int *frame_length)
+{
+    uint32_t magic, record[4];
+
+    memcpy(&magic, buf, sizeof(magic));
+    if(*offset + (long)sizeof(record) > length)
+        return NULL;
+    memcpy(record, buf + *offset, sizeof(record));
+    if(magic != 0xa1b2c3d4UL)
+        record[2] = (record[2] >> 24) | ((record[2] >> 8) & 0xff00) | ((record[2] << 8) & 0xff0000) | (record[2] << 24);
+    if(*offset + (long)sizeof(record) + record[2] > length)
+        return NULL;
+
+    *offset += sizeof(record) + record[2];
+    *frame_length = record[2];
+    return (const unsigned char *)buf + *offset - record[2];
+}
+
+/*
+ * Replays a capture through the capture backend and checks each window's
+ * cells against capture_expected. Returns the number of bad cells.
+ */
+static int check_capture(const char *file)
+{
+    static wifi_scan_result_t result;
+    capture_scanner_t *cap;
+    int count = sizeof(capture_expected) / sizeof(capture_expected[0]);
+    int bad = 0, next = 0, window, i;
+
+    cap = capture_scan_init(file, CAPTURE_WINDOW);
+    if(cap == NULL)
+        return 1;
+
+    for(window = 0; capture_scan_trigger(cap) == 0; window++)
+    {
+        while(capture_scan_poll(cap) == WIFI_SCAN_PENDING)
+            ;
+        if(capture_scan_collect(cap, &result) < 0)
+        {
+            printf("check: window %d failed to collect\n", window);
+            bad++;
+            break;
+        }
+        for(i = 0; i < result.count; i++)
+        {
+            const wifi_scan_t *cell = &result.bss[i];
+            const capture_cell_t *e = ((next < count) && (capture_expected[next].window == window)) ? &capture_expected[next++] : NULL;
+
+            if((e == NULL) || (memcmp(cell->bssid, e->bssid, 6) != 0) || (strcmp(cell->essid, e->essid) != 0) ||
+                (cell->frequency != e->frequency) || (cell->channel != e->channel) ||
+                (cell->signal != e->signal) || (cell->noise != e->noise))
+            {
+                printf("check: window %d cell %02x:%02x:%02x:%02x:%02x:%02x '%s' ch %d %d MHz sig %d noise %d\n",
+                    window, cell->bssid[0], cell->bssid[1], cell->bssid[2], cell->bssid[3], cell->bssid[4], cell->bssid[5],
+                    cell->essid, cell->channel, cell->frequency, cell->signal, cell->noise);
+                bad++;
+            }
+        }
+        for(; (next < count) && (capture_expected[next].window == window); next++)
+        {
+            printf("check: window %d is missing '%s'\n", window, capture_expected[next].essid);
+            bad++;
+        }
+    }
+    capture_scan_close(cap);
+
+    if(window != CAPTURE_WINDOWS)
+    {
+        printf("check: %d windows replayed, %d expected\n", window, CAPTURE_WINDOWS);
+        bad++;
+    }
+    printf("check: %d cells in %d windows, %d bad\n", next, window, bad);
+    return bad;
+}
+
+/*
+ * Sends every frame of a capture through the capture filter on a socket pair.
+ * It must pass just the frames capture_parse takes, cut to the snap length.
+ * Returns the number of frames it got wrong.
+ */
+static int check_filter(const char *buf, long length)
+{
+    static unsigned char received[CAPTURE_SNAP + 1];
+    const unsigned char *frame;
+    capture_frame_t info;
+    long offset = 24;
+    int fds[2], frame_length, passed = 0, bad = 0;
+
+    if((socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) || (capture_attach_filter(fds[1]) < 0))
+    {
+        printf("filter: no socket to attach the capture filter to\n");
+        return 1;
+    }
+
+    while((frame = pcap_frame(buf, length, &offset, &frame_length)) != NULL)
+    {
+        bool wanted = (capture_parse(frame, frame_length, &info) == 0);
+        int n;
+
+        if(send(fds[0], frame, frame_length, 0) != frame_length)
+        {
+            bad++;
+            continue;
+        }
+        n = recv(fds[1], received, sizeof(received), MSG_DONTWAIT);
+        if((n > 0) != wanted)
+        {
+            printf("filter: frame type %02x %s\n", frame[(frame[3] << 8) | frame[2]], wanted ? "dropped" : "passed");
+            bad++;
+        }
+        else if((n > 0) && (n != ((frame_length > CAPTURE_SNAP) ? CAPTURE_SNAP : frame_length)))
+        {
+            printf("filter: %d of a %d byte frame passed\n", n, frame_length);
+            bad++;
+        }
+        passed += (n > 0);
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    if(passed != CAPTURE_BEACONS)
+        bad++;
+    printf("filter: %d frames passed, %d expected, %d wrong\n", passed, CAPTURE_BEACONS, bad);
+    return bad;
+}
+
+/* Parses every frame of a capture, as the capture backend does for each one it receives */
+static void bench_capture(const char *buf, long length, int iterations)
+{
+    const unsigned char *frame;
+    capture_frame_t info;
+    long frames = 0, parsed = 0, bytes = 0, offset;
+    double start, elapsed;
+    int frame_length, i;
+
+    start = bench_now();
+    for(i = 0; i < iterations; i++)
+    {
+        offset = 24;
+        while((frame = pcap_frame(buf, length, &offset, &frame_length)) != NULL)
+        {
+            parsed += (capture_parse(frame, frame_length, &info) == 0);
+            bytes += frame_length;
+            frames++;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    printf("capture_parse: %ld frames (%ld beacons) in %0.3f s, %0.0f frames/s, %0.1f MB/s\n",
+        frames, parsed, elapsed, frames / elapsed, bytes / elapsed / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    char *buf = NULL;
+    long length;
+    int bad;
+
+    if(argc < 2)
+    {
+        printf("Usage: %s <recording | -s cells | -n cells | -c [capture]> [iterations]\n", argv[0]);
+        return -1;
+    }
+
+    if(strcmp(argv[1], "-c") == 0)
+    {
+        const char *file = (argc > 2) ? argv[2] : DEFAULT_CAPTURE;
+        iterations = (argc > 3) ? atoi(argv[3]) : CAPTURE_ITERATIONS;
+        buf = bench_load_file(file, &length);
+        if(buf == NULL)
+        {
+            printf("loading %s failed\n", file);
+            return -1;
+        }
+        printf("replaying capture %s x %d\n", file, iterations);
+        bad = check_capture(file);
+        bad += check_filter(buf, length);
+        bench_capture(buf, length, iterations);
+        free(buf);
+        return bad ? -1 : 0;
+    }
+
+    if(strcmp(argv[1], "-s") == 0)
+    {
+        int cells;
+        iterations = (argc > 3) ? atoi(argv[3]) : DEFAULT_ITERATIONS;
+        cells = build_synthetic((argc > 2) ? atoi(argv[2]) : 40);
+        printf("parsing a synthetic scan of %d cells (%d bytes) x %d\n", cells, scans[0].length, iterations);
+    }
+    else if(strcmp(argv[1], "-n") == 0)
+    {
+        int cells;
+        iterations = (argc > 3) ? atoi(argv[3]) : DEFAULT_ITERATIONS;
+        cells = build_synthetic_nl80211((argc > 2) ? atoi(argv[2]) : 40);
+        printf("parsing a synthetic nl80211 dump of %d cells (%d bytes) x %d\n", cells, scans[0].length, iterations);
+    }
+    else
+    {
+        buf = bench_load_file(argv[1], &length);
+        if(buf == NULL)
+        {
+            printf("loading %s failed\n", argv[1]);
+            return -1;
+        }
+        if(load_recording(buf, length) < 0)
+        {
+            printf("%s is not a scan recording\n", argv[1]);
+            free(buf);
+            return -1;
+        }
+        if(format.backend == WIFI_BACKEND_NL80211)
+            printf("replaying %d nl80211 dumps from %s x %d\n", scan_count, argv[1], iterations);
+        else
+            printf("replaying %d scans from %s (WE-%d, %d byte event headers) x %d\n",
+                scan_count, argv[1], format.we_version, format.lcp_len, iterations);
+        if((format.backend == WIFI_BACKEND_WEXT) && (format.lcp_len != IW_EV_LCP_LEN))
+            printf("recording was made on a host with %d byte event headers, this host uses %d\n", format.lcp_len, (int)IW_EV_LCP_LEN);
+    }
+
+    bad = check_cells();
+    bench_parse(iterations);
+
+    free(buf);
+    return bad ? -1 : 0;
+}
+
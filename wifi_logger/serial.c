@@ -16,6 +16,7 @@
  */
 
 #include "serial.h"
+#include "termios2.h"
 
 #include <fcntl.h>
 #include <termios.h>
@@ -23,17 +24,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <string.h>
+#include <errno.h>
+#include <linux/serial.h>
 
-#define BUFFER_LENGTH   200
+/* Largest relative error (in percent) tolerated between requested and applied baud rates */
+#define BAUD_TOLERANCE  2
 
-static int fd;
-static char rx[BUFFER_LENGTH];
+/* Must be a power of two */
+#define RING_LENGTH     4096
+#define RING_MASK       (RING_LENGTH - 1)
 
-int serial_init(const char *dev, int baud, bool blocking)
+static const struct
+{
+    int baud;
+    speed_t speed;
+} bauds[] =
+{
+    { 4800, B4800 },
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 500000, B500000 },
+    { 576000, B576000 },
+    { 921600, B921600 },
+    { 1000000, B1000000 },
+};
+
+static int serial_custom_baud(const char *dev, int baud, bool strict);
+static void serial_reset(void);
+static int serial_fill(int timeout);
+static unsigned long serial_overruns(void);
+
+static int fd = -1;
+
+/* Received characters live in rx[tail..head), wrapping. Everything before
+ * scan has already been searched for a newline. The counters run freely and
+ * are masked on access. */
+static char rx[RING_LENGTH];
+static unsigned int head, tail, scan;
+static char line_buf[SERIAL_MAX_LINE + 1];
+static serial_stats_t stats;
+static unsigned long overruns;
+
+int serial_init(const char *dev, int baud, bool blocking, bool strict)
 {
     struct termios options;
-    int flags;
+    int flags, i;
+    bool custom = false;
     
     flags = O_RDWR;
     if(!blocking)
@@ -52,53 +96,43 @@ int serial_init(const char *dev, int baud, bool blocking)
     tcflush(fd, TCIFLUSH);
     tcgetattr(fd, &options);
     
-    switch(baud)
+    for(i = 0; i < (int)(sizeof(bauds) / sizeof(bauds[0])); i++)
     {
-        case 4800:
-        {
-            cfsetispeed(&options, B4800);
-            cfsetospeed(&options, B4800);
-        } break;
-        
-        case 9600:    
-        {
-            cfsetispeed(&options, B9600);
-            cfsetospeed(&options, B9600);
-        } break;
-        
-        case 38400:
-        {
-            cfsetispeed(&options, B38400);
-            cfsetospeed(&options, B38400);
-        } break;
-        
-        case 57600:
-        {
-            cfsetispeed(&options, B57600);
-            cfsetospeed(&options, B57600);
-        } break;
-        
-        case 115200:    
-        {
-            cfsetispeed(&options, B115200);
-            cfsetospeed(&options, B115200);
-        } break;
-        
-        default:
-        {
-            cfsetispeed(&options, B9600);
-            cfsetospeed(&options, B9600);
-        } break;
+        if(bauds[i].baud == baud)
+            break;
+    }
+    
+    if(i < (int)(sizeof(bauds) / sizeof(bauds[0])))
+    {
+        cfsetispeed(&options, bauds[i].speed);
+        cfsetospeed(&options, bauds[i].speed);
+    }
+    else
+    {
+        /* Set via termios2 below, once the rest of the settings are in place */
+        cfsetispeed(&options, B9600);
+        cfsetospeed(&options, B9600);
+        custom = true;
     }
         
     options.c_cflag &= ~CRTSCTS;
     options.c_lflag = 0;
     options.c_iflag = 0;
     options.c_oflag = 0;
+    options.c_cc[VMIN] = blocking ? 1 : 0;
+    options.c_cc[VTIME] = 0;
 
     tcsetattr(fd, TCSANOW, &options);
     
-    rx[0] = '\0';
+    if(custom && (serial_custom_baud(dev, baud, strict) < 0))
+    {
+        serial_close();
+        return -1;
+    }
+    
+    serial_reset();
+    memset(&stats, 0, sizeof(stats));
+    overruns = serial_overruns();
     
     return 0;
 }
@@ -116,53 +150,99 @@ void serial_flush(void)
 {
     if(fd != -1) 
         ioctl(fd, TCFLSH, 2);
+    serial_reset();
 }
 
-int serial_readline(char *data)
+/*
+ * Hands out the next complete line (including its newline) from the receive
+ * ring, reading more only when no complete line is buffered. One read() can
+ * therefore satisfy many calls. *line stays valid until the next call.
+ * Waits up to timeout milliseconds (-1 forever) for data; returns the line
+ * length, 0 on timeout, or -1 on error.
+ */
+int serial_readline(const char **line, int timeout)
 {
-    int result;
+    if(fd == -1)
+        return -1;
     
-    if(fd != -1)
+    while(1)
     {
-        int length, i;
-        bool complete;
+        int result;
         
-        complete = false;
-                
-        do
+        /* Look for a newline in the characters not yet searched */
+        while(scan != head)
         {
-            length = strlen(rx);
-            /* Append read characters onto end of buffer */
-            result = read(fd, rx + length, BUFFER_LENGTH - length);
-            if(result > 0)
+            if(rx[scan++ & RING_MASK] == '\n')
             {
-                char *pch;
+                unsigned int start = tail, length = scan - tail;
                 
-                rx[length + result] = '\0';
-                length += result;
+                tail = scan;
+                if(length > SERIAL_MAX_LINE)
+                {
+                    stats.overlong++;
+                    continue;
+                }
                 
-                /* Look for new line character */
-                pch = strchr(rx, '\n');
-                i = pch - rx + 1; 
-                if(i > 0)
+                stats.lines++;
+                if((start & RING_MASK) + length <= RING_LENGTH)
                 {
-                    char tmp[BUFFER_LENGTH];
-                    /* Copy complete message to data and remove this from rx buffer */
-                    strcpy(tmp, rx);                    
-                    strncpy(data, rx, i);
-                    data[i] = '\0';
-                    strcpy(rx, tmp + i);
-                    rx[length - i] = '\0';
-                    complete = true;
+                    /* Contiguous in the ring, no copy needed */
+                    *line = &rx[start & RING_MASK];
                 }
-            }            
-            usleep(10000);    
-        } while(!complete);
+                else
+                {
+                    unsigned int first = RING_LENGTH - (start & RING_MASK);
+                    memcpy(line_buf, &rx[start & RING_MASK], first);
+                    memcpy(line_buf + first, rx, length - first);
+                    line_buf[length] = '\0';
+                    *line = line_buf;
+                }
+                return length;
+            }
+        }
+        
+        /* A full ring without a newline can only be a runaway line */
+        if(head - tail == RING_LENGTH)
+        {
+            stats.overlong++;
+            tail = head;
+        }
+        
+        result = serial_fill(timeout);
+        if((result < 0) || ((result == 0) && (timeout >= 0)))
+            return result;
     }
-    else
-        result = -1;
+}
+
+/*
+ * Raw counterpart of serial_readline for binary protocols: hands out the
+ * longest contiguous run of buffered bytes, reading only when nothing is
+ * buffered. Same return values and *data lifetime as serial_readline.
+ */
+int serial_read(const char **data, int timeout)
+{
+    unsigned int start, length;
     
-    return result;
+    if(fd == -1)
+        return -1;
+    
+    if(head == tail)
+    {
+        int result = serial_fill(timeout);
+        if(result <= 0)
+            return result;
+    }
+    
+    start = tail & RING_MASK;
+    length = head - tail;
+    if(start + length > RING_LENGTH)
+        length = RING_LENGTH - start;
+    
+    *data = &rx[start];
+    tail += length;
+    scan = tail;
+    
+    return length;
 }
 
 int serial_writeline(char *data) 
@@ -180,3 +260,92 @@ int serial_writeline(char *data)
     return result;
 }
 
+void serial_get_stats(serial_stats_t *s)
+{
+    *s = stats;
+    s->dropped = serial_overruns() - overruns;
+}
+
+/*
+ * Private functions
+ */
+
+/*
+ * Applies a rate that has no Bxxx constant through termios2/BOTHER and checks
+ * what the driver made of it. Unless strict, failures fall back to 9600 baud
+ * with a warning rather than an error.
+ */
+static int serial_custom_baud(const char *dev, int baud, bool strict)
+{
+    int actual = -1;
+    
+    if(termios2_set_baud(fd, baud) == 0)
+        actual = termios2_get_baud(fd);
+    
+    if(actual <= 0)
+    {
+        printf("%s: %d baud is not supported by the driver\n", dev, baud);
+        if(strict)
+            return -1;
+        printf("%s: falling back to 9600 baud\n", dev);
+    }
+    else if(abs(actual - baud) * 100 > baud * BAUD_TOLERANCE)
+    {
+        printf("%s: requested %d baud but the UART is running at %d\n", dev, baud, actual);
+        if(strict)
+            return -1;
+    }
+    
+    return 0;
+}
+
+static void serial_reset(void)
+{
+    head = tail = scan = 0;
+}
+
+/* Waits for data and reads as much as fits into the free space of the ring */
+static int serial_fill(int timeout)
+{
+    struct pollfd pfd;
+    struct iovec iov[2];
+    unsigned int start = head & RING_MASK, space = RING_LENGTH - (head - tail);
+    int result;
+    
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do
+    {
+        result = poll(&pfd, 1, timeout);
+    } while((result < 0) && (errno == EINTR));
+    if(result <= 0)
+        return result;
+    
+    /* The free space may wrap around the end of the ring */
+    iov[0].iov_base = &rx[start];
+    iov[0].iov_len = (start + space <= RING_LENGTH) ? space : RING_LENGTH - start;
+    iov[1].iov_base = rx;
+    iov[1].iov_len = space - iov[0].iov_len;
+    
+    result = readv(fd, iov, (iov[1].iov_len > 0) ? 2 : 1);
+    if(result < 0)
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+    if(result == 0)
+        return -1;  /* Hangup */
+    
+    head += result;
+    stats.reads++;
+    stats.bytes += result;
+    
+    return result;
+}
+
+static unsigned long serial_overruns(void)
+{
+    struct serial_icounter_struct icount;
+    
+    if(ioctl(fd, TIOCGICOUNT, &icount) < 0)
+        return 0;
+    
+    return icount.overrun + icount.buf_overrun;
+}
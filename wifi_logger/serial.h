@@ -20,11 +20,24 @@
 
 #include <stdbool.h>
 
-int serial_init(const char *dev, int baud, bool blocking);
+#define SERIAL_MAX_LINE     256
+
+typedef struct
+{
+    unsigned long reads;        /* read() calls that returned data */
+    unsigned long bytes;
+    unsigned long lines;        /* Complete lines handed out */
+    unsigned long overlong;     /* Lines discarded for exceeding SERIAL_MAX_LINE */
+    unsigned long dropped;      /* Characters lost to UART/tty overruns, if the driver reports them */
+} serial_stats_t;
+
+int serial_init(const char *dev, int baud, bool blocking, bool strict);
 void serial_close(void);
 void serial_flush(void);
-int serial_readline(char *data);
+int serial_readline(const char **line, int timeout);
+int serial_read(const char **data, int timeout);
 int serial_writeline(char *data);
+void serial_get_stats(serial_stats_t *stats);
 
 #endif
 
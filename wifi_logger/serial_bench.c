@@ -0,0 +1,134 @@
+/*
+ *  Measures sustained NMEA throughput of the serial reader at a given baud
+ *  rate, using a pseudo-terminal pair in place of a real UART
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "serial.h"
+#include "nmea.h"
+
+#define DEFAULT_BAUD        230400
+#define DEFAULT_SECONDS     5
+#define DEFAULT_FILE        "data/mish_gps.txt"
+#define TICK_US             10000
+
+/* Writes the log round and round into the master side, paced like a UART at baud 8N1 */
+static void writer(int master, const char *buf, long length, int baud)
+{
+    double start = bench_now(), rate = baud / 10.0;
+    long sent = 0, pos = 0;
+
+    while(1)
+    {
+        long due = (long)((bench_now() - start) * rate) - sent;
+
+        while(due > 0)
+        {
+            long n = (due < length - pos) ? due : length - pos;
+
+            n = write(master, buf + pos, n);
+            if(n <= 0)
+                _exit(0);
+            sent += n;
+            due -= n;
+            pos = (pos + n) % length;
+        }
+        usleep(TICK_US);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int baud = (argc > 1) ? atoi(argv[1]) : DEFAULT_BAUD;
+    int seconds = (argc > 2) ? atoi(argv[2]) : DEFAULT_SECONDS;
+    const char *file = (argc > 3) ? argv[3] : DEFAULT_FILE;
+    long length, lines = 0, bad = 0, bytes = 0;
+    double start, elapsed;
+    serial_stats_t stats;
+    int master;
+    pid_t pid;
+    char *buf;
+
+    buf = bench_load_file(file, &length);
+    if(buf == NULL)
+    {
+        printf("loading %s failed\n", file);
+        return -1;
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        printf("Opening pseudo-terminal failed\n");
+        return -1;
+    }
+
+    /* Configure the slave before anything is written, so the line discipline is raw */
+    if(serial_init(ptsname(master), baud, false, false) < 0)
+        return -1;
+
+    pid = fork();
+    if(pid == 0)
+        writer(master, buf, length, baud);
+
+    printf("%d baud for %d s: offered %0.0f bytes/s\n", baud, seconds, baud / 10.0);
+
+    start = bench_now();
+    do
+    {
+        const char *line;
+        nmea_sentence_t sentence;
+        int n = serial_readline(&line, 100);
+
+        if(n < 0)
+            break;
+        if(n > 0)
+        {
+            lines++;
+            bytes += n;
+            if(nmea_tokenize(line, n, &sentence) < 0)
+                bad++;
+        }
+    } while(bench_now() - start < seconds);
+    elapsed = bench_now() - start;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    serial_get_stats(&stats);
+    serial_close();
+    close(master);
+
+    printf("received:  %ld lines (%ld bad), %0.0f lines/s, %0.0f bytes/s\n", 
+        lines, bad, lines / elapsed, bytes / elapsed);
+    printf("reader:    %lu reads (%0.1f lines/read), %lu overlong, %lu dropped\n", 
+        stats.reads, stats.reads ? (double)stats.lines / stats.reads : 0.0, stats.overlong, stats.dropped);
+
+    free(buf);
+    return 0;
+}
+
@@ -0,0 +1,234 @@
+/*
+ *  Lock-free single-producer/single-consumer rings linking the logger's threads
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spsc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * head and tail run freely and are masked on use, so head - tail is the depth
+ * even across wrap. Each is written by one side only; the barriers order the
+ * slot contents against the index that hands them over. gcc 4.6 predates the
+ * __atomic builtins, so this uses __sync_synchronize (a full sync on MIPS).
+ */
+#define barrier()   __sync_synchronize()
+
+/* Returns 0, or -1 if length isn't a power of two or the slots can't be allocated */
+int spsc_init(spsc_t *queue, const char *name, int slot_size, int length)
+{
+    memset(queue, 0, sizeof(*queue));
+    if((length <= 0) || (length & (length - 1)))
+    {
+        printf("%s queue length %d is not a power of two\n", name, length);
+        return -1;
+    }
+    
+    queue->slots = calloc(length, slot_size);
+    if(queue->slots == NULL)
+    {
+        printf("Failed to allocate %d byte %s queue\n", length * slot_size, name);
+        return -1;
+    }
+    queue->name = name;
+    queue->slot_size = slot_size;
+    queue->length = length;
+    queue->mask = length - 1;
+    
+    return 0;
+}
+
+void spsc_close(spsc_t *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+/* Producer: returns the next free slot to fill in, or NULL if the ring is full */
+void *spsc_reserve(spsc_t *queue)
+{
+    unsigned int head = queue->head;
+    
+    if(head - queue->tail == queue->length)
+        return NULL;
+    /* The consumer may still have been reading this slot until tail moved past it */
+    barrier();
+    
+    return queue->slots + (head & queue->mask) * queue->slot_size;
+}
+
+/* Producer: hands the reserved slot to the consumer */
+void spsc_publish(spsc_t *queue)
+{
+    unsigned int depth;
+    
+    barrier();
+    queue->head++;
+    
+    queue->pushed++;
+    depth = queue->head - queue->tail;
+    if(depth > queue->max_depth)
+        queue->max_depth = depth;
+    
+    if(queue->published)
+        spsc_event_signal(queue->published);
+}
+
+/* Producer: counts an item discarded because spsc_reserve found the ring full */
+void spsc_drop(spsc_t *queue)
+{
+    queue->dropped++;
+}
+
+/* Consumer: returns the oldest published slot without removing it, or NULL if empty */
+void *spsc_peek(spsc_t *queue)
+{
+    unsigned int tail = queue->tail;
+    
+    if(queue->head == tail)
+        return NULL;
+    /* Don't read the slot before seeing the head that published it */
+    barrier();
+    
+    return queue->slots + (tail & queue->mask) * queue->slot_size;
+}
+
+/* Consumer: frees the slot returned by spsc_peek for reuse */
+void spsc_release(spsc_t *queue)
+{
+    barrier();
+    queue->tail++;
+    
+    if(queue->released)
+        spsc_event_signal(queue->released);
+}
+
+/* Either side: a snapshot of the items waiting */
+int spsc_depth(const spsc_t *queue)
+{
+    return queue->head - queue->tail;
+}
+
+void spsc_print_stats(const spsc_t *queue)
+{
+    printf("%s queue: %lu pushed, %lu dropped, max depth %u of %u\n", queue->name, 
+        queue->pushed, queue->dropped, queue->max_depth, queue->length);
+}
+
+/* Attaches events for the consumer to wait on for items, and the producer for room. Either may be NULL. */
+void spsc_notify(spsc_t *queue, spsc_event_t *published, spsc_event_t *released)
+{
+    queue->published = published;
+    queue->released = released;
+}
+
+/* Returns 0, or -1 if the event can't be created */
+int spsc_event_init(spsc_event_t *event)
+{
+    pthread_condattr_t attr;
+    
+    memset(event, 0, sizeof(*event));
+    if(pthread_mutex_init(&event->lock, NULL) != 0)
+    {
+        printf("Failed to create queue event\n");
+        return -1;
+    }
+    
+    /* Timeouts run on the monotonic clock like everything else, so setting the time can't stretch them */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if(pthread_cond_init(&event->cond, &attr) != 0)
+    {
+        printf("Failed to create queue event\n");
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&event->lock);
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+    event->initialised = true;
+    
+    return 0;
+}
+
+void spsc_event_close(spsc_event_t *event)
+{
+    if(!event->initialised)
+        return;
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->lock);
+    event->initialised = false;
+}
+
+/* Wakes every thread waiting on the event */
+void spsc_event_signal(spsc_event_t *event)
+{
+    pthread_mutex_lock(&event->lock);
+    event->count++;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->lock);
+}
+
+/* The event's count, to be read before checking the queues and passed to spsc_event_wait */
+unsigned int spsc_event_count(spsc_event_t *event)
+{
+    unsigned int count;
+    
+    pthread_mutex_lock(&event->lock);
+    count = event->count;
+    pthread_mutex_unlock(&event->lock);
+    
+    return count;
+}
+
+/*
+ * Sleeps until the event is signalled after its count read seen, or timeout
+ * ms pass. A negative timeout waits for the signal however long it takes.
+ */
+void spsc_event_wait(spsc_event_t *event, unsigned int seen, int timeout)
+{
+    struct timespec deadline;
+    
+    if(timeout == 0)
+        return;
+    if(timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    
+    pthread_mutex_lock(&event->lock);
+    while(event->count == seen)
+    {
+        if(timeout < 0)
+            pthread_cond_wait(&event->cond, &event->lock);
+        else if(pthread_cond_timedwait(&event->cond, &event->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&event->lock);
+}
+
@@ -0,0 +1,87 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SPSC_CACHE_LINE     32      /* 24Kc/34Kc/74Kc data cache lines */
+
+/*
+ * Lets a thread sleep until another publishes to, or releases from, any of
+ * the queues it is attached to. count moves on with every signal, so a waiter
+ * that read it before looking at its queues can't miss a signal sent between
+ * the look and the wait.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int count;
+    bool initialised;
+} spsc_event_t;
+
+/*
+ * A bounded single-producer/single-consumer ring of fixed size slots. One
+ * thread reserves and publishes, one other peeks and releases, with no locks
+ * beyond those of any events attached with spsc_notify.
+ * Slots are filled and read in place so large items aren't copied through it.
+ */
+typedef struct
+{
+    unsigned char *slots;
+    int slot_size;
+    unsigned int length;            /* Slots, a power of two */
+    unsigned int mask;
+    const char *name;
+    
+    /* Written by the producer only */
+    volatile unsigned int head;
+    unsigned long pushed;
+    unsigned long dropped;          /* Items the producer gave up on because the ring was full */
+    unsigned int max_depth;
+    char pad[SPSC_CACHE_LINE];      /* Keeps the two ends on separate cache lines */
+    
+    /* Written by the consumer only */
+    volatile unsigned int tail;
+    
+    /* Signalled, if set, when an item is published and when a slot is released */
+    spsc_event_t *published;
+    spsc_event_t *released;
+} spsc_t;
+
+int spsc_init(spsc_t *queue, const char *name, int slot_size, int length);
+void spsc_close(spsc_t *queue);
+void *spsc_reserve(spsc_t *queue);
+void spsc_publish(spsc_t *queue);
+void spsc_drop(spsc_t *queue);
+void *spsc_peek(spsc_t *queue);
+void spsc_release(spsc_t *queue);
+int spsc_depth(const spsc_t *queue);
+void spsc_print_stats(const spsc_t *queue);
+void spsc_notify(spsc_t *queue, spsc_event_t *published, spsc_event_t *released);
+
+int spsc_event_init(spsc_event_t *event);
+void spsc_event_close(spsc_event_t *event);
+void spsc_event_signal(spsc_event_t *event);
+unsigned int spsc_event_count(spsc_event_t *event);
+void spsc_event_wait(spsc_event_t *event, unsigned int seen, int timeout);
+
+#endif
+
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "termios2.h"
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+/* Sets both directions to baud, leaving the rest of the line settings alone */
+int termios2_set_baud(int fd, int baud)
+{
+    struct termios2 options;
+
+    if(ioctl(fd, TCGETS2, &options) < 0)
+        return -1;
+
+    options.c_cflag &= ~CBAUD;
+    options.c_cflag |= BOTHER;
+    options.c_ospeed = baud;
+#ifdef IBSHIFT
+    options.c_cflag &= ~(CBAUD << IBSHIFT);
+    options.c_cflag |= BOTHER << IBSHIFT;
+#endif
+    options.c_ispeed = baud;
+
+    return ioctl(fd, TCSETS2, &options);
+}
+
+/* Returns the output baud rate the driver actually applied */
+int termios2_get_baud(int fd)
+{
+    struct termios2 options;
+
+    if(ioctl(fd, TCGETS2, &options) < 0)
+        return -1;
+
+    return options.c_ospeed;
+}
+
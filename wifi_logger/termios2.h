@@ -0,0 +1,30 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMIOS2_H
+#define TERMIOS2_H
+
+/* 
+ * Arbitrary baud rates through the Linux termios2/BOTHER interface. This 
+ * lives in its own file because <asm/termbits.h> can't be included 
+ * alongside libc's <termios.h>.
+ */
+int termios2_set_baud(int fd, int baud);
+int termios2_get_baud(int fd);
+
+#endif
+
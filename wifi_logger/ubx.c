@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ubx.h"
+
+#include <string.h>
+
+#define UBX_SYNC1           0xB5
+#define UBX_SYNC2           0x62
+
+/* NAV-PVT grew from 84 bytes (u-blox 7) to 92 bytes (u-blox 8 and later) */
+#define NAV_PVT_MIN_LENGTH  84
+#define NAV_DOP_LENGTH      18
+
+enum
+{
+    STATE_SYNC1,
+    STATE_SYNC2,
+    STATE_CLASS,
+    STATE_ID,
+    STATE_LENGTH1,
+    STATE_LENGTH2,
+    STATE_PAYLOAD,
+    STATE_CK_A,
+    STATE_CK_B
+};
+
+static uint16_t get_u2(const uint8_t *p);
+static uint32_t get_u4(const uint8_t *p);
+
+void ubx_init(ubx_parser_t *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->state = STATE_SYNC1;
+}
+
+/*
+ * Feeds bytes into the frame decoder, stopping as soon as a frame with a good
+ * checksum is complete (*complete is then set and the frame can be inspected
+ * until the next call). Returns the number of bytes consumed.
+ */
+int ubx_feed(ubx_parser_t *parser, const uint8_t *buf, int length, bool *complete)
+{
+    int i;
+
+    *complete = false;
+
+    for(i = 0; i < length; i++)
+    {
+        uint8_t c = buf[i];
+
+        /* Fletcher checksum runs over class, id, length and payload */
+        if((parser->state >= STATE_CLASS) && (parser->state <= STATE_PAYLOAD))
+        {
+            parser->ck_a += c;
+            parser->ck_b += parser->ck_a;
+        }
+
+        switch(parser->state)
+        {
+            case STATE_SYNC1:
+            {
+                if(c == UBX_SYNC1)
+                    parser->state = STATE_SYNC2;
+            } break;
+
+            case STATE_SYNC2:
+            {
+                parser->state = (c == UBX_SYNC2) ? STATE_CLASS : STATE_SYNC1;
+                parser->ck_a = parser->ck_b = 0;
+            } break;
+
+            case STATE_CLASS:
+            {
+                parser->cls = c;
+                parser->state = STATE_ID;
+            } break;
+
+            case STATE_ID:
+            {
+                parser->id = c;
+                parser->state = STATE_LENGTH1;
+            } break;
+
+            case STATE_LENGTH1:
+            {
+                parser->length = c;
+                parser->state = STATE_LENGTH2;
+            } break;
+
+            case STATE_LENGTH2:
+            {
+                parser->length |= c << 8;
+                parser->count = 0;
+                if(parser->length > UBX_MAX_PAYLOAD)
+                {
+                    parser->errors++;
+                    parser->state = STATE_SYNC1;
+                }
+                else
+                    parser->state = (parser->length > 0) ? STATE_PAYLOAD : STATE_CK_A;
+            } break;
+
+            case STATE_PAYLOAD:
+            {
+                parser->payload[parser->count++] = c;
+                if(parser->count == parser->length)
+                    parser->state = STATE_CK_A;
+            } break;
+
+            case STATE_CK_A:
+            {
+                if(c == parser->ck_a)
+                    parser->state = STATE_CK_B;
+                else
+                {
+                    parser->errors++;
+                    parser->state = STATE_SYNC1;
+                }
+            } break;
+
+            case STATE_CK_B:
+            {
+                parser->state = STATE_SYNC1;
+                if(c == parser->ck_b)
+                {
+                    parser->frames++;
+                    *complete = true;
+                    return i + 1;
+                }
+                parser->errors++;
+            } break;
+        }
+    }
+
+    return length;
+}
+
+bool ubx_is(const ubx_parser_t *parser, uint8_t cls, uint8_t id)
+{
+    return (parser->cls == cls) && (parser->id == id);
+}
+
+bool ubx_nav_pvt(const ubx_parser_t *parser, ubx_nav_pvt_t *pvt)
+{
+    const uint8_t *p = parser->payload;
+
+    if(!ubx_is(parser, UBX_CLASS_NAV, UBX_NAV_PVT) || (parser->length < NAV_PVT_MIN_LENGTH))
+        return false;
+
+    pvt->itow = get_u4(p);
+    pvt->year = get_u2(p + 4);
+    pvt->month = p[6];
+    pvt->day = p[7];
+    pvt->hour = p[8];
+    pvt->min = p[9];
+    pvt->sec = p[10];
+    pvt->valid_time = (p[11] & 0x03) == 0x03;     /* validDate and validTime */
+    pvt->nano = (int32_t)get_u4(p + 16);
+    pvt->fix_type = p[20];
+    pvt->fix_ok = (p[21] & 0x01) ? true : false;
+    pvt->num_sv = p[23];
+    pvt->lon = (int32_t)get_u4(p + 24);
+    pvt->lat = (int32_t)get_u4(p + 28);
+    pvt->height_msl = (int32_t)get_u4(p + 36);
+    pvt->ground_speed = (int32_t)get_u4(p + 60);
+    pvt->heading = (int32_t)get_u4(p + 64);
+    pvt->pdop = get_u2(p + 76);
+
+    return true;
+}
+
+bool ubx_nav_dop(const ubx_parser_t *parser, uint32_t *itow, int *hdop)
+{
+    const uint8_t *p = parser->payload;
+
+    if(!ubx_is(parser, UBX_CLASS_NAV, UBX_NAV_DOP) || (parser->length < NAV_DOP_LENGTH))
+        return false;
+
+    *itow = get_u4(p);
+    *hdop = get_u2(p + 12);
+
+    return true;
+}
+
+/*
+ * Private functions
+ */
+
+/* UBX is little endian and the payload has no alignment guarantees */
+static uint16_t get_u2(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u4(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
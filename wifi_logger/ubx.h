@@ -0,0 +1,66 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UBX_H
+#define UBX_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define UBX_MAX_PAYLOAD     512
+
+#define UBX_CLASS_NAV       0x01
+#define UBX_NAV_DOP         0x04
+#define UBX_NAV_PVT         0x07
+
+/* Streaming u-blox binary frame decoder */
+typedef struct
+{
+    int state;
+    uint8_t cls, id;
+    uint16_t length, count;
+    uint8_t ck_a, ck_b;
+    uint8_t payload[UBX_MAX_PAYLOAD];
+    unsigned long frames;
+    unsigned long errors;       /* Checksum failures and oversized frames */
+} ubx_parser_t;
+
+/* The subset of UBX-NAV-PVT used by the logger, in the receiver's own units */
+typedef struct
+{
+    uint32_t itow;              /* GPS time of week, ms */
+    int year, month, day, hour, min, sec;
+    int32_t nano;               /* Fraction of second, ns (may be negative) */
+    bool valid_time;
+    int fix_type;               /* 0 none, 2 2D, 3 3D, ... */
+    bool fix_ok;
+    int num_sv;
+    int32_t lon, lat;           /* 1e-7 degrees */
+    int32_t height_msl;         /* mm */
+    int32_t ground_speed;       /* mm/s */
+    int32_t heading;            /* 1e-5 degrees */
+    int pdop;                   /* x100 */
+} ubx_nav_pvt_t;
+
+void ubx_init(ubx_parser_t *parser);
+int ubx_feed(ubx_parser_t *parser, const uint8_t *buf, int length, bool *complete);
+bool ubx_is(const ubx_parser_t *parser, uint8_t cls, uint8_t id);
+bool ubx_nav_pvt(const ubx_parser_t *parser, ubx_nav_pvt_t *pvt);
+bool ubx_nav_dop(const ubx_parser_t *parser, uint32_t *itow, int *hdop);
+
+#endif
+
@@ -0,0 +1,176 @@
+/*
+ *  Benchmarks UBX decoding and checks the fixes decoded from a recorded UBX stream
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "gps.h"
+#include "ubx.h"
+
+#define DEFAULT_FILE        "data/mish_gps.ubx"
+#define DEFAULT_REFERENCE   "data/mish_gps.txt"
+#define DEFAULT_ITERATIONS  2000
+
+/*
+ * data/mish_gps.ubx holds NAV-DOP + NAV-PVT epochs for a minute of
+ * data/mish_gps.txt, led by a no-fix epoch and interleaved with NMEA text,
+ * NAV-SAT frames the logger ignores and one frame with a corrupt checksum.
+ */
+#define EXPECTED_ERRORS     1
+
+/* Runs the frame decoder over an in-memory copy of the stream. Returns 0, or -1 if the error count is wrong. */
+static int bench_decode(const char *buf, long length, int iterations)
+{
+    ubx_parser_t parser;
+    ubx_nav_pvt_t pvt;
+    long pvts = 0;
+    double start, elapsed;
+    int i;
+
+    start = bench_now();
+    for(i = 0; i < iterations; i++)
+    {
+        const uint8_t *p = (const uint8_t *)buf, *end = p + length;
+        ubx_init(&parser);
+        while(p < end)
+        {
+            bool complete = false;
+            p += ubx_feed(&parser, p, end - p, &complete);
+            if(complete && ubx_nav_pvt(&parser, &pvt))
+                pvts++;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    printf("ubx_feed:   %lu frames, %lu errors per pass, %0.3f s, %0.1f MB/s (%ld NAV-PVT)\n",
+        parser.frames, parser.errors, elapsed, length * (double)iterations / elapsed / 1e6, pvts);
+    if(parser.errors != EXPECTED_ERRORS)
+    {
+        printf("FAIL: expected %d checksum error(s)\n", EXPECTED_ERRORS);
+        return -1;
+    }
+    return 0;
+}
+
+/* Replays a log through gps_update, keeping every valid fix */
+static gps_t *load_fixes(const char *file, int protocol, int *count)
+{
+    gps_config_t config;
+    gps_t gps, *fixes = NULL;
+    int capacity = 0, last = -1;
+
+    memset(&config, 0, sizeof(config));
+    config.dev = file;
+    config.baud = GPS_LOGFILE;
+    config.protocol = protocol;
+
+    *count = 0;
+    if(gps_init(&config) < 0)
+        return NULL;
+    while(gps_update(&gps, -1) >= 0)
+    {
+        if(!gps.valid || (gps.id == last))
+            continue;
+        last = gps.id;
+        if(*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            fixes = realloc(fixes, capacity * sizeof(gps_t));
+        }
+        fixes[(*count)++] = gps;
+    }
+    gps_close();
+
+    return fixes;
+}
+
+static const gps_t *find_fix(const gps_t *fixes, int count, const gps_t *fix)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+        if((fixes[i].date == fix->date) && (fixes[i].time == fix->time))
+            return &fixes[i];
+    return NULL;
+}
+
+/* Every UBX fix must decode to what the NMEA log reported for the same epoch */
+static int check_fixes(const char *file, const char *reference)
+{
+    gps_t *ubx, *nmea;
+    int nubx, nnmea, i, mismatched = 0;
+
+    ubx = load_fixes(file, GPS_UBX, &nubx);
+    nmea = load_fixes(reference, GPS_NMEA, &nnmea);
+    if((ubx == NULL) || (nmea == NULL))
+    {
+        printf("FAIL: no fixes decoded\n");
+        free(ubx);
+        free(nmea);
+        return -1;
+    }
+
+    for(i = 0; i < nubx; i++)
+    {
+        const gps_t *u = &ubx[i], *n = find_fix(nmea, nnmea, u);
+
+        if((n == NULL) || (u->latitude != n->latitude) || (u->longitude != n->longitude) ||
+            (u->altitude != n->altitude) || (u->speed != n->speed) || (u->course != n->course) ||
+            (u->hdop != n->hdop) || (u->satellites != n->satellites))
+        {
+            printf("mismatch at %06d %d\n", u->date, u->time);
+            mismatched++;
+        }
+    }
+
+    printf("gps_update: %d UBX fixes, %d mismatched against %s\n", nubx, mismatched, reference);
+    if(mismatched)
+        printf("FAIL\n");
+
+    free(ubx);
+    free(nmea);
+    return mismatched ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file = (argc > 1) ? argv[1] : DEFAULT_FILE;
+    const char *reference = (argc > 2) ? argv[2] : DEFAULT_REFERENCE;
+    int iterations = (argc > 3) ? atoi(argv[3]) : DEFAULT_ITERATIONS;
+    char *buf;
+    long length;
+    int result;
+
+    buf = bench_load_file(file, &length);
+    if(buf == NULL)
+    {
+        printf("loading %s failed\n", file);
+        return -1;
+    }
+
+    printf("decoding %s x %d\n", file, iterations);
+    result = bench_decode(buf, length, iterations);
+    if(check_fixes(file, reference) < 0)
+        result = -1;
+
+    free(buf);
+    return result;
+}
@@ -0,0 +1,571 @@
+/*
+ *  Monitor mode capture backend. Beacons and probe responses are read off a
+ *  packet socket with their radiotap headers, and every frame's signal is
+ *  averaged per BSSID over a capture window, giving many readings per access
+ *  point where a scan gives one. A radiotap .pcap file can be replayed in
+ *  place of the interface.
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wifi_capture.h"
+#include "monotonic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/if_arp.h>
+#include <linux/filter.h>
+
+#define CAPTURE_POLL        50      /* ms between socket drains, so the receive buffer never fills */
+#define CAPTURE_RCVBUF      (1024 * 1024)
+#define SNAP_LENGTH         2048    /* Enough for the radiotap header and the elements we look at */
+
+/* pcap file format */
+#define PCAP_MAGIC          0xa1b2c3d4UL
+#define PCAP_MAGIC_NS       0xa1b23c4dUL
+#define LINKTYPE_RADIOTAP   127
+
+/* Radiotap fields, by present bit */
+#define RADIOTAP_FLAGS      1
+#define RADIOTAP_CHANNEL    3
+#define RADIOTAP_SIGNAL     5
+#define RADIOTAP_NOISE      6
+#define RADIOTAP_EXT        31
+#define RADIOTAP_FLAG_FCS   0x10
+
+/* 802.11 management frames */
+#define FC_BEACON           0x80
+#define FC_PROBE_RESPONSE   0x50
+#define MGMT_HEADER         24
+#define MGMT_FIXED          12      /* Timestamp, interval and capabilities before the elements */
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version_major, version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs, snaplen, linktype;
+} pcap_header_t;
+
+typedef struct
+{
+    uint32_t ts_sec, ts_usec, incl_len, orig_len;
+} pcap_record_t;
+
+/* One interface's socket, or replayed file, and window in flight */
+struct capture_scanner
+{
+    int fd;
+    FILE *pcap;
+    bool swapped, nanoseconds;
+    const char *interface;
+    int window;
+
+    /* Frame buffer; in replay the frame read past the end of a window is kept for the next one */
+    unsigned char *frame;
+    int frame_length;
+    int64_t frame_time;
+    bool frame_held, pcap_eof;
+
+    /* Signal totals per BSSID for the window in progress */
+    wifi_scan_result_t table;
+    int64_t signal_sum[WIFI_SCAN_MAX_BSS], noise_sum[WIFI_SCAN_MAX_BSS];
+    int frames[WIFI_SCAN_MAX_BSS], noise_frames[WIFI_SCAN_MAX_BSS];
+    wifi_scan_stats_t stats;
+
+    /* State of the window in flight */
+    int state;
+    int64_t window_start, window_end, next_poll;
+};
+
+static int socket_open(capture_scanner_t *cap, const char *ifname);
+static int pcap_open(capture_scanner_t *cap, const char *file);
+static int pcap_next(capture_scanner_t *cap, int64_t *time);
+static uint32_t pcap_u32(const capture_scanner_t *cap, uint32_t value);
+static void aggregate(capture_scanner_t *cap, const capture_frame_t *info);
+static uint16_t le16(const unsigned char *p);
+static uint32_t le32(const unsigned char *p);
+
+/* Opens ifname, or the .pcap file it names, for capture. Returns the scanner, or NULL on error. */
+capture_scanner_t *capture_scan_init(const char *ifname, int window_ms)
+{
+    const char *ext = strrchr(ifname, '.');
+    capture_scanner_t *cap = calloc(1, sizeof(*cap));
+
+    if(cap)
+        cap->frame = malloc(SNAP_LENGTH);
+    if((cap == NULL) || (cap->frame == NULL))
+    {
+        printf("%s: Allocation failed\n", __FUNCTION__);
+        free(cap);
+        return NULL;
+    }
+    cap->fd = -1;
+    cap->interface = ifname;
+    cap->window = (window_ms > 0) ? window_ms : 1000;
+    cap->state = WIFI_SCAN_IDLE;
+
+    if(((ext && (strcmp(ext, ".pcap") == 0)) ? pcap_open(cap, ifname) : socket_open(cap, ifname)) < 0)
+    {
+        capture_scan_close(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+void capture_scan_close(capture_scanner_t *cap)
+{
+    if(cap == NULL)
+        return;
+    if(cap->fd != -1)
+    {
+        close(cap->fd);
+        cap->fd = -1;
+    }
+    if(cap->pcap)
+    {
+        fclose(cap->pcap);
+        cap->pcap = NULL;
+    }
+    free(cap->frame);
+    free(cap);
+}
+
+/* Starts a capture window. Returns 0 on success or -1 on error. */
+int capture_scan_trigger(capture_scanner_t *cap)
+{
+    if(cap->frame == NULL)
+        return -1;
+    if(cap->pcap && cap->pcap_eof)
+        return -1;
+
+    cap->table.count = 0;
+    cap->table.truncated = 0;
+
+    if(cap->fd != -1)
+    {
+        /* Frames that queued up between windows belong to an earlier position */
+        while(recv(cap->fd, cap->frame, SNAP_LENGTH, MSG_DONTWAIT) > 0)
+            ;
+        cap->window_start = monotonic_ms();
+        cap->window_end = cap->window_start + cap->window;
+        cap->next_poll = cap->window_start + CAPTURE_POLL;
+    }
+    else
+    {
+        /* Replay windows run on the capture's own clock, starting at the next frame */
+        if(!cap->frame_held && (pcap_next(cap, &cap->frame_time) < 0))
+        {
+            cap->pcap_eof = true;
+            return -1;
+        }
+        cap->frame_held = true;
+        cap->window_start = cap->frame_time;
+        cap->window_end = cap->window_start + cap->window;
+    }
+
+    cap->stats.scans++;
+    cap->state = WIFI_SCAN_PENDING;
+    return 0;
+}
+
+/*
+ * Reads whatever frames have arrived, without blocking, and adds them to the
+ * window's totals. Returns the same as wifi_scan_poll.
+ */
+int capture_scan_poll(capture_scanner_t *cap)
+{
+    capture_frame_t info;
+    int64_t now;
+
+    if(cap->state != WIFI_SCAN_PENDING)
+        return cap->state;
+
+    if(cap->fd != -1)
+    {
+        int length;
+
+        now = monotonic_ms();
+        if(now < cap->next_poll)
+            return cap->state;
+
+        while((length = recv(cap->fd, cap->frame, SNAP_LENGTH, MSG_DONTWAIT)) > 0)
+        {
+            if(capture_parse(cap->frame, length, &info) == 0)
+                aggregate(cap, &info);
+        }
+        if((length < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+        {
+            printf("%-8.16s  Capture failed : %s\n\n", cap->interface, strerror(errno));
+            cap->state = WIFI_SCAN_IDLE;
+            return -1;
+        }
+
+        if(now < cap->window_end)
+        {
+            cap->next_poll = (now + CAPTURE_POLL < cap->window_end) ? now + CAPTURE_POLL : cap->window_end;
+            return cap->state;
+        }
+    }
+    else
+    {
+        /* A replayed window ends at the first frame past it, which starts the next window */
+        while(cap->frame_held && (cap->frame_time < cap->window_end))
+        {
+            if(capture_parse(cap->frame, cap->frame_length, &info) == 0)
+                aggregate(cap, &info);
+            cap->frame_held = (pcap_next(cap, &cap->frame_time) == 0);
+        }
+        cap->pcap_eof = !cap->frame_held;
+    }
+
+    cap->state = WIFI_SCAN_READY;
+    return cap->state;
+}
+
+/* Milliseconds until capture_scan_poll next needs calling, or -1 if no window is open */
+int capture_scan_poll_delay(capture_scanner_t *cap)
+{
+    int64_t delay;
+
+    if(cap->state != WIFI_SCAN_PENDING)
+        return (cap->state == WIFI_SCAN_READY) ? 0 : -1;
+    if(cap->fd == -1)
+        return 0;
+
+    delay = cap->next_poll - monotonic_ms();
+    return (delay > 0) ? (int)delay : 0;
+}
+
+/*
+ * Fills result with the mean signal of every BSS heard during the window,
+ * stamped at the middle of the window, and leaves the capture idle. Returns
+ * the number of cells or -1.
+ */
+int capture_scan_collect(capture_scanner_t *cap, wifi_scan_result_t *result)
+{
+    int i;
+
+    if(cap->state != WIFI_SCAN_READY)
+        return -1;
+    cap->state = WIFI_SCAN_IDLE;
+
+    result->count = cap->table.count;
+    result->truncated = cap->table.truncated;
+    result->received = (cap->fd != -1) ? cap->window_start + cap->window / 2 : monotonic_ms();
+    for(i = 0; i < cap->table.count; i++)
+    {
+        wifi_scan_t *cell = &result->bss[i];
+
+        *cell = cap->table.bss[i];
+        if(cap->frames[i])
+        {
+            cell->signal = cap->signal_sum[i] / cap->frames[i];
+            cell->quality = wifi_quality_from_dbm(cell->signal);
+        }
+        cell->noise = cap->noise_frames[i] ? cap->noise_sum[i] / cap->noise_frames[i] : 0;
+    }
+
+    return result->count;
+}
+
+void capture_scan_get_stats(capture_scanner_t *cap, wifi_scan_stats_t *s)
+{
+    struct tpacket_stats kstats;
+    socklen_t length = sizeof(kstats);
+
+    /* The kernel's counters reset on every read, so accumulate them */
+    if((cap->fd != -1) && (getsockopt(cap->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &length) == 0))
+        cap->stats.dropped += kstats.tp_drops;
+    *s = cap->stats;
+}
+
+/*
+ * Pulls the BSSID, ESSID, channel and signal out of a radiotap-framed beacon
+ * or probe response. Returns 0, or -1 if the frame is something else or is
+ * malformed.
+ */
+int capture_parse(const unsigned char *buf, int length, capture_frame_t *info)
+{
+    const unsigned char *field, *ie, *end;
+    uint32_t present;
+    int radiotap_length, offset, bit, flags = 0;
+
+    memset(info, 0, sizeof(*info));
+
+    if((length < 8) || (buf[0] != 0))
+        return -1;
+    radiotap_length = le16(buf + 2);
+    if((radiotap_length < 8) || (radiotap_length + MGMT_HEADER > length))
+        return -1;
+
+    /* Fields follow the last present word, each aligned to its own size */
+    present = le32(buf + 4);
+    offset = 8;
+    for(field = buf + 4; le32(field) & (1UL << RADIOTAP_EXT); field += 4)
+    {
+        offset += 4;
+        if(offset > radiotap_length)
+            return -1;
+    }
+
+    for(bit = 0; bit <= RADIOTAP_NOISE; bit++)
+    {
+        static const unsigned char size[] = { 8, 1, 1, 4, 2, 1, 1 };
+        static const unsigned char align[] = { 8, 1, 1, 2, 1, 1, 1 };
+
+        if(!(present & (1UL << bit)))
+            continue;
+        offset = (offset + align[bit] - 1) & ~(align[bit] - 1);
+        if(offset + size[bit] > radiotap_length)
+            return -1;
+
+        if(bit == RADIOTAP_FLAGS)
+            flags = buf[offset];
+        else if(bit == RADIOTAP_CHANNEL)
+            info->frequency = le16(buf + offset);
+        else if(bit == RADIOTAP_SIGNAL)
+        {
+            info->signal = (signed char)buf[offset];
+            info->has_signal = true;
+        }
+        else if(bit == RADIOTAP_NOISE)
+        {
+            info->noise = (signed char)buf[offset];
+            info->has_noise = true;
+        }
+        offset += size[bit];
+    }
+
+    /* 802.11 header: frame control, duration, DA, SA, BSSID, sequence */
+    buf += radiotap_length;
+    length -= radiotap_length;
+    if(flags & RADIOTAP_FLAG_FCS)
+        length -= 4;
+    if(((buf[0] != FC_BEACON) && (buf[0] != FC_PROBE_RESPONSE)) || (length < MGMT_HEADER + MGMT_FIXED))
+        return -1;
+    memcpy(info->bssid, buf + 16, sizeof(info->bssid));
+    info->channel = wifi_freq_to_channel(info->frequency);
+
+    for(ie = buf + MGMT_HEADER + MGMT_FIXED, end = buf + length; (end - ie >= 2) && (ie + 2 + ie[1] <= end); ie += 2 + ie[1])
+    {
+        if((ie[0] == 0) && !info->has_essid)
+        {
+            int essid_length = (ie[1] > WIFI_ESSID_MAX) ? WIFI_ESSID_MAX : ie[1];
+            memcpy(info->essid, ie + 2, essid_length);
+            info->essid[essid_length] = '\0';
+            info->has_essid = true;
+        }
+        else if((ie[0] == 3) && (ie[1] >= 1) && (info->channel == 0))
+        {
+            info->channel = ie[2];
+        }
+    }
+
+    return 0;
+}
+
+/* Makes fd pass only beacons and probe responses, cut to SNAP_LENGTH. Returns 0 on success or -1 on error. */
+int capture_attach_filter(int fd)
+{
+    /* X = radiotap length, then test the frame control byte after it */
+    static struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FC_BEACON, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FC_PROBE_RESPONSE, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SNAP_LENGTH),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog filter = { sizeof(code) / sizeof(code[0]), code };
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0)
+    {
+        printf("Error attaching capture filter: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Private functions
+ */
+
+static int socket_open(capture_scanner_t *cap, const char *ifname)
+{
+    struct sockaddr_ll addr;
+    struct ifreq ifr;
+    int rcvbuf = CAPTURE_RCVBUF;
+
+    cap->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if(cap->fd < 0)
+    {
+        printf("Error opening packet socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if(ioctl(cap->fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        printf("%-8.16s  No such interface\n", ifname);
+        return -1;
+    }
+    if(ifr.ifr_hwaddr.sa_family != ARPHRD_IEEE80211_RADIOTAP)
+    {
+        printf("%-8.16s  Interface isn't in monitor mode with radiotap headers\n", ifname);
+        return -1;
+    }
+
+    /* Filter before binding so nothing unfiltered gets queued */
+    if(capture_attach_filter(cap->fd) < 0)
+        return -1;
+    setsockopt(cap->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(ifname);
+    if(bind(cap->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf("Error binding to %s: %s\n", ifname, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int pcap_open(capture_scanner_t *cap, const char *file)
+{
+    pcap_header_t header;
+
+    cap->pcap = fopen(file, "rb");
+    if(cap->pcap == NULL)
+    {
+        printf("loading %s capture failed\n", file);
+        return -1;
+    }
+
+    if(fread(&header, sizeof(header), 1, cap->pcap) != 1)
+    {
+        printf("%s: not a pcap file\n", file);
+        return -1;
+    }
+    cap->swapped = (header.magic != PCAP_MAGIC) && (header.magic != PCAP_MAGIC_NS);
+    cap->nanoseconds = (pcap_u32(cap, header.magic) == PCAP_MAGIC_NS);
+    if((pcap_u32(cap, header.magic) != PCAP_MAGIC) && !cap->nanoseconds)
+    {
+        printf("%s: not a pcap file\n", file);
+        return -1;
+    }
+    if(pcap_u32(cap, header.linktype) != LINKTYPE_RADIOTAP)
+    {
+        printf("%s: capture has no radiotap headers (link type %u)\n", file, (unsigned int)pcap_u32(cap, header.linktype));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reads the next frame of the replayed capture and its time (ms). Returns 0, or -1 at the end. */
+static int pcap_next(capture_scanner_t *cap, int64_t *time)
+{
+    pcap_record_t record;
+    uint32_t length;
+
+    if(fread(&record, sizeof(record), 1, cap->pcap) != 1)
+        return -1;
+
+    length = pcap_u32(cap, record.incl_len);
+    cap->frame_length = (length > SNAP_LENGTH) ? SNAP_LENGTH : length;
+    if(fread(cap->frame, 1, cap->frame_length, cap->pcap) != (size_t)cap->frame_length)
+        return -1;
+    if(length > (uint32_t)cap->frame_length)
+        fseek(cap->pcap, length - cap->frame_length, SEEK_CUR);
+
+    *time = (int64_t)pcap_u32(cap, record.ts_sec) * 1000 + pcap_u32(cap, record.ts_usec) / (cap->nanoseconds ? 1000000 : 1000);
+    return 0;
+}
+
+static uint32_t pcap_u32(const capture_scanner_t *cap, uint32_t value)
+{
+    if(!cap->swapped)
+        return value;
+    return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+}
+
+/* Adds one frame to its BSS's totals */
+static void aggregate(capture_scanner_t *cap, const capture_frame_t *info)
+{
+    wifi_scan_t *cell;
+    int i;
+
+    cap->stats.frames++;
+    i = cap->table.count;
+    cell = wifi_scan_lookup(&cap->table, info->bssid);
+    if(cell == NULL)
+        return;
+
+    if(cap->table.count != i)
+    {
+        /* First frame from this BSS in the window */
+        cap->signal_sum[i] = cap->noise_sum[i] = 0;
+        cap->frames[i] = cap->noise_frames[i] = 0;
+        cell->frequency = info->frequency;
+        cell->channel = info->channel;
+        cell->age = 0;
+    }
+    i = cell - cap->table.bss;
+    if(info->has_essid && (cell->essid[0] == '\0'))
+    {
+        strcpy(cell->essid, info->essid);
+        cell->target = wifi_scan_is_target(cell->essid, strlen(cell->essid));
+    }
+    if(info->has_signal)
+    {
+        cap->signal_sum[i] += info->signal;
+        cap->frames[i]++;
+    }
+    if(info->has_noise)
+    {
+        cap->noise_sum[i] += info->noise;
+        cap->noise_frames[i]++;
+    }
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WIFI_CAPTURE_H
+#define WIFI_CAPTURE_H
+
+#include "wifi_scan.h"
+
+/* What one beacon or probe response says about its BSS */
+typedef struct
+{
+    unsigned char bssid[6];
+    char essid[WIFI_ESSID_MAX + 1];
+    bool has_essid;
+    int frequency;          /* MHz, 0 if the radiotap header has no channel */
+    int channel;            /* From the DS parameter set if there was no frequency */
+    int signal;             /* dBm */
+    int noise;              /* dBm */
+    bool has_signal;
+    bool has_noise;
+} capture_frame_t;
+
+typedef struct capture_scanner capture_scanner_t;
+
+/* Monitor mode capture backend, one scanner per interface. ifname may instead be a radiotap .pcap file to replay. */
+capture_scanner_t *capture_scan_init(const char *ifname, int window);
+void capture_scan_close(capture_scanner_t *cap);
+int capture_scan_trigger(capture_scanner_t *cap);
+int capture_scan_poll(capture_scanner_t *cap);
+int capture_scan_poll_delay(capture_scanner_t *cap);
+int capture_scan_collect(capture_scanner_t *cap, wifi_scan_result_t *result);
+void capture_scan_get_stats(capture_scanner_t *cap, wifi_scan_stats_t *stats);
+int capture_parse(const unsigned char *frame, int length, capture_frame_t *info);
+int capture_attach_filter(int fd);
+
+#endif
+
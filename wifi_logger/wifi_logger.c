@@ -23,44 +23,133 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "gps.h"
 #include "wifi_scan.h"
 #include "ini.h"
+#include "monotonic.h"
+#include "spsc.h"
+#include "log.h"
 
-#define MSLEEP(x)            usleep((x)*1000)
+/* How long completed scan results wait for a fix newer than the last one (ms) */
+#define STAMP_TIMEOUT        2000
 
+#define LINK_RATE_MAX        1000
+
+/* Queue lengths (powers of two). A scan slot holds a whole result table, ~18 kB */
+#define FIX_QUEUE            64
+#define SCAN_QUEUE           32
+
+/* Interfaces scanned at once, eg a 2.4 GHz and a 5 GHz adapter */
+#define MAX_RADIOS           4
+
+/* One radio's scanner, and the fix its last scan was started for */
+typedef struct
+{
+    wifi_scan_config_t config;
+    wifi_scanner_t *scanner;
+    int triggered_id;
+} radio_t;
+
+/* Scan results, or a single link sample, on their way from the scanner to the writer */
 typedef struct
 {
-    const char *gps_dev;
-    int gps_baud;
-    const char *wifi_interface;
-    const char *target_essid;
+    int radio;
+    wifi_scan_result_t result;
+} scan_item_t;
+
+typedef struct
+{
+    gps_config_t gps;
+    wifi_scan_config_t wifi;
+    int link_rate;
     int logging_delta;
     int logging_duration;
-    const char *output;
+    log_config_t log;
     bool print_output;
 } configuration;
 
+static configuration config;
+static radio_t radios[MAX_RADIOS];
+static int radio_count;
+
+/* The GPS and scanner stages feed the writer (main thread) through these */
+static spsc_t fix_queue, scan_queue;
+static spsc_event_t writer_wake;            /* Something was queued for the writer, or the GPS stage ended */
+static spsc_event_t gps_wake;               /* The writer made room in the fix queue, or the stages are stopping */
+static spsc_event_t scan_wake;              /* The GPS stage has a new fix, or the stages are stopping */
+static pthread_t gps_tid, scan_tid;
+static bool gps_started, scan_started;
+
+/* Shared between the threads, so only read and written through shared_get/shared_set */
+static int latest_fix = -1;                 /* id of the newest fix, for starting one scan per fix */
+static int stopping, gps_done;
+static long fixes, links;                   /* Counted by the GPS and scanner threads */
+
 static int handler(void *user, const char *section, const char *name, const char *value)
 {
     configuration *pconfig = (configuration *)user;
 
     #define MATCH(s, n) strcasecmp(section, s) == 0 && strcasecmp(name, n) == 0
     if(MATCH("gps", "port")) 
-        pconfig->gps_dev = strdup(value);
+        pconfig->gps.dev = strdup(value);
     else if(MATCH("gps", "baud"))
-        pconfig->gps_baud = (atoi(value) > 0) ? atoi(value) : 0;
+        pconfig->gps.baud = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("gps", "strictbaud"))
+        pconfig->gps.strict_baud = (atoi(value) > 0) ? true : false;
+    else if(MATCH("gps", "protocol"))
+        pconfig->gps.protocol = (strcasecmp(value, "ubx") == 0) ? GPS_UBX : GPS_NMEA;
+    else if(MATCH("gps", "replaystart"))
+        pconfig->gps.replay_start = (*value) ? strdup(value) : NULL;
+    else if(MATCH("gps", "replayend"))
+        pconfig->gps.replay_end = (*value) ? strdup(value) : NULL;
+    else if(MATCH("gps", "replayspeed"))
+        pconfig->gps.replay_speed = (atoi(value) > 0) ? atoi(value) : 0;
     else if(MATCH("wifi", "interface"))
-        pconfig->wifi_interface = strdup(value);
+        pconfig->wifi.interface = strdup(value);
     else if(MATCH("wifi", "target"))
-        pconfig->target_essid = strdup(value);
+        pconfig->wifi.targets = strdup(value);
+    else if(MATCH("wifi", "backend"))
+        pconfig->wifi.backend = (strcasecmp(value, "nl80211") == 0) ? WIFI_BACKEND_NL80211 : 
+            (strcasecmp(value, "capture") == 0) ? WIFI_BACKEND_CAPTURE : WIFI_BACKEND_WEXT;
+    else if(MATCH("wifi", "capturewindow"))
+        pconfig->wifi.capture_window = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("wifi", "mode"))
+        pconfig->wifi.mode = (strcasecmp(value, "passive") == 0) ? WIFI_MODE_PASSIVE : 
+            (strcasecmp(value, "link") == 0) ? WIFI_MODE_LINK : WIFI_MODE_ACTIVE;
+    else if(MATCH("wifi", "linkrate"))
+        pconfig->link_rate = (atoi(value) > 0) ? atoi(value) : 1;
+    else if(MATCH("wifi", "activeinterval"))
+        pconfig->wifi.active_interval = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("wifi", "maxage"))
+        pconfig->wifi.max_age = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("wifi", "channels"))
+        pconfig->wifi.channels = strdup(value);
+    else if(MATCH("wifi", "directed"))
+        pconfig->wifi.directed = (atoi(value) > 0) ? true : false;
+    else if(MATCH("wifi", "record"))
+        pconfig->wifi.record = strdup(value);
     else if(MATCH("log", "delta"))
-        pconfig->logging_delta = (atoi(value) > 0) ? atoi(value) : 0;
+        pconfig->logging_delta = (atoi(value) > 0) ? atoi(value) : 1;
     else if(MATCH("log", "duration"))
         pconfig->logging_duration = (atoi(value) > 0) ? atoi(value) : 0;
     else if(MATCH("log", "output"))
-        pconfig->output = strdup(value);
+        pconfig->log.file = strdup(value);
+    else if(MATCH("log", "format"))
+        pconfig->log.format = (strcasecmp(value, "binary") == 0) ? LOG_BINARY : 
+            (strcasecmp(value, "compressed") == 0) ? LOG_COMPRESSED : LOG_TEXT;
+    else if(MATCH("log", "flushinterval"))
+        pconfig->log.flush_interval = (atoi(value) > 0) ? 1000 * atoi(value) : 0;
+    else if(MATCH("log", "flushsize"))
+        pconfig->log.flush_size = (atoi(value) > 0) ? atoi(value) : 1;
+    else if(MATCH("log", "preallocate"))
+        pconfig->log.preallocate = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("log", "segmentsize"))
+        pconfig->log.segment_size = (atoi(value) > 0) ? atoi(value) : 0;
+    else if(MATCH("log", "segmentduration"))
+        pconfig->log.segment_duration = (atoi(value) > 0) ? 1000 * atoi(value) : 0;
     else if(MATCH("debug", "printoutput"))
         pconfig->print_output = (atoi(value) > 0) ? true : false;    
     else
@@ -69,25 +158,361 @@ static int handler(void *user, const char *section, const char *name, const char
     return 1;
 }
 
-void write_log(FILE *output, gps_t gps, wifi_scan_t scan, bool display)
+/* Logs one BSS against a fix */
+void write_log(gps_t gps, wifi_scan_t scan, int radio, bool display)
 {
-    /* Format: gps time, scan quality, signal level, noise level, gps latitude, gps longitude */
-    fprintf(output, "%0.3f %d %d %d %0.4f %0.4f\n", gps.time, scan.quality, scan.signal, scan.noise, gps.latitude, gps.longitude);
+    log_sample_t sample;
+    
+    sample.time = gps.date ? gps_utc(gps.date, gps.time) : gps.time;
+    sample.latitude = gps.latitude;
+    sample.longitude = gps.longitude;
+    memcpy(sample.bssid, scan.bssid, sizeof(sample.bssid));
+    sample.quality = scan.quality;
+    sample.signal = scan.signal;
+    sample.noise = scan.noise;
+    sample.channel = scan.channel;
+    sample.radio = radio;
+    
+    log_write(&sample, scan.essid, radios[radio].config.interface);
     if(display)
-        printf("%0.3f %d %d %d %0.4f %0.4f\n", gps.time, scan.quality, scan.signal, scan.noise, gps.latitude, gps.longitude);
+    {
+        char line[180];
+        log_format_text(line, &sample, scan.essid, radios[radio].config.interface);
+        fputs(line, stdout);
+    }
 }
 
-int main(int argc, char* argv[])
+/* Logs every target network in a scan against one fix. Returns the number of records written. */
+int write_scan(gps_t gps, const wifi_scan_result_t *result, int radio, bool display)
+{
+    int i, records = 0;
+    
+    for(i = 0; i < result->count; i++)
+    {
+        if(result->bss[i].target)
+        {
+            write_log(gps, result->bss[i], radio, display);
+            records++;
+        }
+    }
+    
+    return records;
+}
+
+/* Prints the non-empty bins of the scan duration histogram */
+static void print_durations(const wifi_scan_stats_t *stats)
+{
+    int i;
+    
+    printf("scan durations:\n");
+    for(i = 0; i < WIFI_SCAN_HISTOGRAM; i++)
+    {
+        if(stats->duration[i] == 0)
+            continue;
+        if(i == 0)
+            printf("  %11d ms: %lu\n", 0, stats->duration[i]);
+        else if(i == WIFI_SCAN_HISTOGRAM - 1)
+            printf("  >= %8d ms: %lu\n", 1 << (i - 1), stats->duration[i]);
+        else
+            printf("  %5d-%5d ms: %lu\n", 1 << (i - 1), (1 << i) - 1, stats->duration[i]);
+    }
+}
+
+/* 
+ * Opens a scanner for each of the comma separated interfaces, all sharing the
+ * rest of the [WIFI] settings. count is left at the number opened, which need
+ * closing even on error. Returns 0, or -1 if any radio failed to open.
+ */
+static int open_radios(const wifi_scan_config_t *config, radio_t *radios, int *count)
+{
+    char *list, *name;
+    bool several = config->interface && strchr(config->interface, ',');
+    
+    *count = 0;
+    list = strdup(config->interface ? config->interface : "");
+    for(name = strtok(list, ", "); name; name = strtok(NULL, ", "))
+    {
+        radio_t *radio = &radios[*count];
+        
+        if(*count == MAX_RADIOS)
+        {
+            printf("Only %d radios are supported, ignoring %s\n", MAX_RADIOS, name);
+            continue;
+        }
+        
+        radio->config = *config;
+        radio->config.interface = strdup(name);
+        /* Each radio records to its own file */
+        if(config->record && several)
+        {
+            char *record = malloc(strlen(config->record) + strlen(name) + 2);
+            if(record)
+                sprintf(record, "%s.%s", config->record, name);
+            radio->config.record = record;
+        }
+        radio->triggered_id = -1;
+        radio->scanner = wifi_scan_init(&radio->config);
+        if(radio->scanner == NULL)
+        {
+            free(list);
+            return -1;
+        }
+        (*count)++;
+    }
+    free(list);
+    
+    if(*count == 0)
+    {
+        printf("No wifi interface configured\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Prints a radio's scan statistics at exit */
+static void print_stats(const radio_t *radio)
 {
-    int result = 0;
+    wifi_scan_stats_t stats;
+    
+    wifi_scan_get_stats(radio->scanner, &stats);
+    if(stats.scans && (radio->config.backend != WIFI_BACKEND_CAPTURE))
+        printf("%s: %lu scans: %0.2f allocations and %0.2f E2BIG retries per scan, %d byte buffer\n", radio->config.interface,
+            stats.scans, (double)stats.allocations / stats.scans, (double)stats.e2big_retries / stats.scans, stats.buffer_size);
+    if(stats.cache_reads)
+        printf("%s: %lu cached result reads, %lu stale cells dropped\n", radio->config.interface, stats.cache_reads, stats.expired);
+    if(stats.frames)
+        printf("%s: %lu beacons captured, %lu dropped\n", radio->config.interface, stats.frames, stats.dropped);
+    if(stats.scans && (radio->config.backend != WIFI_BACKEND_CAPTURE))
+        print_durations(&stats);
+}
+
+/* Prints how the log writes went at exit */
+static void print_log_stats(void)
+{
+    writer_stats_t stats;
+    
+    log_get_stats(&stats);
+    if(stats.flushes)
+        printf("log: %llu bytes in %lu flushes (%lu stalls, %lu errors), write+sync mean %0.1f ms, max %d ms\n", 
+            stats.bytes, stats.flushes, stats.stalls, stats.errors, (double)stats.latency_total / stats.flushes, stats.latency_max);
+}
+
+/* gcc 4.6 predates the __atomic builtins, so these use __sync (full barriers on MIPS) */
+static int shared_get(int *value)
+{
+    return __sync_fetch_and_add(value, 0);
+}
+
+static void shared_set(int *value, int new_value)
+{
+    __sync_synchronize();
+    *value = new_value;
+    __sync_synchronize();
+}
+
+/* 
+ * GPS stage: reads fixes and queues them for the writer. A replayed log waits
+ * for room in the queue, but a live receiver can't be held up so its fixes are
+ * dropped (and counted) if the writer falls behind.
+ */
+static void *gps_thread(void *arg)
+{
+    bool replay = (config.gps.baud == GPS_LOGFILE);
     gps_t gps;
-    wifi_scan_t scan;
-    configuration config;
-    FILE *output;
-    bool log = true;
-    time_t start;
+    
+    while(!shared_get(&stopping))
+    {
+        int result = gps_update(&gps, config.logging_delta);
+        
+        if((result >= 0) && gps.valid)
+        {
+            gps_t *slot;
+            
+            while(1)
+            {
+                unsigned int seen = spsc_event_count(&gps_wake);
+                
+                slot = spsc_reserve(&fix_queue);
+                if(slot || !replay || shared_get(&stopping))
+                    break;
+                spsc_event_wait(&gps_wake, seen, -1);
+            }
+            if(slot)
+            {
+                *slot = gps;
+                spsc_publish(&fix_queue);
+            }
+            else
+                spsc_drop(&fix_queue);
+            shared_set(&latest_fix, gps.id);
+            spsc_event_signal(&scan_wake);
+            fixes++;
+        }
+        if(replay && (result < 0))
+            break;
+    }
+    
+    shared_set(&gps_done, 1);
+    spsc_event_signal(&writer_wake);
+    return NULL;
+}
+
+/* Collects a radio's finished results straight into the scan queue, or discards them if it is full */
+static void queue_scan(radio_t *radio, int index)
+{
+    static scan_item_t discard;
+    scan_item_t *item = spsc_reserve(&scan_queue);
+    
+    if(item == NULL)
+    {
+        wifi_scan_collect(radio->scanner, &discard.result);
+        spsc_drop(&scan_queue);
+        return;
+    }
+    
+    item->radio = index;
+    if(wifi_scan_collect(radio->scanner, &item->result) >= 0)
+        spsc_publish(&scan_queue);
+}
+
+/* Samples each radio's link into the scan queue. Returns ms until the next sample is due. */
+static int sample_links(int64_t *next_sample)
+{
+    int64_t now = monotonic_ms();
+    int i;
+    
+    if(now < *next_sample)
+        return (int)(*next_sample - now);
+    *next_sample = (*next_sample + 1000 / config.link_rate > now) ? *next_sample + 1000 / config.link_rate : 
+        now + 1000 / config.link_rate;
+    
+    for(i = 0; i < radio_count; i++)
+    {
+        scan_item_t *item = spsc_reserve(&scan_queue);
+        
+        if(item == NULL)
+        {
+            spsc_drop(&scan_queue);
+            continue;
+        }
+        if((wifi_scan_link(radios[i].scanner, &item->result.bss[0]) > 0) && item->result.bss[0].target)
+        {
+            item->radio = i;
+            item->result.count = 1;
+            item->result.truncated = 0;
+            item->result.received = now;
+            spsc_publish(&scan_queue);
+            links++;
+        }
+    }
+    
+    return (int)(*next_sample - now);
+}
+
+/* 
+ * Scanner stage: keeps every radio's scan going in the background, each
+ * starting at most one scan per fix, and queues the results (or link samples)
+ * for the writer. Waits for the first fix, as there'd be nothing to stamp
+ * results with before it. Between rounds it sleeps until a new fix, or in
+ * poll() on the sockets of radios with a scan in flight, so nl80211 results
+ * are picked up as soon as the kernel announces them.
+ */
+static void *scan_thread(void *arg)
+{
+    int64_t next_sample = 0;
+    struct pollfd fds[MAX_RADIOS];
+    
+    while(1)
+    {
+        unsigned int seen = spsc_event_count(&scan_wake);
+        int fix_id = shared_get(&latest_fix), wait = -1, nfds = 0, i;
+        
+        if(shared_get(&stopping))
+            break;
+        if(fix_id < 0)
+        {
+            spsc_event_wait(&scan_wake, seen, -1);
+            continue;
+        }
+        
+        if(config.wifi.mode == WIFI_MODE_LINK)
+            wait = sample_links(&next_sample);
+        else
+        {
+            for(i = 0; i < radio_count; i++)
+            {
+                radio_t *radio = &radios[i];
+                int state = wifi_scan_poll(radio->scanner), delay;
+                
+                if((state == WIFI_SCAN_IDLE) || (state < 0))
+                {
+                    if(fix_id != radio->triggered_id)
+                    {
+                        radio->triggered_id = fix_id;
+                        wifi_scan_trigger(radio->scanner);
+                    }
+                }
+                else if(state == WIFI_SCAN_READY)
+                    queue_scan(radio, i);
+                
+                /* Wake in time to poll the soonest scan, or when one announces its results */
+                delay = wifi_scan_poll_delay(radio->scanner);
+                if((delay >= 0) && ((wait < 0) || (delay < wait)))
+                    wait = delay;
+                if((delay > 0) && (wifi_scan_fd(radio->scanner) >= 0))
+                {
+                    fds[nfds].fd = wifi_scan_fd(radio->scanner);
+                    fds[nfds].events = POLLIN;
+                    nfds++;
+                }
+            }
+        }
+        
+        /* A new fix doesn't wake poll(), so it checks for one every Delta */
+        if(nfds)
+            poll(fds, nfds, ((wait < 0) || (wait > config.logging_delta)) ? config.logging_delta : wait);
+        else
+            spsc_event_wait(&scan_wake, seen, wait);
+    }
+    
+    return NULL;
+}
+
+/* Stops the GPS and scanner stages, if they were started */
+static void stop_threads(void)
+{
+    shared_set(&stopping, 1);
+    if(gps_started)
+    {
+        spsc_event_signal(&gps_wake);
+        pthread_join(gps_tid, NULL);
+    }
+    if(scan_started)
+    {
+        spsc_event_signal(&scan_wake);
+        pthread_join(scan_tid, NULL);
+    }
+    gps_started = scan_started = false;
+}
+
+int main(int argc, char* argv[])
+{
+    int result = 0, i;
+    gps_t fix, previous;
+    scan_item_t *item;
+    bool replay, have_fix = false;
+    int64_t finish = 0;
+    struct timespec begin, end;
+    long records = 0;
 
     /* Parse configuration file */
+    memset(&config, 0, sizeof(config));
+    config.gps.replay_speed = 1;
+    config.link_rate = 20;
+    config.logging_delta = 10;
+    config.log.flush_interval = 60000;
+    config.log.flush_size = 65536;
     if(ini_parse("wifi_logger.ini", handler, &config) < 0) 
     {
         printf("Failed to load 'wifi_logger.ini'\n");
@@ -95,51 +520,169 @@ int main(int argc, char* argv[])
     }
     
     /* Configure GPS */
-    result = gps_init(config.gps_dev, config.gps_baud);
+    result = gps_init(&config.gps);
     if(result < 0)
         goto exit;
         
-    /* Configure wifi */
-    result = wifi_scan_init(config.wifi_interface, config.target_essid);
+    /* Configure wifi, one scanner per radio */
+    result = open_radios(&config.wifi, radios, &radio_count);
     if(result < 0)
         goto exit;
     
+    /* Queues between the GPS and scanner stages and the writer */
+    result = spsc_init(&fix_queue, "fix", sizeof(gps_t), FIX_QUEUE);
+    if(result < 0)
+        goto exit;
+    result = spsc_init(&scan_queue, "scan", sizeof(scan_item_t), SCAN_QUEUE);
+    if(result < 0)
+        goto exit;
+    
+    /* The writer sleeps until something is queued, a replay's GPS stage until the writer makes room, and the scanner until a new fix */
+    result = spsc_event_init(&writer_wake);
+    if(result < 0)
+        goto exit;
+    result = spsc_event_init(&gps_wake);
+    if(result < 0)
+        goto exit;
+    result = spsc_event_init(&scan_wake);
+    if(result < 0)
+        goto exit;
+    spsc_notify(&fix_queue, &writer_wake, &gps_wake);
+    spsc_notify(&scan_queue, &writer_wake, NULL);
+    
     /* Setup output log file */
-    output = fopen(config.output, "w");
-    if(output == NULL)
+    result = log_open(&config.log);
+    if(result < 0)
+        goto exit;
+    
+    /* A replayed log is paced by its own timestamps (see ReplaySpeed) and ends with the file */
+    replay = (config.gps.baud == GPS_LOGFILE);
+    if(config.link_rate > LINK_RATE_MAX)
+        config.link_rate = LINK_RATE_MAX;
+    
+    if(config.logging_duration)
+        finish = monotonic_ms() + config.logging_duration * 1000LL;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(pthread_create(&gps_tid, NULL, gps_thread, NULL) != 0)
+    {
+        printf("Failed to start GPS thread\n");
+        result = -1;
+        goto exit;
+    }
+    gps_started = true;
+    if(pthread_create(&scan_tid, NULL, scan_thread, NULL) != 0)
     {
-        printf("Failed to create %s logfile\n", config.output); 
+        printf("Failed to start scanner thread\n");
+        result = -1;
         goto exit;
     }
+    scan_started = true;
     
-    start = time(NULL);
-    /* Log wifi statistics with GPS position stamps */
-    while(log)
+    /* Writer stage: join scans to fixes and log them with GPS position stamps */
+    while(1)
     {
-        int gps_result, wifi_result;
+        unsigned int seen = spsc_event_count(&writer_wake);
+        int64_t now;
+        int wait, delay;
+        gps_t *next;
         
-        gps_result = gps_update(&gps);
-        if((gps_result >= 0) && gps.valid)
+        /* Results taken before the newest fix are stamped with whichever of the last two fixes is nearer */
+        item = spsc_peek(&scan_queue);
+        if(item && have_fix && (item->result.received <= fix.received))
         {
-            wifi_result = wifi_scan(&scan);       
+            records += write_scan((item->result.received - previous.received <= fix.received - item->result.received) ? 
+                previous : fix, &item->result, item->radio, config.print_output);
+            spsc_release(&scan_queue);
+            continue;
+        }
         
-            if(wifi_result >= 0)
-                write_log(output, gps, scan, config.print_output);
+        next = spsc_peek(&fix_queue);
+        if(next)
+        {
+            previous = have_fix ? fix : *next;
+            fix = *next;
+            have_fix = true;
+            spsc_release(&fix_queue);
+            continue;
         }
         
-        if((int)(time(NULL) - start) >= config.logging_duration)
-            log = false;
-
-        MSLEEP(config.logging_delta);
+        /* No newer fix is coming (eg lost lock), so the last one is the nearest */
+        now = monotonic_ms();
+        if(item && have_fix && (now - item->result.received > STAMP_TIMEOUT))
+        {
+            records += write_scan(fix, &item->result, item->radio, config.print_output);
+            spsc_release(&scan_queue);
+            continue;
+        }
+        
+        /* Once the GPS and scanner stages stop, drain what they queued before finishing */
+        if(shared_get(&stopping))
+            break;
+        if(shared_get(&gps_done) || (finish && (now >= finish)))
+        {
+            stop_threads();
+            continue;
+        }
+        
+        /* Sleep until something is queued, or the next deadline: a result's stamp timeout, a flush or the end */
+        wait = log_poll();
+        if(item && have_fix)
+        {
+            delay = (int)(item->result.received + STAMP_TIMEOUT + 1 - now);
+            if((wait < 0) || (delay < wait))
+                wait = delay;
+        }
+        if(finish)
+        {
+            delay = (int)(finish - now);
+            if((wait < 0) || (delay < wait))
+                wait = delay;
+        }
+        spsc_event_wait(&writer_wake, seen, wait);
+    }
+    
+    /* Nothing newer is coming, so whatever is still waiting goes against the last fix */
+    while((item = spsc_peek(&scan_queue)) != NULL)
+    {
+        if(have_fix)
+            records += write_scan(fix, &item->result, item->radio, config.print_output);
+        spsc_release(&scan_queue);
+    }
+    
+    /* Closing waits for the last batch to be synced, so it is counted below */
+    log_close();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(replay)
+    {
+        double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        printf("replayed %ld fixes, logged %ld records in %0.3f s (%0.0f fixes/s)\n", 
+            fixes, records, elapsed, (elapsed > 0) ? fixes / elapsed : 0.0);
     }
+    
+    if(links)
+    {
+        double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        printf("%ld link samples (%0.1f Hz)\n", links, (elapsed > 0) ? links / elapsed : 0.0);
+    }
+    
+    spsc_print_stats(&fix_queue);
+    spsc_print_stats(&scan_queue);
+    for(i = 0; i < radio_count; i++)
+        print_stats(&radios[i]);
+    print_log_stats();
    
 exit:
     printf("wifi logger exitting\n");
+    stop_threads();
     gps_close();
-    wifi_scan_close();
-    if(output)
-        fclose(output);
+    for(i = 0; i < radio_count; i++)
+        wifi_scan_close(radios[i].scanner);
+    spsc_close(&fix_queue);
+    spsc_close(&scan_queue);
+    spsc_event_close(&writer_wake);
+    spsc_event_close(&gps_wake);
+    spsc_event_close(&scan_wake);
+    log_close();
     
     return result;
 }
-
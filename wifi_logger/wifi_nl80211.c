@@ -0,0 +1,680 @@
+/*
+ *  nl80211 scan backend. Talks generic netlink directly rather than through
+ *  libnl, waits for the kernel's scan-complete multicast event instead of
+ *  polling, and reads the results with a single dump.
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wifi_nl80211.h"
+#include "monotonic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK         270
+#endif
+
+#define SCAN_TIMEOUT        5000    /* ms */
+#define BUFFER_SIZE         32768   /* Initial dump buffer, grown if a dump doesn't fit */
+#define EVENT_SIZE          4096
+
+/* Highest attribute index looked at; anything above is skipped */
+#define ATTR_MAX            NL80211_ATTR_BSS
+
+#define ATTR_DATA(a)        ((const void *)((const char *)(a) + NLA_HDRLEN))
+#define ATTR_LEN(a)         ((int)(a)->nla_len - NLA_HDRLEN)
+
+typedef struct
+{
+    struct nlmsghdr n;
+    struct genlmsghdr g;
+    char attrs[1024];
+} request_t;
+
+/* One interface's sockets and scan in flight */
+struct nl80211_scanner
+{
+    int cmd_fd, event_fd;
+    int family_id, scan_group;
+    uint32_t seq;
+    const char *interface;
+    unsigned int ifindex;
+
+    /* Dump buffer, kept between scans at the largest size needed */
+    unsigned char *buffer;
+    int buflen, dump_length;
+    wifi_scan_stats_t stats;
+
+    /* State of the scan in flight */
+    int state;
+    bool dump_now;
+    int64_t deadline, ready_at;
+};
+
+static int nl_open(void);
+static int nl_send(int fd, request_t *req);
+static int nl_ack(nl80211_scanner_t *nl);
+static void request_init(nl80211_scanner_t *nl, request_t *req, int type, int flags, int cmd);
+static struct nlattr *request_put(request_t *req, int type, const void *data, int length);
+static void request_nest_end(request_t *req, struct nlattr *nest);
+static void attr_parse(const struct nlattr **tb, int max, const void *data, int length);
+static int resolve_family(nl80211_scanner_t *nl);
+static int scan_event(nl80211_scanner_t *nl);
+static int scan_dump(nl80211_scanner_t *nl);
+static void bss_parse(wifi_scan_t *cell, const struct nlattr **bss);
+static void bss_elements(wifi_scan_t *cell, const unsigned char *ie, int length);
+
+/* Opens the sockets for scanning ifname. Returns the scanner, or NULL on error. */
+nl80211_scanner_t *nl80211_scan_init(const char *ifname)
+{
+    nl80211_scanner_t *nl = calloc(1, sizeof(*nl));
+
+    if(nl == NULL)
+    {
+        printf("%s: Allocation failed\n", __FUNCTION__);
+        return NULL;
+    }
+    nl->cmd_fd = nl->event_fd = -1;
+    nl->interface = ifname;
+    nl->state = WIFI_SCAN_IDLE;
+
+    nl->ifindex = if_nametoindex(ifname);
+    if(nl->ifindex == 0)
+    {
+        printf("%-8.16s  No such interface\n", nl->interface);
+        nl80211_scan_close(nl);
+        return NULL;
+    }
+
+    nl->buflen = BUFFER_SIZE;
+    nl->buffer = malloc(nl->buflen);
+    if(nl->buffer == NULL)
+    {
+        printf("%s: Allocation failed\n", __FUNCTION__);
+        nl80211_scan_close(nl);
+        return NULL;
+    }
+    nl->stats.allocations++;
+    nl->stats.buffer_size = nl->buflen;
+
+    nl->cmd_fd = nl_open();
+    nl->event_fd = nl_open();
+    if((nl->cmd_fd < 0) || (nl->event_fd < 0))
+    {
+        printf("Error opening netlink socket: %s\n", strerror(errno));
+        nl80211_scan_close(nl);
+        return NULL;
+    }
+
+    if(resolve_family(nl) < 0)
+    {
+        printf("nl80211 is not available\n");
+        nl80211_scan_close(nl);
+        return NULL;
+    }
+
+    /* Scan-complete notifications arrive on the "scan" multicast group */
+    if(setsockopt(nl->event_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &nl->scan_group, sizeof(nl->scan_group)) < 0)
+    {
+        printf("Error joining nl80211 scan group: %s\n", strerror(errno));
+        nl80211_scan_close(nl);
+        return NULL;
+    }
+
+    return nl;
+}
+
+void nl80211_scan_close(nl80211_scanner_t *nl)
+{
+    if(nl == NULL)
+        return;
+    if(nl->cmd_fd != -1)
+    {
+        close(nl->cmd_fd);
+        nl->cmd_fd = -1;
+    }
+    if(nl->event_fd != -1)
+    {
+        close(nl->event_fd);
+        nl->event_fd = -1;
+    }
+    free(nl->buffer);
+    free(nl);
+}
+
+/* 
+ * Starts a scan, or if active is false just arranges for the next poll to
+ * read the cached results. The scan is limited to the given frequencies (MHz),
+ * or all if there are none, and probes for any network as well as by name for
+ * the given ESSIDs. Returns 0 on success or -1 on error.
+ */
+int nl80211_scan_trigger(nl80211_scanner_t *nl, bool active, const int *frequencies, int frequency_count, const char **essids, int essid_count)
+{
+    request_t req;
+    struct nlattr *nest;
+    uint32_t index = nl->ifindex;
+    int i;
+
+    if((nl->cmd_fd < 0) || (nl->buffer == NULL))
+        return -1;
+
+    /* Forget notifications for scans that finished before this one */
+    while(recv(nl->event_fd, nl->buffer, nl->buflen, MSG_DONTWAIT) > 0)
+        ;
+
+    nl->deadline = monotonic_ms() + SCAN_TIMEOUT;
+    nl->state = WIFI_SCAN_PENDING;
+    if(!active)
+    {
+        nl->dump_now = true;
+        nl->stats.cache_reads++;
+        return 0;
+    }
+
+    nl->dump_now = false;
+    request_init(nl, &req, nl->family_id, NLM_F_REQUEST | NLM_F_ACK, NL80211_CMD_TRIGGER_SCAN);
+    request_put(&req, NL80211_ATTR_IFINDEX, &index, sizeof(index));
+    if(frequency_count)
+    {
+        nest = request_put(&req, NL80211_ATTR_SCAN_FREQUENCIES, NULL, 0);
+        for(i = 0; i < frequency_count; i++)
+        {
+            uint32_t frequency = frequencies[i];
+            request_put(&req, i + 1, &frequency, sizeof(frequency));
+        }
+        request_nest_end(&req, nest);
+    }
+    /* Without any SSIDs the kernel only listens; the wildcard (empty) SSID probes for every network, as iw scan does */
+    nest = request_put(&req, NL80211_ATTR_SCAN_SSIDS, NULL, 0);
+    for(i = 0; i < essid_count; i++)
+        request_put(&req, i + 1, essids[i], (strlen(essids[i]) > WIFI_ESSID_MAX) ? WIFI_ESSID_MAX : strlen(essids[i]));
+    request_put(&req, essid_count + 1, NULL, 0);
+    request_nest_end(&req, nest);
+    if((nl_send(nl->cmd_fd, &req) < 0) || (nl_ack(nl) < 0))
+    {
+        if(errno == EPERM)
+            nl->dump_now = true;        /* Not allowed to trigger, but we can still read what's there */
+        else if(errno != EBUSY)     /* Busy means someone else's scan is running; wait for its results */
+        {
+            printf("%-8.16s  Interface doesn't support scanning : %s\n\n", nl->interface, strerror(errno));
+            nl->state = WIFI_SCAN_IDLE;
+            return -1;
+        }
+    }
+
+    nl->stats.scans++;
+    return 0;
+}
+
+/*
+ * Checks for the scan-complete event without blocking and, once it has
+ * arrived, dumps the results. Returns the same as wifi_scan_poll.
+ */
+int nl80211_scan_poll(nl80211_scanner_t *nl)
+{
+    int64_t now;
+
+    if(nl->state != WIFI_SCAN_PENDING)
+        return nl->state;
+
+    now = monotonic_ms();
+    if(!nl->dump_now)
+    {
+        int event = scan_event(nl);
+
+        if(event < 0)
+        {
+            printf("%-8.16s  Scan aborted\n\n", nl->interface);
+            nl->state = WIFI_SCAN_IDLE;
+            return -1;
+        }
+        if(event == 0)
+        {
+            if(now < nl->deadline)
+                return nl->state;
+            printf("%-8.16s  Scan timed out\n\n", nl->interface);
+            nl->state = WIFI_SCAN_IDLE;
+            return -1;
+        }
+    }
+
+    if(scan_dump(nl) < 0)
+    {
+        printf("%-8.16s  Failed to read scan data : %s\n\n", nl->interface, strerror(errno));
+        nl->state = WIFI_SCAN_IDLE;
+        return -1;
+    }
+
+    nl->ready_at = now;
+    nl->state = WIFI_SCAN_READY;
+    return nl->state;
+}
+
+/*
+ * Nothing needs polling on a timer while a scan is in flight - the event is
+ * picked up whenever the caller next looks - so this is just the time left
+ * before the scan is given up on.
+ */
+int nl80211_scan_poll_delay(nl80211_scanner_t *nl)
+{
+    int64_t delay;
+
+    if(nl->state != WIFI_SCAN_PENDING)
+        return (nl->state == WIFI_SCAN_READY) ? 0 : -1;
+    if(nl->dump_now)
+        return 0;
+
+    delay = nl->deadline - monotonic_ms();
+    return (delay > 0) ? (int)delay : 0;
+}
+
+/* The socket scan notifications arrive on, readable when nl80211_scan_poll may have news */
+int nl80211_scan_fd(nl80211_scanner_t *nl)
+{
+    return nl->event_fd;
+}
+
+int nl80211_scan_collect(nl80211_scanner_t *nl, wifi_scan_result_t *result)
+{
+    if(nl->state != WIFI_SCAN_READY)
+        return -1;
+    nl->state = WIFI_SCAN_IDLE;
+
+    if(nl80211_parse_scan(nl->buffer, nl->dump_length, result) < 0)
+        return -1;
+    result->received = nl->ready_at;
+
+    if(result->count == 0)
+        printf("%-8.16s  No scan results\n\n", nl->interface);
+
+    return result->count;
+}
+
+/* The dump behind the results ready to collect, for recording. Returns its length, or -1 if there is none. */
+int nl80211_scan_raw(nl80211_scanner_t *nl, const void **buf, int64_t *time)
+{
+    if(nl->state != WIFI_SCAN_READY)
+        return -1;
+
+    *buf = nl->buffer;
+    *time = nl->ready_at;
+    return nl->dump_length;
+}
+
+void nl80211_scan_get_stats(nl80211_scanner_t *nl, wifi_scan_stats_t *s)
+{
+    *s = nl->stats;
+}
+
+/*
+ * Fills result with every BSS in a NL80211_CMD_GET_SCAN dump - the
+ * concatenated netlink messages as read from the socket, up to NLMSG_DONE.
+ * Needs no socket, so recorded dumps can be replayed through it. Returns the
+ * number of cells, or -1 if the dump holds an error.
+ */
+int nl80211_parse_scan(const void *buf, int length, wifi_scan_result_t *result)
+{
+    const struct nlmsghdr *h;
+
+    result->count = 0;
+    result->truncated = 0;
+
+    for(h = buf; NLMSG_OK(h, length); h = NLMSG_NEXT(h, length))
+    {
+        const struct genlmsghdr *g;
+        const struct nlattr *tb[ATTR_MAX + 1], *bss[NL80211_BSS_MAX + 1];
+        wifi_scan_t *cell;
+
+        if(h->nlmsg_type == NLMSG_DONE)
+            break;
+        if(h->nlmsg_type == NLMSG_ERROR)
+            return -1;
+        if(h->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+            continue;
+
+        g = NLMSG_DATA(h);
+        if(g->cmd != NL80211_CMD_NEW_SCAN_RESULTS)
+            continue;
+
+        attr_parse(tb, ATTR_MAX, (const char *)g + GENL_HDRLEN, h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+        if(tb[NL80211_ATTR_BSS] == NULL)
+            continue;
+
+        attr_parse(bss, NL80211_BSS_MAX, ATTR_DATA(tb[NL80211_ATTR_BSS]), ATTR_LEN(tb[NL80211_ATTR_BSS]));
+        if((bss[NL80211_BSS_BSSID] == NULL) || (ATTR_LEN(bss[NL80211_BSS_BSSID]) < 6))
+            continue;
+
+        cell = wifi_scan_lookup(result, ATTR_DATA(bss[NL80211_BSS_BSSID]));
+        if(cell)
+            bss_parse(cell, bss);
+    }
+
+    return result->count;
+}
+
+/*
+ * Private functions
+ */
+
+static int nl_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if(fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int nl_send(int fd, request_t *req)
+{
+    return (send(fd, req, req->n.nlmsg_len, 0) == (ssize_t)req->n.nlmsg_len) ? 0 : -1;
+}
+
+/* Waits for the acknowledgement of the last request. Returns 0, or -1 with errno set from the kernel's error. */
+static int nl_ack(nl80211_scanner_t *nl)
+{
+    while(1)
+    {
+        const struct nlmsghdr *h;
+        int length = recv(nl->cmd_fd, nl->buffer, nl->buflen, 0);
+
+        if(length < 0)
+            return -1;
+
+        for(h = (const struct nlmsghdr *)nl->buffer; NLMSG_OK(h, length); h = NLMSG_NEXT(h, length))
+        {
+            if((h->nlmsg_seq == nl->seq) && (h->nlmsg_type == NLMSG_ERROR))
+            {
+                const struct nlmsgerr *err = NLMSG_DATA(h);
+
+                errno = -err->error;
+                return err->error ? -1 : 0;
+            }
+        }
+    }
+}
+
+static void request_init(nl80211_scanner_t *nl, request_t *req, int type, int flags, int cmd)
+{
+    memset(req, 0, sizeof(*req));
+    req->n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->n.nlmsg_type = type;
+    req->n.nlmsg_flags = flags;
+    req->n.nlmsg_seq = ++nl->seq;
+    req->g.cmd = cmd;
+    req->g.version = 1;
+}
+
+/* Appends an attribute. With no data it starts a nest, closed by request_nest_end. */
+static struct nlattr *request_put(request_t *req, int type, const void *data, int length)
+{
+    struct nlattr *attr = (struct nlattr *)((char *)req + NLMSG_ALIGN(req->n.nlmsg_len));
+
+    attr->nla_type = type;
+    attr->nla_len = NLA_HDRLEN + length;
+    if(length)
+        memcpy((char *)attr + NLA_HDRLEN, data, length);
+    req->n.nlmsg_len = NLMSG_ALIGN(req->n.nlmsg_len) + NLA_ALIGN(attr->nla_len);
+
+    return attr;
+}
+
+static void request_nest_end(request_t *req, struct nlattr *nest)
+{
+    nest->nla_len = (char *)req + req->n.nlmsg_len - (char *)nest;
+}
+
+/* Indexes a run of attributes by type; tb[type] is NULL for those not present */
+static void attr_parse(const struct nlattr **tb, int max, const void *data, int length)
+{
+    const struct nlattr *attr = data;
+
+    memset(tb, 0, (max + 1) * sizeof(*tb));
+    while((length >= NLA_HDRLEN) && (attr->nla_len >= NLA_HDRLEN) && (attr->nla_len <= length))
+    {
+        int type = attr->nla_type & NLA_TYPE_MASK;
+
+        if(type <= max)
+            tb[type] = attr;
+        length -= NLA_ALIGN(attr->nla_len);
+        attr = (const struct nlattr *)((const char *)attr + NLA_ALIGN(attr->nla_len));
+    }
+}
+
+/* Looks up the nl80211 family id and its "scan" multicast group */
+static int resolve_family(nl80211_scanner_t *nl)
+{
+    request_t req;
+    const struct nlmsghdr *h;
+    int length;
+
+    request_init(nl, &req, GENL_ID_CTRL, NLM_F_REQUEST, CTRL_CMD_GETFAMILY);
+    request_put(&req, CTRL_ATTR_FAMILY_NAME, NL80211_GENL_NAME, sizeof(NL80211_GENL_NAME));
+    if(nl_send(nl->cmd_fd, &req) < 0)
+        return -1;
+
+    length = recv(nl->cmd_fd, nl->buffer, nl->buflen, 0);
+    for(h = (const struct nlmsghdr *)nl->buffer; NLMSG_OK(h, length); h = NLMSG_NEXT(h, length))
+    {
+        const struct nlattr *tb[CTRL_ATTR_MAX + 1], *group;
+        int remaining;
+
+        if((h->nlmsg_seq != nl->seq) || (h->nlmsg_type != GENL_ID_CTRL))
+            continue;
+
+        attr_parse(tb, CTRL_ATTR_MAX, (const char *)NLMSG_DATA(h) + GENL_HDRLEN, h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+        if((tb[CTRL_ATTR_FAMILY_ID] == NULL) || (tb[CTRL_ATTR_MCAST_GROUPS] == NULL))
+            return -1;
+        nl->family_id = *(const uint16_t *)ATTR_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+
+        /* Groups are a nested array, each entry holding a name and an id */
+        group = ATTR_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+        remaining = ATTR_LEN(tb[CTRL_ATTR_MCAST_GROUPS]);
+        while((remaining >= NLA_HDRLEN) && (group->nla_len >= NLA_HDRLEN) && (group->nla_len <= remaining))
+        {
+            const struct nlattr *gb[CTRL_ATTR_MCAST_GRP_MAX + 1];
+
+            attr_parse(gb, CTRL_ATTR_MCAST_GRP_MAX, ATTR_DATA(group), ATTR_LEN(group));
+            if(gb[CTRL_ATTR_MCAST_GRP_NAME] && gb[CTRL_ATTR_MCAST_GRP_ID] &&
+                (strcmp(ATTR_DATA(gb[CTRL_ATTR_MCAST_GRP_NAME]), "scan") == 0))
+            {
+                nl->scan_group = *(const uint32_t *)ATTR_DATA(gb[CTRL_ATTR_MCAST_GRP_ID]);
+                return 0;
+            }
+            remaining -= NLA_ALIGN(group->nla_len);
+            group = (const struct nlattr *)((const char *)group + NLA_ALIGN(group->nla_len));
+        }
+        return -1;
+    }
+
+    return -1;
+}
+
+/*
+ * Reads any pending scan notifications without blocking. Returns 1 once our
+ * interface's results are ready, -1 if its scan was aborted, or 0 if neither
+ * has happened yet.
+ */
+static int scan_event(nl80211_scanner_t *nl)
+{
+    unsigned char event[EVENT_SIZE];
+
+    while(1)
+    {
+        const struct nlmsghdr *h;
+        int length = recv(nl->event_fd, event, sizeof(event), MSG_DONTWAIT);
+
+        if(length < 0)
+        {
+            /* Notifications were dropped, maybe ours among them, so look at what's there */
+            return (errno == ENOBUFS) ? 1 : 0;
+        }
+
+        for(h = (const struct nlmsghdr *)event; NLMSG_OK(h, length); h = NLMSG_NEXT(h, length))
+        {
+            const struct genlmsghdr *g = NLMSG_DATA(h);
+            const struct nlattr *tb[ATTR_MAX + 1];
+
+            if((h->nlmsg_type != nl->family_id) || (h->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)))
+                continue;
+            if((g->cmd != NL80211_CMD_NEW_SCAN_RESULTS) && (g->cmd != NL80211_CMD_SCAN_ABORTED))
+                continue;
+
+            attr_parse(tb, ATTR_MAX, (const char *)g + GENL_HDRLEN, h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+            if((tb[NL80211_ATTR_IFINDEX] == NULL) || (*(const uint32_t *)ATTR_DATA(tb[NL80211_ATTR_IFINDEX]) != nl->ifindex))
+                continue;
+
+            return (g->cmd == NL80211_CMD_NEW_SCAN_RESULTS) ? 1 : -1;
+        }
+    }
+}
+
+/* Reads the interface's whole BSS list into the dump buffer. Returns 0 or -1. */
+static int scan_dump(nl80211_scanner_t *nl)
+{
+    request_t req;
+    uint32_t index = nl->ifindex;
+
+    request_init(nl, &req, nl->family_id, NLM_F_REQUEST | NLM_F_DUMP, NL80211_CMD_GET_SCAN);
+    request_put(&req, NL80211_ATTR_IFINDEX, &index, sizeof(index));
+    if(nl_send(nl->cmd_fd, &req) < 0)
+        return -1;
+
+    nl->dump_length = 0;
+    while(1)
+    {
+        const struct nlmsghdr *h;
+        int length;
+
+        /* Peek at the size of the next message batch so it never gets truncated */
+        length = recv(nl->cmd_fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+        if(length < 0)
+            return -1;
+        if(nl->dump_length + length > nl->buflen)
+        {
+            int size = nl->buflen;
+            unsigned char *newbuf;
+
+            while(nl->dump_length + length > size)
+                size *= 2;
+            newbuf = realloc(nl->buffer, size);
+            if(newbuf == NULL)
+            {
+                printf("%s: Allocation failed\n", __FUNCTION__);
+                errno = ENOMEM;
+                return -1;
+            }
+            nl->buffer = newbuf;
+            nl->buflen = size;
+            nl->stats.allocations++;
+            nl->stats.buffer_size = nl->buflen;
+        }
+
+        length = recv(nl->cmd_fd, nl->buffer + nl->dump_length, nl->buflen - nl->dump_length, 0);
+        if(length < 0)
+            return -1;
+        nl->dump_length += length;
+
+        for(h = (const struct nlmsghdr *)(nl->buffer + nl->dump_length - length); NLMSG_OK(h, length); h = NLMSG_NEXT(h, length))
+        {
+            if(h->nlmsg_type == NLMSG_DONE)
+                return 0;
+            if(h->nlmsg_type == NLMSG_ERROR)
+            {
+                const struct nlmsgerr *err = NLMSG_DATA(h);
+                errno = -err->error;
+                return -1;
+            }
+        }
+    }
+}
+
+static void bss_parse(wifi_scan_t *cell, const struct nlattr **bss)
+{
+    const struct nlattr *ies;
+
+    if(bss[NL80211_BSS_FREQUENCY])
+    {
+        cell->frequency = *(const uint32_t *)ATTR_DATA(bss[NL80211_BSS_FREQUENCY]);
+        cell->channel = wifi_freq_to_channel(cell->frequency);
+    }
+
+    if(bss[NL80211_BSS_SIGNAL_MBM])
+    {
+        cell->signal = *(const int32_t *)ATTR_DATA(bss[NL80211_BSS_SIGNAL_MBM]) / 100;
+        cell->quality = wifi_quality_from_dbm(cell->signal);
+        cell->noise = 0;
+    }
+    else if(bss[NL80211_BSS_SIGNAL_UNSPEC])
+    {
+        /* Relative 0..100 */
+        cell->signal = *(const uint8_t *)ATTR_DATA(bss[NL80211_BSS_SIGNAL_UNSPEC]);
+        cell->quality = cell->signal;
+        cell->noise = 0;
+    }
+
+    if(bss[NL80211_BSS_SEEN_MS_AGO])
+        cell->age = *(const uint32_t *)ATTR_DATA(bss[NL80211_BSS_SEEN_MS_AGO]);
+
+    /* Probe response elements if there are any, otherwise the beacon's */
+    ies = bss[NL80211_BSS_INFORMATION_ELEMENTS] ? bss[NL80211_BSS_INFORMATION_ELEMENTS] : bss[NL80211_BSS_BEACON_IES];
+    if(ies)
+        bss_elements(cell, ATTR_DATA(ies), ATTR_LEN(ies));
+}
+
+/* Picks the SSID and, if the frequency was missing, the DS channel out of the 802.11 information elements */
+static void bss_elements(wifi_scan_t *cell, const unsigned char *ie, int length)
+{
+    while((length >= 2) && (ie[1] + 2 <= length))
+    {
+        if(ie[0] == 0)
+        {
+            int essid_length = (ie[1] > WIFI_ESSID_MAX) ? WIFI_ESSID_MAX : ie[1];
+
+            memcpy(cell->essid, ie + 2, essid_length);
+            cell->essid[essid_length] = '\0';
+            cell->target = wifi_scan_is_target(cell->essid, essid_length);
+        }
+        else if((ie[0] == 3) && (ie[1] >= 1) && (cell->channel == 0))
+        {
+            cell->channel = ie[2];
+        }
+
+        length -= ie[1] + 2;
+        ie += ie[1] + 2;
+    }
+}
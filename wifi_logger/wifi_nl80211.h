@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WIFI_NL80211_H
+#define WIFI_NL80211_H
+
+#include "wifi_scan.h"
+
+typedef struct nl80211_scanner nl80211_scanner_t;
+
+/* nl80211 scan backend, spoken directly over generic netlink (no libnl). One scanner per interface. */
+nl80211_scanner_t *nl80211_scan_init(const char *ifname);
+void nl80211_scan_close(nl80211_scanner_t *nl);
+int nl80211_scan_trigger(nl80211_scanner_t *nl, bool active, const int *frequencies, int frequency_count, const char **essids, int essid_count);
+int nl80211_scan_poll(nl80211_scanner_t *nl);
+int nl80211_scan_poll_delay(nl80211_scanner_t *nl);
+int nl80211_scan_fd(nl80211_scanner_t *nl);
+int nl80211_scan_collect(nl80211_scanner_t *nl, wifi_scan_result_t *result);
+int nl80211_scan_raw(nl80211_scanner_t *nl, const void **buf, int64_t *time);
+void nl80211_scan_get_stats(nl80211_scanner_t *nl, wifi_scan_stats_t *stats);
+int nl80211_parse_scan(const void *buf, int length, wifi_scan_result_t *result);
+
+#endif
+
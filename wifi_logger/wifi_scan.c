@@ -16,252 +16,958 @@
  */
 
 #include "wifi_scan.h"
+#include "wifi_nl80211.h"
+#include "wifi_capture.h"
+#include "wifi_wext.h"
+#include "monotonic.h"
 
-#include <iwlib.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
-typedef struct iwscan_state
+#define SCAN_FIRST_POLL     250     /* ms between set and first get */
+#define SCAN_POLL           100     /* ms between gets while results are not ready */
+#define SCAN_TIMEOUT        5000    /* ms */
+
+#define MAX_TARGETS         16
+
+static void cell_quality(wifi_scan_t *cell, const struct iw_quality *qual, const wifi_record_header_t *format);
+static int percent(int value, int max);
+static void cell_frequency(wifi_scan_t *cell, const struct iw_freq *freq);
+static void cell_custom(wifi_scan_t *cell, const char *data, int length);
+static int proc_quality(wifi_scanner_t *scanner, struct iw_quality *qual);
+static int wext_collect(wifi_scanner_t *scanner, wifi_scan_result_t *result);
+static int expire(wifi_scanner_t *scanner, wifi_scan_result_t *result);
+static void record_duration(wifi_scanner_t *scanner, int64_t ms);
+static int record_open(wifi_scanner_t *scanner, const char *file);
+static void record_scan(wifi_scanner_t *scanner, int64_t time, const void *buf, uint32_t length);
+
+/* One interface: its backend, settings and scan in flight */
+struct wifi_scanner
 {
-    int ap_num;
-    int val_index;
-} iwscan_state;
+    int backend;
+    int mode;
+    int active_interval, max_age;
+    int64_t last_active;
+    int skfd;
+    const char *interface;
+    nl80211_scanner_t *nl;
+    capture_scanner_t *capture;
+    
+    /* Frequencies (MHz) scans are limited to; none means every channel */
+    int frequencies[WIFI_MAX_CHANNELS];
+    int frequency_count;
+    bool directed;
+    
+    /* Range info is fetched once; the results buffer is kept between scans at the largest size needed */
+    struct iw_range range;
+    int has_range;
+    unsigned char *buffer;
+    int buflen;
+    wifi_scan_stats_t stats;
+    
+    /* Layout and scaling of the driver's results, also written at the head of a recording */
+    wifi_record_header_t format;
+    FILE *record;
+    
+    /* State of the scan in flight */
+    int state;
+    int64_t next_poll, deadline, ready_at;
+    int64_t triggered_at;
+    bool timing;
+    struct iwreq wrq;
+};
 
-static int skfd;
-static const char *interface, *target;
+/* Target ESSIDs, shared by every scanner; none means every network is a target */
+static char *target_list;
+static const char *targets[MAX_TARGETS];
+static int target_lengths[MAX_TARGETS];
+static int target_count;
+static int scanner_count;
 
-int wifi_scan_init(const char *ifname, const char *target_essid)
+/*
+ * Opens config->interface for scanning. Each interface gets its own scanner,
+ * so several radios can scan at once. Targets are taken from the first
+ * scanner opened. Returns the scanner, or NULL on error.
+ */
+wifi_scanner_t *wifi_scan_init(const wifi_scan_config_t *config)
 {
-    skfd = iw_sockets_open();
-    if(skfd < 0)
+    wifi_scanner_t *scanner = calloc(1, sizeof(*scanner));
+    
+    if(scanner == NULL)
+    {
+        printf("%s: Allocation failed\n", __FUNCTION__);
+        return NULL;
+    }
+    scanner->interface = config->interface;
+    scanner->backend = config->backend;
+    scanner->mode = config->mode;
+    scanner->active_interval = config->active_interval;
+    scanner->max_age = config->max_age;
+    scanner->skfd = -1;
+    scanner->state = WIFI_SCAN_IDLE;
+    
+    /* Comma separated list of target ESSIDs, empty or "*" for all */
+    if(scanner_count++ == 0)
+    {
+        target_count = 0;
+        target_list = strdup(config->targets ? config->targets : "");
+        if(target_list && strcmp(target_list, "*"))
+        {
+            char *essid;
+            for(essid = strtok(target_list, ","); essid && (target_count < MAX_TARGETS); essid = strtok(NULL, ","))
+            {
+                while(*essid == ' ')
+                    essid++;
+                if(*essid)
+                {
+                    char *end = essid + strlen(essid);
+                    while((end > essid) && (end[-1] == ' '))
+                        *--end = '\0';
+                    target_lengths[target_count] = end - essid;
+                    targets[target_count++] = essid;
+                }
+            }
+        }
+    }
+    
+    /* Comma separated list of channels to scan, empty for all */
+    if(config->channels)
+    {
+        const char *p = config->channels;
+        while(*p && (scanner->frequency_count < WIFI_MAX_CHANNELS))
+        {
+            int channel = strtol(p, (char **)&p, 10);
+            if(wifi_channel_to_freq(channel))
+                scanner->frequencies[scanner->frequency_count++] = wifi_channel_to_freq(channel);
+            while(*p && (*p != ','))
+                p++;
+            if(*p == ',')
+                p++;
+        }
+    }
+    
+    scanner->directed = config->directed && target_count;
+    
+    if((scanner->backend == WIFI_BACKEND_NL80211) && (scanner->mode != WIFI_MODE_LINK))
+    {
+        scanner->nl = nl80211_scan_init(scanner->interface);
+        if(scanner->nl == NULL)
+            goto error;
+        scanner->format.magic = WIFI_RECORD_MAGIC;
+        scanner->format.version = WIFI_RECORD_VERSION;
+        scanner->format.backend = WIFI_BACKEND_NL80211;
+        if(config->record && (record_open(scanner, config->record) < 0))
+            goto error;
+        return scanner;
+    }
+    if((scanner->backend == WIFI_BACKEND_CAPTURE) && (scanner->mode != WIFI_MODE_LINK))
+    {
+        scanner->capture = capture_scan_init(scanner->interface, config->capture_window);
+        if(scanner->capture == NULL)
+            goto error;
+        return scanner;
+    }
+    
+    scanner->skfd = wext_open();
+    if(scanner->skfd < 0)
     {
         printf("Error opening iw socket\n");
-        return -1;
+        goto error;
     }
     
-    interface = ifname;
-    target = target_essid;
+    /* Get range stuff */
+    scanner->has_range = (wext_get_range(scanner->skfd, scanner->interface, &scanner->range) >= 0);
+    scanner->format.magic = WIFI_RECORD_MAGIC;
+    scanner->format.version = WIFI_RECORD_VERSION;
+    scanner->format.we_version = scanner->has_range ? scanner->range.we_version_compiled : WIRELESS_EXT;
+    scanner->format.lcp_len = IW_EV_LCP_LEN;
+    scanner->format.has_range = scanner->has_range && (scanner->range.we_version_compiled >= 16);
+    scanner->format.max_qual = scanner->range.max_qual.qual;
+    scanner->format.max_level = scanner->range.max_qual.level;
+    scanner->format.max_noise = scanner->range.max_qual.noise;
+    scanner->format.backend = WIFI_BACKEND_WEXT;
     
-    return 0;
+    /* Link statistics can be read from drivers that don't scan, and scaled without range info */
+    if(scanner->mode == WIFI_MODE_LINK)
+        return scanner;
+    /* Check if the interface could support scanning. */
+    if((!scanner->has_range) || (scanner->range.we_version_compiled < 14))
+    {
+        printf("%-8.16s  Interface doesn't support scanning.\n\n", scanner->interface);
+        goto error;
+    }
+    
+    scanner->buflen = IW_SCAN_MAX_DATA;    /* Min for compat WE<17 */
+    scanner->buffer = malloc(scanner->buflen);
+    if(scanner->buffer == NULL)
+    {
+        printf("%s: Allocation failed\n", __FUNCTION__);
+        goto error;
+    }
+    scanner->stats.allocations++;
+    scanner->stats.buffer_size = scanner->buflen;
+    
+    /* Scan options need WE-17; older drivers always sweep everything for any network */
+    if((scanner->frequency_count || scanner->directed) && (scanner->range.we_version_compiled < 17))
+        printf("%-8.16s  Driver can't limit scans, scanning all channels\n", scanner->interface);
+    else if(scanner->directed && (target_count > 1))
+        printf("%-8.16s  Wireless Extensions can only probe for one ESSID, using %s\n", scanner->interface, targets[0]);
+    
+    if(config->record && (record_open(scanner, config->record) < 0))
+        goto error;
+    
+    return scanner;
+    
+error:
+    wifi_scan_close(scanner);
+    return NULL;
 }
 
-void wifi_scan_close(void)
+void wifi_scan_close(wifi_scanner_t *scanner)
 {
-    if(skfd != -1)
+    if(scanner == NULL)
+        return;
+    nl80211_scan_close(scanner->nl);
+    capture_scan_close(scanner->capture);
+    if(scanner->skfd != -1)
+        close(scanner->skfd);
+    free(scanner->buffer);
+    if(scanner->record)
+        fclose(scanner->record);
+    free(scanner);
+    
+    /* The targets go with the last scanner */
+    if(--scanner_count == 0)
     {
-        iw_sockets_close(skfd);
-        skfd = -1;
+        free(target_list);
+        target_list = NULL;
+        target_count = 0;
     }
 }
 
-/* Hacked from print_scanning_info function from iwlist.c */
-int wifi_scan(wifi_scan_t *scan)
+/* Hacked from print_scanning_info function from iwlist.c, split so that the 
+ * caller can carry on with other work while the driver scans */
+
+/*
+ * Starts a scan. In passive mode this only reads the results the kernel has
+ * cached from whoever scanned last (eg wpa_supplicant), with an active scan
+ * every active_interval seconds. Returns 0 on success or -1 on error.
+ */
+int wifi_scan_trigger(wifi_scanner_t *scanner)
 {
-    struct iwreq            wrq;
     struct iw_scan_req      scanopt;                      /* Options for 'set' */
-    unsigned char *         buffer = NULL;                /* Results */
-    int                     buflen = IW_SCAN_MAX_DATA;    /* Min for compat WE<17 */
-    struct iw_range         range;
-    int                     has_range;
-    struct timeval          tv;                           /* Select timeout */
-    int                     timeout = 5000000;            /* 5s */
-    int                     result = 0;
-
-    /* Get range stuff */
-    has_range = (iw_get_range_info(skfd, interface, &range) >= 0);
-    /* Check if the interface could support scanning. */
-    if((!has_range) || (range.we_version_compiled < 14))
+    bool active = (scanner->mode != WIFI_MODE_PASSIVE);
+    
+    if((scanner->mode == WIFI_MODE_PASSIVE) && scanner->active_interval && 
+        (monotonic_ms() - scanner->last_active >= scanner->active_interval * 1000))
     {
-        printf("%-8.16s  Interface doesn't support scanning.\n\n", interface);
-        return -1;
+        active = true;
+        scanner->last_active = monotonic_ms();
+    }
+    
+    scanner->timing = false;
+    if(scanner->backend == WIFI_BACKEND_CAPTURE)
+        return capture_scan_trigger(scanner->capture);
+    if(scanner->backend == WIFI_BACKEND_NL80211)
+    {
+        if(nl80211_scan_trigger(scanner->nl, active, scanner->frequencies, scanner->frequency_count, 
+            scanner->directed ? targets : NULL, scanner->directed ? target_count : 0) < 0)
+            return -1;
+        scanner->triggered_at = monotonic_ms();
+        scanner->timing = active;
+        return 0;
     }
+    if(scanner->buffer == NULL)
+        return -1;
 
     /* Init timeout value -> 250ms between set and first get */
-    tv.tv_sec = 0;
-    tv.tv_usec = 250000;
+    scanner->next_poll = monotonic_ms() + SCAN_FIRST_POLL;
+    scanner->deadline = monotonic_ms() + SCAN_TIMEOUT;
+
+    if(!active)
+    {
+        /* Cached results can be read straight away */
+        scanner->next_poll = monotonic_ms();
+        scanner->stats.cache_reads++;
+        scanner->state = WIFI_SCAN_PENDING;
+        return 0;
+    }
 
     /* Clean up set args */
     memset(&scanopt, 0, sizeof(scanopt));
 
     /* Initiate Scanning */
-    if(iw_set_ext(skfd, interface, SIOCSIWSCAN, &wrq) < 0)
+    scanner->wrq.u.data.pointer = NULL;
+    scanner->wrq.u.data.flags = 0;
+    scanner->wrq.u.data.length = 0;
+    
+    /* Only dwell on the configured channels, probing for the (first) target */
+    if((scanner->frequency_count || scanner->directed) && (scanner->range.we_version_compiled > 16))
+    {
+        int i;
+        
+        for(i = 0; i < scanner->frequency_count; i++)
+        {
+            scanopt.channel_list[i].m = scanner->frequencies[i];
+            scanopt.channel_list[i].e = 6;
+        }
+        scanopt.num_channels = scanner->frequency_count;
+        if(scanner->frequency_count)
+            scanner->wrq.u.data.flags |= IW_SCAN_THIS_FREQ;
+        
+        if(scanner->directed)
+        {
+            scanopt.essid_len = (target_lengths[0] > IW_ESSID_MAX_SIZE) ? IW_ESSID_MAX_SIZE : target_lengths[0];
+            memcpy(scanopt.essid, targets[0], scanopt.essid_len);
+            scanner->wrq.u.data.flags |= IW_SCAN_THIS_ESSID;
+        }
+        
+        scanner->wrq.u.data.pointer = (caddr_t)&scanopt;
+        scanner->wrq.u.data.length = sizeof(scanopt);
+    }
+    
+    if(wext_ioctl(scanner->skfd, scanner->interface, SIOCSIWSCAN, &scanner->wrq) < 0)
     {
         if((errno != EPERM))
         {
-            printf("sdfsdfdffhgdfg\n");
-            printf("%-8.16s  Interface doesn't support scanning : %s\n\n", interface, strerror(errno));
+            printf("%-8.16s  Interface doesn't support scanning : %s\n\n", scanner->interface, strerror(errno));
             return -1;
         }
-        tv.tv_usec = 0;
+        /* Not allowed to trigger, but we can still read what's there */
+        scanner->next_poll = monotonic_ms();
     }
-    timeout -= tv.tv_usec;
-
-    /* Forever */
-    while(1)
+    else
     {
-        fd_set            rfds;           /* File descriptors for select */
-        int               last_fd;        /* Last fd */
-        int               ret;
-
-        /* Guess what ? We must re-generate rfds each time */
-        FD_ZERO(&rfds);
-        last_fd = -1;
-
-        /* Wait until something happens */
-        ret = select(last_fd + 1, &rfds, NULL, NULL, &tv);
+        scanner->triggered_at = monotonic_ms();
+        scanner->timing = true;
+    }
+    
+    scanner->stats.scans++;
+    scanner->state = WIFI_SCAN_PENDING;
+    
+    return 0;
+}
 
-        /* Check if there was an error */
-        if(ret < 0)
+/*
+ * Checks on the scan in flight without blocking. Returns WIFI_SCAN_PENDING
+ * until the results have been read (WIFI_SCAN_READY), WIFI_SCAN_IDLE if no
+ * scan was triggered, or -1 if the scan failed or timed out.
+ */
+int wifi_scan_poll(wifi_scanner_t *scanner)
+{
+    int64_t now;
+    
+    if(scanner->backend == WIFI_BACKEND_CAPTURE)
+        return capture_scan_poll(scanner->capture);
+    if(scanner->backend == WIFI_BACKEND_NL80211)
+    {
+        int result = nl80211_scan_poll(scanner->nl);
+        if((result == WIFI_SCAN_READY) && scanner->timing)
         {
-            if(errno == EAGAIN || errno == EINTR)
-                continue;
-            printf("Unhandled signal - exiting...\n");
-            return -1;
+            record_duration(scanner, monotonic_ms() - scanner->triggered_at);
+            scanner->timing = false;
         }
+        return result;
+    }
+    if(scanner->state != WIFI_SCAN_PENDING)
+        return scanner->state;
+    
+    now = monotonic_ms();
+    if(now < scanner->next_poll)
+        return scanner->state;
 
-        /* Check if there was a timeout */
-        if(ret == 0)
+    while(1)
+    {
+        /* Grow the buffer only when the driver asked for more */
+        if(scanner->buflen > scanner->stats.buffer_size)
         {
-            unsigned char *newbuf;
-
-        realloc:
-            /* (Re)allocate the buffer - realloc(NULL, len) == malloc(len) */
-            newbuf = realloc(buffer, buflen);
+            unsigned char *newbuf = realloc(scanner->buffer, scanner->buflen);
             if(newbuf == NULL)
             {
-                if(buffer)
-                    free(buffer);
                 printf("%s: Allocation failed\n", __FUNCTION__);
+                scanner->buflen = scanner->stats.buffer_size;
+                scanner->state = WIFI_SCAN_IDLE;
                 return -1;
             }
-            buffer = newbuf;
+            scanner->buffer = newbuf;
+            scanner->stats.allocations++;
+            scanner->stats.buffer_size = scanner->buflen;
+        }
 
-            /* Try to read the results */
-            wrq.u.data.pointer = buffer;
-            wrq.u.data.flags = 0;
-            wrq.u.data.length = buflen;
-            if(iw_get_ext(skfd, interface, SIOCGIWSCAN, &wrq) < 0)
+        /* Try to read the results */
+        scanner->wrq.u.data.pointer = scanner->buffer;
+        scanner->wrq.u.data.flags = 0;
+        scanner->wrq.u.data.length = scanner->buflen;
+        if(wext_ioctl(scanner->skfd, scanner->interface, SIOCGIWSCAN, &scanner->wrq) < 0)
+        {
+            /* Check if buffer was too small (WE-17 only) */
+            if((errno == E2BIG) && (scanner->range.we_version_compiled > 16))
             {
-                /* Check if buffer was too small (WE-17 only) */
-                if((errno == E2BIG) && (range.we_version_compiled > 16))
-                {
-                    /* Some driver may return very large scan results, either
-                    * because there are many cells, or because they have many
-                    * large elements in cells (like IWEVCUSTOM). Most will
-                    * only need the regular sized buffer. We now use a dynamic
-                    * allocation of the buffer to satisfy everybody. Of course,
-                    * as we don't know in advance the size of the array, we try
-                    * various increasing sizes. Jean II */
-
-                    /* Check if the driver gave us any hints. */
-                    if(wrq.u.data.length > buflen)
-                        buflen = wrq.u.data.length;
-                    else
-                        buflen *= 2;
-
-                    /* Try again */
-                    goto realloc;
-                }
+                /* Some driver may return very large scan results, either
+                * because there are many cells, or because they have many
+                * large elements in cells (like IWEVCUSTOM). Most will
+                * only need the regular sized buffer. We now use a dynamic
+                * allocation of the buffer to satisfy everybody. Of course,
+                * as we don't know in advance the size of the array, we try
+                * various increasing sizes. Jean II */
 
-                /* Check if results not available yet */
-                if(errno == EAGAIN)
-                {
-                    /* Restart timer for only 100ms*/
-                    tv.tv_sec = 0;
-                    tv.tv_usec = 100000;
-                    timeout -= tv.tv_usec;
-                    if(timeout > 0)
-                        continue;   /* Try again later */
-                }
+                /* Check if the driver gave us any hints. */
+                if(scanner->wrq.u.data.length > scanner->buflen)
+                    scanner->buflen = scanner->wrq.u.data.length;
+                else
+                    scanner->buflen *= 2;
+                scanner->stats.e2big_retries++;
 
-                /* Bad error */
-                free(buffer);
-                printf("%-8.16s  Failed to read scan data : %s\n\n", interface, strerror(errno));
-                return -2;
+                /* Try again */
+                continue;
+            }
+
+            /* Check if results not available yet */
+            if(errno == EAGAIN)
+            {
+                /* Try again in 100ms */
+                scanner->next_poll = now + SCAN_POLL;
+                if(scanner->next_poll < scanner->deadline)
+                    return scanner->state;
             }
-            else
-                /* We have the results, go to process them */
-                break;
+
+            /* Bad error */
+            printf("%-8.16s  Failed to read scan data : %s\n\n", scanner->interface, strerror(errno));
+            scanner->state = WIFI_SCAN_IDLE;
+            return -1;
+        }
+        
+        /* We have the results */
+        if(scanner->timing)
+        {
+            record_duration(scanner, now - scanner->triggered_at);
+            scanner->timing = false;
         }
+        scanner->ready_at = now;
+        if(scanner->record)
+            record_scan(scanner, scanner->ready_at, scanner->buffer, scanner->wrq.u.data.length);
+        scanner->state = WIFI_SCAN_READY;
+        return scanner->state;
+    }
+}
+
+/* Milliseconds until wifi_scan_poll next needs calling, or -1 if no scan is in flight */
+int wifi_scan_poll_delay(wifi_scanner_t *scanner)
+{
+    int64_t delay;
+    
+    if(scanner->backend == WIFI_BACKEND_CAPTURE)
+        return capture_scan_poll_delay(scanner->capture);
+    if(scanner->backend == WIFI_BACKEND_NL80211)
+        return nl80211_scan_poll_delay(scanner->nl);
+    if(scanner->state != WIFI_SCAN_PENDING)
+        return (scanner->state == WIFI_SCAN_READY) ? 0 : -1;
+    
+    delay = scanner->next_poll - monotonic_ms();
+    return (delay > 0) ? (int)delay : 0;
+}
+
+/*
+ * A descriptor that becomes readable when a scan in flight may have finished
+ * early, for the caller to poll on alongside wifi_scan_poll_delay. Only
+ * nl80211 has one; -1 means the scan only moves on when its delay runs out.
+ * Captures are drained on their timer rather than per beacon, so don't offer
+ * their socket either.
+ */
+int wifi_scan_fd(wifi_scanner_t *scanner)
+{
+    if(scanner->backend == WIFI_BACKEND_NL80211)
+        return nl80211_scan_fd(scanner->nl);
+    return -1;
+}
+
+/*
+ * Fills result with every cell of a completed scan, keyed by BSSID, marking
+ * those whose ESSID is a target, and leaves the scanner idle. Returns the 
+ * number of cells or -1.
+ */
+int wifi_scan_collect(wifi_scanner_t *scanner, wifi_scan_result_t *result)
+{
+    int count;
+    
+    if(scanner->backend == WIFI_BACKEND_CAPTURE)
+        count = capture_scan_collect(scanner->capture, result);
+    else if(scanner->backend == WIFI_BACKEND_NL80211)
+    {
+        const void *dump;
+        int64_t time;
+        int length;
+        
+        if(scanner->record && ((length = nl80211_scan_raw(scanner->nl, &dump, &time)) >= 0))
+            record_scan(scanner, time, dump, length);
+        count = nl80211_scan_collect(scanner->nl, result);
+    }
+    else
+        count = wext_collect(scanner, result);
+    
+    if((count > 0) && scanner->max_age)
+        count = expire(scanner, result);
+    
+    return count;
+}
+
+void wifi_scan_get_stats(wifi_scanner_t *scanner, wifi_scan_stats_t *s)
+{
+    if(scanner->backend == WIFI_BACKEND_CAPTURE)
+        capture_scan_get_stats(scanner->capture, s);
+    else if(scanner->backend == WIFI_BACKEND_NL80211)
+    {
+        nl80211_scan_get_stats(scanner->nl, s);
+        s->expired = scanner->stats.expired;
+        memcpy(s->duration, scanner->stats.duration, sizeof(s->duration));
+    }
+    else
+        *s = scanner->stats;
+}
+
+/* Blocking scan: trigger, wait for the results and collect them */
+int wifi_scan(wifi_scanner_t *scanner, wifi_scan_result_t *result)
+{
+    int status;
+    
+    if(wifi_scan_trigger(scanner) < 0)
+        return -1;
+    
+    while((status = wifi_scan_poll(scanner)) == WIFI_SCAN_PENDING)
+    {
+        struct pollfd fds;
+        
+        /* Poll ignores a negative fd, leaving just the timeout */
+        fds.fd = wifi_scan_fd(scanner);
+        fds.events = POLLIN;
+        poll(&fds, 1, wifi_scan_poll_delay(scanner));
     }
+    
+    if(status < 0)
+        return -2;
+    
+    return wifi_scan_collect(scanner, result);
+}
+
+/*
+ * Reads the statistics of the link to the access point we're associated
+ * with, through SIOCGIWSTATS or failing that /proc/net/wireless. This needs
+ * no scan, so it can be called tens of times a second. Returns 1 with link
+ * filled in, 0 if not associated, or -1 on error.
+ */
+int wifi_scan_link(wifi_scanner_t *scanner, wifi_scan_t *link)
+{
+    static const unsigned char none[6] = { 0 }, fake[6] = { 0x44, 0x44, 0x44, 0x44, 0x44, 0x44 }, 
+        broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    struct iwreq req;
+    struct iw_statistics iwstats;
+    struct iw_quality qual;
+    char essid[IW_ESSID_MAX_SIZE + 2];
+    
+    if(scanner->skfd < 0)
+        return -1;
+    
+    memset(link, 0, sizeof(*link));
+    if(wext_ioctl(scanner->skfd, scanner->interface, SIOCGIWAP, &req) < 0)
+        return -1;
+    memcpy(link->bssid, req.u.ap_addr.sa_data, sizeof(link->bssid));
+    if(!memcmp(link->bssid, none, 6) || !memcmp(link->bssid, fake, 6) || !memcmp(link->bssid, broadcast, 6))
+        return 0;
+    
+    req.u.essid.pointer = (caddr_t)essid;
+    req.u.essid.length = sizeof(essid);
+    req.u.essid.flags = 0;
+    if(wext_ioctl(scanner->skfd, scanner->interface, SIOCGIWESSID, &req) >= 0)
+    {
+        int length = (req.u.essid.length > WIFI_ESSID_MAX) ? WIFI_ESSID_MAX : req.u.essid.length;
+        memcpy(link->essid, essid, length);
+        link->essid[length] = '\0';
+    }
+    link->target = wifi_scan_is_target(link->essid, strlen(link->essid));
+    
+    if(wext_ioctl(scanner->skfd, scanner->interface, SIOCGIWFREQ, &req) >= 0)
+        cell_frequency(link, &req.u.freq);
+    
+    req.u.data.pointer = (caddr_t)&iwstats;
+    req.u.data.length = sizeof(iwstats);
+    req.u.data.flags = 1;   /* Clear the updated flags */
+    if(wext_ioctl(scanner->skfd, scanner->interface, SIOCGIWSTATS, &req) >= 0)
+        cell_quality(link, &iwstats.qual, &scanner->format);
+    else if(proc_quality(scanner, &qual) == 0)
+        cell_quality(link, &qual, &scanner->format);
+    else
+        return -1;
+    
+    link->age = 0;
+    return 1;
+}
 
-    if(wrq.u.data.length)
+/* Finds the table entry for bssid, adding it if this is the first time it's been seen */
+wifi_scan_t *wifi_scan_lookup(wifi_scan_result_t *result, const unsigned char *bssid)
+{
+    wifi_scan_t *cell;
+    int i;
+    
+    for(i = 0; i < result->count; i++)
     {
-        struct iw_event         iwe;
-        struct stream_descr     stream;
-        int                     ret;
-        bool                    found_target = false;    
+        if(memcmp(result->bss[i].bssid, bssid, sizeof(result->bss[i].bssid)) == 0)
+            return &result->bss[i];
+    }
+    
+    if(result->count == WIFI_SCAN_MAX_BSS)
+    {
+        result->truncated++;
+        return NULL;
+    }
+    
+    cell = &result->bss[result->count++];
+    memset(cell, 0, sizeof(*cell));
+    memcpy(cell->bssid, bssid, sizeof(cell->bssid));
+    cell->target = wifi_scan_is_target("", 0);
+    cell->age = -1;
+    
+    return cell;
+}
 
-        iw_init_event_stream(&stream, (char *) buffer, wrq.u.data.length);
-        do
+bool wifi_scan_is_target(const char *essid, int length)
+{
+    int i;
+    
+    if(target_count == 0)
+        return true;
+    
+    for(i = 0; i < target_count; i++)
+    {
+        if((target_lengths[i] == length) && (memcmp(targets[i], essid, length) == 0))
+            return true;
+    }
+    
+    return false;
+}
+
+/* Channel number for a centre frequency in MHz, or 0 if it isn't a 2.4 or 5 GHz channel */
+int wifi_freq_to_channel(int frequency)
+{
+    if(frequency == 2484)
+        return 14;
+    else if((frequency >= 2412) && (frequency < 2484))
+        return (frequency - 2407) / 5;
+    else if((frequency >= 5000) && (frequency < 6000))
+        return (frequency - 5000) / 5;
+    else
+        return 0;
+}
+
+/* Centre frequency in MHz of a 2.4 or 5 GHz channel, or 0 if there's no such channel */
+int wifi_channel_to_freq(int channel)
+{
+    if(channel == 14)
+        return 2484;
+    else if((channel >= 1) && (channel < 14))
+        return 2407 + channel * 5;
+    else if((channel >= 34) && (channel <= 196))
+        return 5000 + channel * 5;
+    else
+        return 0;
+}
+
+/* Quality on cfg80211's Wireless Extensions scale, where -110..-40 dBm maps to 0..70 of 70 */
+int wifi_quality_from_dbm(int dbm)
+{
+    int level = (dbm < -110) ? -110 : (dbm > -40) ? -40 : dbm;
+    
+    return (100 * (level + 110)) / 70;
+}
+
+/*
+ * Fills result with every cell in a raw SIOCGIWSCAN buffer laid out and 
+ * scaled as described by format, or in an nl80211 dump if the format says so.
+ * Needs no driver, so recorded buffers can be replayed through it, including
+ * those recorded on a host with a different event layout. Returns the number
+ * of cells, or -1 if the layout is unknown.
+ */
+int wifi_scan_parse(const wifi_record_header_t *format, const void *buf, int length, wifi_scan_result_t *result, 
+    wifi_scan_stats_t *stats)
+{
+    wext_stream_t           stream;
+    wext_event_t            event;
+    int                     ret;
+    wifi_scan_t             *cell = NULL;
+    
+    if(format->backend == WIFI_BACKEND_NL80211)
+        return nl80211_parse_scan(buf, length, result);
+    
+    result->count = 0;
+    result->truncated = 0;
+    
+    if((format->lcp_len != 4) && (format->lcp_len != 8))
+        return -1;
+
+    /* Events are read in place; only the fields a cell needs are copied out */
+    wext_stream_init(&stream, buf, length, format->lcp_len, format->we_version);
+    while((ret = wext_stream_next(&stream, &event)) > 0)
+    {
+        if(stats)
+            stats->events++;
+        switch(event.cmd)
         {
-            /* Extract an event and process it */
-            ret = iw_extract_event_stream(&stream, &iwe, range.we_version_compiled);
-            if(ret > 0)
+            /* Each cell starts with its BSSID, after the sockaddr's family */
+            case SIOCGIWAP:
+            {
+                if(event.length >= 2 + 6)
+                    cell = wifi_scan_lookup(result, event.data + 2);
+            } break;
+            
+            case SIOCGIWFREQ:
             {
-                switch(iwe.cmd)
+                struct iw_freq freq;
+                if(cell && (event.length >= (int)sizeof(freq)))
                 {
-                    case SIOCGIWESSID:
-                    {
-                        char essid[IW_ESSID_MAX_SIZE+1];
-                        memset(essid, '\0', sizeof(essid));
-                        if((iwe.u.essid.pointer) && (iwe.u.essid.length))
-                            memcpy(essid, iwe.u.essid.pointer, iwe.u.essid.length);
-                        if(strcmp(target, essid) == 0)
-                            found_target = true;
-                    } break;
-                    
-                    case IWEVQUAL:
-                    {
-                        if(found_target)
-                        {   
-                            /* If the statistics are in dBm */
-                            if(has_range && (iwe.u.qual.level != 0))
-                            {
-                                /* Statistics are in dBm (absolute power measurement) */
-                                if(iwe.u.qual.level > range.max_qual.level)
-                                {
-                                    scan->quality = (100*iwe.u.qual.qual) / range.max_qual.qual;
-                                    scan->signal = iwe.u.qual.level - 0x100;
-                                    scan->noise = iwe.u.qual.noise - 0x100;
-                                }
-                                /* Statistics are relative values (0 -> max) */
-                                else
-                                {
-                                    scan->quality = (100*iwe.u.qual.qual) / range.max_qual.qual;
-                                    scan->signal = (100*iwe.u.qual.level) / range.max_qual.level;
-                                    scan->noise = (100*iwe.u.qual.noise) / range.max_qual.noise;                                    
-                                }
-                            }
-                            /* We can't read the range, so we don't know... */
-                            else
-                            {
-                                scan->quality = iwe.u.qual.qual;
-                                scan->signal = iwe.u.qual.level;
-                                scan->noise = iwe.u.qual.noise;
-                            }
-                            goto exit;
-                        }
-                    } break;
-                    
-                    default:
-                    {
-                        ; //Not interested in other fields
-                    } break;                    
+                    memcpy(&freq, event.data, sizeof(freq));
+                    cell_frequency(cell, &freq);
                 }
-            }
-        } while(ret > 0);
+            } break;
+            
+            case SIOCGIWESSID:
+            {
+                const unsigned char *essid;
+                int essid_length;
+                if(cell && ((essid_length = wext_event_point(&stream, &event, &essid)) >= 0))
+                {
+                    if(essid_length > WIFI_ESSID_MAX)
+                        essid_length = WIFI_ESSID_MAX;
+                    cell->target = wifi_scan_is_target((const char *)essid, essid_length);
+                    memcpy(cell->essid, essid, essid_length);
+                    cell->essid[essid_length] = '\0';
+                }
+            } break;
+            
+            case IWEVQUAL:
+            {
+                struct iw_quality qual;
+                if(cell && (event.length >= (int)sizeof(qual)))
+                {
+                    memcpy(&qual, event.data, sizeof(qual));
+                    cell_quality(cell, &qual, format);
+                }
+            } break;
+            
+            case IWEVCUSTOM:
+            {
+                const unsigned char *custom;
+                int custom_length;
+                if(cell && ((custom_length = wext_event_point(&stream, &event, &custom)) > 0))
+                    cell_custom(cell, (const char *)custom, custom_length);
+            } break;
+            
+            default:
+            {
+                ; //Not interested in other fields, skipped without decoding
+            } break;                    
+        }
+    }
+    
+    if(ret < 0)
+        printf("Malformed scan results, %d cells read\n", result->count);
+    
+    return result->count;
+}
+
+/*
+ * Private functions
+ */
+
+/* Reads the cells out of the WEXT event stream */
+static int wext_collect(wifi_scanner_t *scanner, wifi_scan_result_t *result)
+{
+    if(scanner->state != WIFI_SCAN_READY)
+        return -1;
+    scanner->state = WIFI_SCAN_IDLE;
+    
+    result->count = 0;
+    result->truncated = 0;
+    result->received = scanner->ready_at;
+
+    if(scanner->wrq.u.data.length)
+        wifi_scan_parse(&scanner->format, scanner->buffer, scanner->wrq.u.data.length, result, &scanner->stats);
+    else
+        printf("%-8.16s  No scan results\n\n", scanner->interface);
+    
+    return result->count;
+}
+
+static void cell_quality(wifi_scan_t *cell, const struct iw_quality *qual, const wifi_record_header_t *format)
+{
+    /* If the statistics are in dBm */
+    if(format->has_range && (qual->level != 0))
+    {
+        /* Statistics are in dBm (absolute power measurement) */
+        if(qual->level > format->max_level)
+        {
+            cell->quality = percent(qual->qual, format->max_qual);
+            cell->signal = qual->level - 0x100;
+            cell->noise = qual->noise - 0x100;
+        }
+        /* Statistics are relative values (0 -> max) */
+        else
+        {
+            cell->quality = percent(qual->qual, format->max_qual);
+            cell->signal = percent(qual->level, format->max_level);
+            cell->noise = percent(qual->noise, format->max_noise);
+        }
     }
+    /* We can't read the range, so we don't know... */
     else
     {
-        printf("%-8.16s  No scan results\n\n", interface);
-        result = -1;
+        cell->quality = qual->qual;
+        cell->signal = qual->level;
+        cell->noise = qual->noise;
+    }
+}
+
+/* Scales a relative value to a percentage of its range maximum. Some drivers report a maximum of 0, so the raw value is kept then. */
+static int percent(int value, int max)
+{
+    return (max > 0) ? (100 * value) / max : value;
+}
+
+/* Drivers report either a channel number (e == 0, small m) or a frequency in Hz as m * 10^e */
+static void cell_frequency(wifi_scan_t *cell, const struct iw_freq *freq)
+{
+    int64_t hz = freq->m;
+    int e;
+    
+    if((freq->e == 0) && (freq->m >= 0) && (freq->m < 1000))
+    {
+        cell->channel = freq->m;
+        return;
     }
     
-exit:   
-    free(buffer);
+    for(e = freq->e; e > 0; e--)
+        hz *= 10;
+    cell->frequency = hz / 1000000;
+    cell->channel = wifi_freq_to_channel(cell->frequency);
+}
+
+/* cfg80211 reports how long ago a cached cell was heard as "Last beacon: <n>ms ago" */
+static void cell_custom(wifi_scan_t *cell, const char *data, int length)
+{
+    static const char prefix[] = "Last beacon: ";
+    int i = sizeof(prefix) - 1;
+    unsigned int age = 0;
     
-    return result;
+    /* Parsed in place, other custom strings are skipped on their prefix */
+    if((length <= i) || memcmp(data, prefix, i) || (data[i] < '0') || (data[i] > '9'))
+        return;
+    for(; (i < length) && (data[i] >= '0') && (data[i] <= '9'); i++)
+        age = age * 10 + (data[i] - '0');
+    if((length - i >= 2) && (memcmp(data + i, "ms", 2) == 0))
+        cell->age = age;
 }
 
+/* Reads the interface's line of /proc/net/wireless, for drivers without SIOCGIWSTATS */
+static int proc_quality(wifi_scanner_t *scanner, struct iw_quality *qual)
+{
+    char buf[4096], *line;
+    int fd, length, link, level, noise;
+    
+    fd = open("/proc/net/wireless", O_RDONLY);
+    if(fd < 0)
+        return -1;
+    length = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(length <= 0)
+        return -1;
+    buf[length] = '\0';
+    
+    /* "  wlan0: 0000   54.  -56.  -95.  ..." where a trailing '.' marks an updated value */
+    for(line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"))
+    {
+        char *name = line + strspn(line, " ");
+        char *colon = strchr(name, ':');
+        
+        if((colon == NULL) || (colon - name != (int)strlen(scanner->interface)) || 
+            strncmp(name, scanner->interface, colon - name))
+            continue;
+        if(sscanf(colon + 1, " %*x %d%*[. ] %d%*[. ] %d", &link, &level, &noise) != 3)
+            return -1;
+        
+        /* dBm values are printed signed; put them back the way the ioctl reports them */
+        memset(qual, 0, sizeof(*qual));
+        qual->qual = link;
+        qual->level = (level < 0) ? level + 0x100 : level;
+        qual->noise = (noise < 0) ? noise + 0x100 : noise;
+        return 0;
+    }
+    
+    return -1;
+}
+
+/* Drops the cells last heard more than max_age ms ago. Returns the number left. */
+static int expire(wifi_scanner_t *scanner, wifi_scan_result_t *result)
+{
+    int i, count = 0;
+    
+    for(i = 0; i < result->count; i++)
+    {
+        if(result->bss[i].age > scanner->max_age)
+        {
+            scanner->stats.expired++;
+            continue;
+        }
+        if(count != i)
+            result->bss[count] = result->bss[i];
+        count++;
+    }
+    
+    result->count = count;
+    return count;
+}
+
+static void record_duration(wifi_scanner_t *scanner, int64_t ms)
+{
+    int bin = 0;
+    
+    while((ms > 0) && (bin < WIFI_SCAN_HISTOGRAM - 1))
+    {
+        ms >>= 1;
+        bin++;
+    }
+    scanner->stats.duration[bin]++;
+}
+
+/* Creates the recording and writes the results' format at its head. Returns 0 or -1. */
+static int record_open(wifi_scanner_t *scanner, const char *file)
+{
+    scanner->record = fopen(file, "wb");
+    if((scanner->record == NULL) || (fwrite(&scanner->format, sizeof(scanner->format), 1, scanner->record) != 1))
+    {
+        printf("Failed to create %s scan recording\n", file);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Appends the buffer just read to the recording */
+static void record_scan(wifi_scanner_t *scanner, int64_t time, const void *buf, uint32_t length)
+{
+    wifi_record_t header;
+    
+    memset(&header, 0, sizeof(header));
+    header.time = time;
+    header.length = length;
+    if((fwrite(&header, sizeof(header), 1, scanner->record) != 1) || 
+        (fwrite(buf, 1, header.length, scanner->record) != header.length))
+    {
+        printf("Scan recording failed, no longer recording\n");
+        fclose(scanner->record);
+        scanner->record = NULL;
+    }
+}
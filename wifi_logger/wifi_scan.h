@@ -18,16 +18,132 @@
 #ifndef WIFI_SCAN_H
 #define WIFI_SCAN_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+
+/* Scanner states, as returned by wifi_scan_poll */
+#define WIFI_SCAN_IDLE      0
+#define WIFI_SCAN_PENDING   1
+#define WIFI_SCAN_READY     2
+
+/* Sampling modes */
+#define WIFI_MODE_ACTIVE        0   /* Scan for every sample */
+#define WIFI_MODE_PASSIVE       1   /* Read the kernel's cached results instead of scanning */
+#define WIFI_MODE_LINK          2   /* Sample the associated link's statistics, no scanning */
+
+/* Scan backends */
+#define WIFI_BACKEND_WEXT       0   /* Wireless Extensions ioctls */
+#define WIFI_BACKEND_NL80211    1   /* nl80211 over generic netlink */
+#define WIFI_BACKEND_CAPTURE    2   /* Beacons captured in monitor mode, or replayed from a .pcap file */
+
+#define WIFI_SCAN_MAX_BSS   256
+#define WIFI_ESSID_MAX      32
+#define WIFI_MAX_CHANNELS   32
+
+/* Scan durations are binned in powers of two: bin 0 is 0 ms, bin i holds 
+ * [2^(i-1), 2^i) ms and the last bin everything longer */
+#define WIFI_SCAN_HISTOGRAM 16
+
+/* One BSS as measured by a scan */
 typedef struct
 {
+    unsigned char bssid[6];
+    char essid[WIFI_ESSID_MAX + 1];
+    bool target;            /* ESSID is in the target list */
+    int channel;
+    int frequency;          /* MHz, 0 if the driver only gave the channel */
     int quality;
     int signal;
     int noise;
+    int age;                /* ms since the BSS was last heard, -1 if the driver doesn't say */
 } wifi_scan_t;
 
-int wifi_scan_init(const char *ifname, const char *target_essid);
-void wifi_scan_close(void);
-int wifi_scan(wifi_scan_t *scan);
+/* Every BSS seen by one scan */
+typedef struct
+{
+    int count;
+    int truncated;          /* Cells that didn't fit in the table */
+    int64_t received;       /* Monotonic ms at which the results were read from the driver */
+    wifi_scan_t bss[WIFI_SCAN_MAX_BSS];
+} wifi_scan_result_t;
+
+/* Raw scan results recorded for offline replay: a header, then a wifi_record_t
+ * and its data per scan - a SIOCGIWSCAN event stream, or for nl80211 the
+ * NL80211_CMD_GET_SCAN dump messages */
+#define WIFI_RECORD_MAGIC       0x52535749UL    /* "IWSR" */
+#define WIFI_RECORD_VERSION     1
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t we_version;    /* Wireless Extensions version of the driver */
+    uint16_t lcp_len;       /* Event header length on the recording host (IW_EV_LCP_LEN, 4 or 8) */
+    uint8_t has_range;      /* The max_ fields are valid */
+    uint8_t max_qual;
+    uint8_t max_level;
+    uint8_t max_noise;
+    uint8_t backend;        /* WIFI_BACKEND_WEXT or WIFI_BACKEND_NL80211 */
+    uint8_t reserved;
+} wifi_record_header_t;
+
+typedef struct
+{
+    int64_t time;           /* Monotonic ms the results were read at */
+    uint32_t length;        /* Bytes of scan data that follow */
+    uint32_t reserved;
+} wifi_record_t;
+
+typedef struct
+{
+    unsigned long scans;            /* Scans triggered */
+    unsigned long cache_reads;      /* Passive reads of the kernel's cached results */
+    unsigned long expired;          /* Cached cells dropped for being older than max_age */
+    unsigned long allocations;      /* Results buffer (re)allocations, including the initial one */
+    unsigned long e2big_retries;    /* SIOCGIWSCAN calls that had to be repeated with a bigger buffer */
+    int buffer_size;                /* Current results buffer size, bytes */
+    unsigned long events;           /* Wireless Extensions scan events walked */
+    unsigned long frames;           /* Beacons and probe responses captured */
+    unsigned long dropped;          /* Frames the kernel dropped before they were read */
+    unsigned long duration[WIFI_SCAN_HISTOGRAM];    /* Active scans by time from trigger to results */
+} wifi_scan_stats_t;
+
+typedef struct
+{
+    const char *interface;  /* One interface; open a scanner for each radio */
+    const char *targets;    /* Comma separated ESSIDs, empty or "*" for all */
+    int backend;
+    int mode;
+    int active_interval;    /* Passive mode still scans this often (seconds, 0 = never) */
+    int max_age;            /* Drop cached cells last heard longer ago than this (ms, 0 = keep all) */
+    const char *channels;   /* Comma separated channels to scan, empty for all */
+    bool directed;          /* Probe for the target ESSIDs by name (WEXT: rather than any network) */
+    int capture_window;     /* Capture backend: ms of beacons averaged into each result */
+    const char *record;     /* Append every raw WEXT or nl80211 scan buffer to this file, NULL for none */
+} wifi_scan_config_t;
+
+/* One per interface; radios are scanned independently */
+typedef struct wifi_scanner wifi_scanner_t;
+
+wifi_scanner_t *wifi_scan_init(const wifi_scan_config_t *config);
+void wifi_scan_close(wifi_scanner_t *scanner);
+int wifi_scan_trigger(wifi_scanner_t *scanner);
+int wifi_scan_poll(wifi_scanner_t *scanner);
+int wifi_scan_poll_delay(wifi_scanner_t *scanner);
+int wifi_scan_fd(wifi_scanner_t *scanner);
+int wifi_scan_collect(wifi_scanner_t *scanner, wifi_scan_result_t *result);
+int wifi_scan(wifi_scanner_t *scanner, wifi_scan_result_t *result);
+void wifi_scan_get_stats(wifi_scanner_t *scanner, wifi_scan_stats_t *stats);
+int wifi_scan_link(wifi_scanner_t *scanner, wifi_scan_t *link);
+int wifi_scan_parse(const wifi_record_header_t *format, const void *buf, int length, wifi_scan_result_t *result, 
+    wifi_scan_stats_t *stats);
+
+/* Shared by the backends */
+wifi_scan_t *wifi_scan_lookup(wifi_scan_result_t *result, const unsigned char *bssid);
+bool wifi_scan_is_target(const char *essid, int length);
+int wifi_freq_to_channel(int frequency);
+int wifi_channel_to_freq(int channel);
+int wifi_quality_from_dbm(int dbm);
 
 #endif
 
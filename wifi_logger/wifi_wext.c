@@ -0,0 +1,132 @@
+/*
+ *  Wireless Extensions ioctls and an in-place walker for SIOCGIWSCAN event streams
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wifi_wext.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define RANGE_MIN_LENGTH    300     /* Anything shorter predates we_version_compiled */
+
+/* Starts walking a SIOCGIWSCAN buffer laid out by a host with lcp_len byte event headers */
+void wext_stream_init(wext_stream_t *stream, const void *buf, int length, int lcp_len, int we_version)
+{
+    stream->current = buf;
+    stream->end = stream->current + length;
+    stream->lcp_len = lcp_len;
+    stream->we_version = we_version;
+}
+
+/*
+ * Steps to the next event without decoding its payload, so events the caller
+ * isn't interested in cost only a header read. Returns 1 with event filled in,
+ * 0 at the end of the stream, or -1 if the stream is malformed.
+ */
+int wext_stream_next(wext_stream_t *stream, wext_event_t *event)
+{
+    uint16_t header[2];     /* len, cmd */
+
+    if(stream->current + stream->lcp_len > stream->end)
+        return 0;
+
+    /* Events are packed back to back, so the header may not be aligned */
+    memcpy(header, stream->current, sizeof(header));
+    if((header[0] < stream->lcp_len) || (stream->current + header[0] > stream->end))
+        return -1;
+
+    event->cmd = header[1];
+    event->data = stream->current + stream->lcp_len;
+    event->length = header[0] - stream->lcp_len;
+    stream->current += header[0];
+
+    return 1;
+}
+
+/*
+ * Finds the data of a point event (ESSID, CUSTOM, GENIE...). The length and
+ * flags follow the header, preceded by space for the pointer up to WE-18. The
+ * pointer is as wide as the event header, since both come from the host's
+ * alignment. Returns the data length with data set, or -1 if it doesn't fit.
+ */
+int wext_event_point(const wext_stream_t *stream, const wext_event_t *event, const unsigned char **data)
+{
+    int offset = (stream->we_version > 18) ? 0 : stream->lcp_len;
+    uint16_t length;
+
+    if(offset + stream->lcp_len > event->length)
+        return -1;
+    memcpy(&length, event->data + offset, sizeof(length));
+
+    /* Data starts after the length and flags, padded out to the pointer size */
+    offset += stream->lcp_len;
+    if(length > event->length - offset)
+        length = event->length - offset;
+    *data = event->data + offset;
+
+    return length;
+}
+
+/* Any socket will do, the kernel routes wireless ioctls by interface name */
+int wext_open(void)
+{
+    int skfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(skfd < 0)
+        skfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    return skfd;
+}
+
+int wext_ioctl(int skfd, const char *ifname, int request, struct iwreq *wrq)
+{
+    strncpy(wrq->ifr_name, ifname, IFNAMSIZ);
+    return ioctl(skfd, request, wrq);
+}
+
+/*
+ * Reads the driver's range info. Drivers older than WE-16 lay the struct out
+ * differently; only the version fields are kept for those. Returns 0, or -1 on
+ * error.
+ */
+int wext_get_range(int skfd, const char *ifname, struct iw_range *range)
+{
+    char buf[sizeof(struct iw_range) * 2];     /* Room for drivers newer than these headers */
+    struct iwreq wrq;
+
+    memset(buf, 0, sizeof(buf));
+    wrq.u.data.pointer = buf;
+    wrq.u.data.length = sizeof(buf);
+    wrq.u.data.flags = 0;
+    if(wext_ioctl(skfd, ifname, SIOCGIWRANGE, &wrq) < 0)
+        return -1;
+    if(wrq.u.data.length < RANGE_MIN_LENGTH)
+        return -1;
+
+    memcpy(range, buf, sizeof(*range));
+    if(range->we_version_compiled < 16)
+    {
+        uint8_t compiled = range->we_version_compiled, source = range->we_version_source;
+        memset(range, 0, sizeof(*range));
+        range->we_version_compiled = compiled;
+        range->we_version_source = source;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,49 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WIFI_WEXT_H
+#define WIFI_WEXT_H
+
+#include <sys/socket.h>
+#include <linux/wireless.h>
+
+/* An event is a view into the caller's scan buffer - nothing is copied */
+typedef struct
+{
+    int cmd;                        /* SIOCGIWAP, IWEVQUAL, ... */
+    const unsigned char *data;      /* Payload, just past the event header. Not aligned */
+    int length;                     /* Payload length */
+} wext_event_t;
+
+typedef struct
+{
+    const unsigned char *current;
+    const unsigned char *end;
+    int lcp_len;                    /* Event header length of the host that produced the stream */
+    int we_version;                 /* Point events carried pointer space up to WE-18 */
+} wext_stream_t;
+
+/* Wireless Extensions spoken directly (no iwlib) */
+void wext_stream_init(wext_stream_t *stream, const void *buf, int length, int lcp_len, int we_version);
+int wext_stream_next(wext_stream_t *stream, wext_event_t *event);
+int wext_event_point(const wext_stream_t *stream, const wext_event_t *event, const unsigned char **data);
+int wext_open(void);
+int wext_ioctl(int skfd, const char *ifname, int request, struct iwreq *wrq);
+int wext_get_range(int skfd, const char *ifname, struct iw_range *range);
+
+#endif
+
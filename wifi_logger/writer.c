@@ -0,0 +1,423 @@
+/*
+ *  Log file writer that batches output in RAM, or writes into a preallocated mapping, and syncs it from a thread of its own
+ *
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "writer.h"
+#include "log.h"
+#include "monotonic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * The logger fills one batch while the flusher thread writes and syncs the
+ * other, so a slow flash write never holds up logging unless a whole batch
+ * fills in the meantime (counted as a stall). Syncing a batch at a time
+ * rather than every record keeps flash writes few and large.
+ *
+ * With a preallocated file the records are copied straight into a shared
+ * mapping of it instead, and the committed length in the file's prefix is
+ * moved past each one, so logging makes no system calls at all. The flusher
+ * then only msyncs, on the same flush policy.
+ */
+static void *flusher(void *arg);
+static int write_all(const unsigned char *data, int length);
+static int map_open(const char *file, int size);
+static int map_write(const void *data, int length);
+static uint32_t le32(uint32_t value);
+
+static int fd = -1;
+static bool trailer;
+static int flush_size;
+static unsigned char *batch[2];
+static int batch_length[2];
+static int active;                  /* Batch being filled by the logger */
+static int64_t oldest;              /* When the first byte went into the active batch, 0 if empty */
+static uint32_t sequence;
+
+/* Preallocated output, NULL when writing batches */
+static unsigned char *map;
+static uint32_t map_size;           /* Whole file, prefix included */
+static uint32_t committed;          /* Bytes of log in the map */
+static uint32_t synced;             /* committed when the last sync was asked for */
+static bool full;
+
+/* Shared with the flusher, under lock */
+static pthread_t flusher_tid;
+static bool flusher_started;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static int pending = -1;            /* Batch handed to the flusher, -1 if none */
+static uint32_t sync_length;        /* How much of the map the flusher is to sync */
+static uint32_t flushed;            /* How much of the map the flusher has synced */
+static bool closing;
+static writer_stats_t stats;
+
+/* Creates the file and starts the flusher. Returns 0, or -1 on error. */
+int writer_open(const writer_config_t *config)
+{
+    int i;
+    
+    trailer = config->trailer;
+    flush_size = (config->flush_size > 0) ? config->flush_size : 1;
+    active = 0;
+    oldest = 0;
+    sequence = 0;
+    pending = -1;
+    closing = false;
+    committed = synced = flushed = 0;
+    full = false;
+    
+    if(config->preallocate > 0)
+    {
+        if(map_open(config->file, config->preallocate) < 0)
+        {
+            writer_close();
+            return -1;
+        }
+    }
+    else for(i = 0; i < 2; i++)
+    {
+        /* A batch can overshoot flush_size by one write, plus its trailer */
+        batch[i] = malloc(flush_size + WRITER_MAX_WRITE + LOG_TRAILER_LENGTH);
+        batch_length[i] = 0;
+        if(batch[i] == NULL)
+        {
+            printf("Failed to allocate %d byte log batches\n", flush_size);
+            writer_close();
+            return -1;
+        }
+    }
+    
+    if(map == NULL)
+        fd = open(config->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        printf("Failed to create %s logfile\n", config->file);
+        writer_close();
+        return -1;
+    }
+    
+    if(pthread_create(&flusher_tid, NULL, flusher, NULL) != 0)
+    {
+        printf("Failed to start the log flusher\n");
+        writer_close();
+        return -1;
+    }
+    flusher_started = true;
+    
+    return 0;
+}
+
+/* Writes out whatever is still batched, waits for it to be synced and closes the file */
+void writer_close(void)
+{
+    int i;
+    
+    if(flusher_started)
+    {
+        writer_flush();
+        if(map)
+        {
+            /* Catch what was written while a sync was still running */
+            pthread_mutex_lock(&lock);
+            while(pending >= 0)
+                pthread_cond_wait(&done, &lock);
+            pthread_mutex_unlock(&lock);
+            writer_flush();
+        }
+        pthread_mutex_lock(&lock);
+        closing = true;
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+        pthread_join(flusher_tid, NULL);
+        flusher_started = false;
+    }
+    if(map)
+    {
+        /* The rest of the preallocation was never used, so give it back */
+        munmap(map, map_size);
+        map = NULL;
+        if(ftruncate(fd, LOG_MAP_HEADER + committed) < 0)
+            printf("Failed to trim the log file: %s\n", strerror(errno));
+    }
+    if(fd >= 0)
+        close(fd);
+    fd = -1;
+    for(i = 0; i < 2; i++)
+    {
+        free(batch[i]);
+        batch[i] = NULL;
+    }
+}
+
+/* Adds data to the active batch, handing the batch to the flusher once it reaches flush_size. Returns 0, or -1 on error. */
+int writer_write(const void *data, int length)
+{
+    if(length > WRITER_MAX_WRITE)
+        return -1;
+    if(map)
+        return map_write(data, length);
+    
+    if(batch_length[active] == 0)
+        oldest = monotonic_ms();
+    memcpy(batch[active] + batch_length[active], data, length);
+    batch_length[active] += length;
+    
+    if(batch_length[active] >= flush_size)
+        return writer_flush();
+    return 0;
+}
+
+/* 
+ * Hands the active batch to the flusher and starts filling the other, waiting
+ * first if the other is still being written. A mapped file is instead synced
+ * up to what has been written so far, unless a sync is already running, when
+ * it's left for the next call rather than holding up the logger. Returns 0,
+ * or -1 if an earlier write or sync failed.
+ */
+int writer_flush(void)
+{
+    int length = batch_length[active];
+    unsigned long errors;
+    
+    if(map)
+    {
+        if(committed == synced)
+            return 0;
+        pthread_mutex_lock(&lock);
+        if(pending < 0)
+        {
+            pending = 0;
+            sync_length = synced = committed;
+            oldest = 0;
+            pthread_cond_signal(&work);
+        }
+        errors = stats.errors;
+        pthread_mutex_unlock(&lock);
+        return errors ? -1 : 0;
+    }
+    
+    if(length == 0)
+        return 0;
+    
+    /* The trailer commits the batch: its length, checksum and place in sequence */
+    if(trailer)
+    {
+        unsigned char *p = batch[active] + length;
+        uint32_t words[4];
+        int i, j;
+        
+        words[0] = LOG_TRAILER_MAGIC;
+        words[1] = length;
+        words[2] = log_crc32(batch[active], length);
+        words[3] = sequence++;
+        for(i = 0; i < 4; i++)
+        {
+            for(j = 0; j < 4; j++)
+                *p++ = words[i] >> (8 * j);
+        }
+        batch_length[active] += LOG_TRAILER_LENGTH;
+    }
+    
+    pthread_mutex_lock(&lock);
+    if(pending >= 0)
+    {
+        stats.stalls++;
+        while(pending >= 0)
+            pthread_cond_wait(&done, &lock);
+    }
+    pending = active;
+    errors = stats.errors;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    
+    active ^= 1;
+    batch_length[active] = 0;
+    oldest = 0;
+    
+    return errors ? -1 : 0;
+}
+
+/* When the oldest unwritten data was batched (monotonic ms), or 0 if there is none */
+int64_t writer_oldest(void)
+{
+    return oldest;
+}
+
+void writer_get_stats(writer_stats_t *s)
+{
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+static void *flusher(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    while(1)
+    {
+        int b, result, latency, error, bytes;
+        int64_t start;
+        
+        while((pending < 0) && !closing)
+            pthread_cond_wait(&work, &lock);
+        if(pending < 0)
+            break;
+        b = pending;
+        bytes = map ? (int)(sync_length - flushed) : batch_length[b];
+        pthread_mutex_unlock(&lock);
+        
+        start = monotonic_ms();
+        if(map)
+        {
+            /* Only dirty pages are written, so syncing from the start costs nothing extra */
+            result = msync(map, LOG_MAP_HEADER + sync_length, MS_SYNC);
+        }
+        else
+        {
+            result = write_all(batch[b], batch_length[b]);
+            if((result == 0) && (fdatasync(fd) < 0))
+                result = -1;
+        }
+        error = errno;
+        latency = monotonic_ms() - start;
+        
+        pthread_mutex_lock(&lock);
+        if(result < 0)
+        {
+            /* Once is enough, a full or failing flash would otherwise flood the console */
+            if(stats.errors++ == 0)
+                printf("Log write failed: %s\n", strerror(error));
+        }
+        else
+        {
+            stats.bytes += bytes;
+            if(map)
+                flushed = sync_length;
+        }
+        stats.flushes++;
+        stats.latency_total += latency;
+        if(latency > stats.latency_max)
+            stats.latency_max = latency;
+        pending = -1;
+        pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&lock);
+    
+    return NULL;
+}
+
+static int write_all(const unsigned char *data, int length)
+{
+    while(length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* 
+ * Creates the file at its full size and maps it, writing the prefix. The
+ * blocks are reserved up front so logging never waits on the filesystem
+ * finding space; one that can't reserve them (eg jffs2) gets a sparse file.
+ * Returns 0, or -1 on error.
+ */
+static int map_open(const char *file, int size)
+{
+    if(size < LOG_MAP_HEADER + WRITER_MAX_WRITE)
+        size = LOG_MAP_HEADER + WRITER_MAX_WRITE;
+    
+    fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        printf("Failed to create %s logfile\n", file);
+        return -1;
+    }
+    if((posix_fallocate(fd, 0, size) != 0) && (ftruncate(fd, size) < 0))
+    {
+        printf("Failed to preallocate %d bytes for %s\n", size, file);
+        return -1;
+    }
+    
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        printf("Failed to map %s: %s\n", file, strerror(errno));
+        map = NULL;
+        return -1;
+    }
+    map_size = size;
+    
+    memset(map, 0, LOG_MAP_HEADER);
+    *(uint32_t *)map = le32(LOG_MAP_MAGIC);
+    *(uint32_t *)(map + 8) = le32(map_size);
+    
+    return 0;
+}
+
+/* 
+ * Copies data into the map, then commits it by moving the length in the
+ * prefix past it in a single aligned store. A crash of the logger can then
+ * lose at most the record being copied. Returns 0, or -1 once the file fills.
+ */
+static int map_write(const void *data, int length)
+{
+    if(committed + length > map_size - LOG_MAP_HEADER)
+    {
+        if(!full)
+            printf("Log file full at %u bytes, raise [LOG] Preallocate\n", map_size);
+        full = true;
+        return -1;
+    }
+    
+    if(oldest == 0)
+        oldest = monotonic_ms();
+    memcpy(map + LOG_MAP_HEADER + committed, data, length);
+    committed += length;
+    __sync_synchronize();
+    *(volatile uint32_t *)(map + 4) = le32(committed);
+    
+    if(committed - synced >= (uint32_t)flush_size)
+        return writer_flush();
+    return 0;
+}
+
+/* value arranged so that storing it as a word lays it out little endian, as the file format wants */
+static uint32_t le32(uint32_t value)
+{
+    unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2012, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define WRITER_MAX_WRITE    16384   /* Largest single writer_write */
+
+typedef struct
+{
+    const char *file;
+    int flush_size;         /* Bytes gathered in RAM before they're written and synced */
+    bool trailer;           /* Follow each batch with a commit trailer (see log.h) */
+    int preallocate;        /* Bytes to create the file with and map, or 0 to write batches */
+} writer_config_t;
+
+/* Counted across every file the process writes, eg each segment of a log */
+typedef struct
+{
+    unsigned long long bytes;       /* Written to the file, trailers included */
+    unsigned long flushes;          /* Batches written with an fdatasync each, or msyncs of a mapped file */
+    unsigned long stalls;           /* Times the logger had to wait for the previous batch to be synced */
+    unsigned long errors;           /* Failed writes or syncs */
+    int64_t latency_total;          /* ms spent writing and syncing */
+    int latency_max;
+} writer_stats_t;
+
+int writer_open(const writer_config_t *config);
+void writer_close(void);
+int writer_write(const void *data, int length);
+int writer_flush(void);
+int64_t writer_oldest(void);
+void writer_get_stats(writer_stats_t *stats);
+
+#endif
+